@@ -0,0 +1,164 @@
+/**
+ * Launch settings benchmark.
+ *
+ * Runs generated scripts through the shell binary and reports:
+ *  - commands per second for /bin/true started plainly and through
+ *    "on nice=0", with each spawn backend. posix_spawn cannot apply launch
+ *    settings, so that case shows what falling back to fork costs.
+ *  - the wall time of one memory-bound background job per core, left to
+ *    the scheduler and placed with "set affinity roundrobin". Each job is
+ *    this binary run as a worker that sweeps a buffer larger than a core's
+ *    cache.
+ *
+ * Usage: affinity-bench [path to simple-shell] [commands] [worker MB]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#define DEFAULT_COMMANDS	2000
+#define DEFAULT_WORKER_MB	64
+#define WORKER_SWEEPS		20 /* Passes each worker makes over its buffer */
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in seconds
+//*****************************************************************************
+static double now_sec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//*****************************************************************************
+// Abstract: The background job: reads and writes a buffer of size_mb
+// megabytes WORKER_SWEEPS times
+//*****************************************************************************
+static int run_worker(int size_mb)
+{
+	size_t count = (size_t)size_mb * 1024 * 1024 / sizeof(long);
+	long *buffer = (long*)malloc(count * sizeof(long)), sum = 0;
+	size_t i;
+	int sweep;
+
+	for (i = 0; i < count; i++)
+	{
+		buffer[i] = i;
+	}
+
+	for (sweep = 0; sweep < WORKER_SWEEPS; sweep++)
+	{
+		for (i = 0; i < count; i++)
+		{
+			sum += buffer[i];
+			buffer[i] = sum;
+		}
+	}
+
+	free(buffer);
+	return sum == 42;
+}
+
+//*****************************************************************************
+// Abstract: Runs "simple-shell script" with its output going to /dev/null
+// and returns the elapsed seconds
+//*****************************************************************************
+static double run_shell(const char *shell, const char *script)
+{
+	double start = now_sec();
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(shell, shell, script, (char*)NULL);
+		_exit(127);
+	}
+
+	waitpid(pid, NULL, 0);
+	return now_sec() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *backends[] = { "posix", "fork", "server" };
+	const char *shell = (argc > 1) ? argv[1] : "./simple-shell";
+	int commands = (argc > 2) ? atoi(argv[2]) : DEFAULT_COMMANDS;
+	int worker_mb = (argc > 3) ? atoi(argv[3]) : DEFAULT_WORKER_MB;
+	char home[] = "/tmp/affinity-bench-XXXXXX";
+	char script[64], self[4096];
+	size_t b;
+	int i, settings;
+
+	if (argc == 3 && 0 == strcmp(argv[1], "--worker"))
+	{
+		return run_worker(atoi(argv[2]));
+	}
+
+	//Keep the runs out of the user's history
+	if (mkdtemp(home) == NULL || realpath(argv[0], self) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", home, 1);
+	snprintf(script, sizeof(script), "%s/script.osh", home);
+
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+	{
+		double elapsed[2];
+
+		for (settings = 0; settings <= 1; settings++)
+		{
+			FILE *out = fopen(script, "w");
+			fprintf(out, "set spawn %s\n", backends[b]);
+			for (i = 0; i < commands; i++)
+			{
+				fputs(settings ? "on nice=0 /bin/true\n" : "/bin/true\n", out);
+			}
+			fclose(out);
+
+			elapsed[settings] = run_shell(shell, script);
+		}
+
+		printf("spawn %-7s plain %8.0f cmds/s   on nice=0 %8.0f cmds/s   (%.2fx)\n", backends[b],
+			commands / elapsed[0], commands / elapsed[1], elapsed[1] / elapsed[0]);
+	}
+
+	cpu_set_t cpus;
+	sched_getaffinity(0, sizeof(cpus), &cpus);
+	int jobs = CPU_COUNT(&cpus);
+
+	for (settings = 0; settings <= 1; settings++)
+	{
+		FILE *out = fopen(script, "w");
+		fputs(settings ? "set affinity roundrobin\n" : "set affinity off\n", out);
+		for (i = 0; i < jobs; i++)
+		{
+			fprintf(out, "%s --worker %d &\n", self, worker_mb);
+		}
+		fputs("wait\n", out);
+		fclose(out);
+
+		double elapsed = run_shell(shell, script);
+		printf("%-10s %d jobs x %d MB x %d sweeps  %8.3f s\n", settings ? "roundrobin" : "unpinned",
+			jobs, worker_mb, WORKER_SWEEPS, elapsed);
+	}
+
+	unlink(script);
+	snprintf(script, sizeof(script), "%s/.cs543_history", home);
+	unlink(script);
+	snprintf(script, sizeof(script), "%s/.cs543_history.idx", home);
+	unlink(script);
+	rmdir(home);
+
+	return 0;
+}
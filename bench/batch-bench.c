@@ -0,0 +1,135 @@
+/**
+ * Batch mode benchmark.
+ *
+ * Runs the same generated script through the shell binary twice: once as
+ * "simple-shell script.osh" (batch mode, no prompt) and once piped into
+ * stdin (interactive mode, prompt and flush on every line). Reports
+ * commands per second for a script of builtins and for a script of
+ * external commands.
+ *
+ * Usage: batch-bench [path to simple-shell] [builtin lines]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_LINES		200000
+#define EXTERNAL_DIVISOR	200 /* External scripts are this much shorter */
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in seconds
+//*****************************************************************************
+static double now_sec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//*****************************************************************************
+// Abstract: Writes a script of lines commands to file_name, either cheap
+// builtins or /bin/true
+//*****************************************************************************
+static void write_script(const char *file_name, int lines, int external)
+{
+	FILE *script = fopen(file_name, "w");
+	int i;
+
+	for (i = 0; i < lines; i++)
+	{
+		if (external)
+		{
+			fputs("/bin/true\n", script);
+		}
+		else
+		{
+			switch (i % 3)
+			{
+				case 0: fputs("set verbose off\n", script); break;
+				case 1: fputs("alias ll \"ls -l\"\n", script); break;
+				default: fputs("jobs\n", script); break;
+			}
+		}
+	}
+
+	fclose(script);
+}
+
+//*****************************************************************************
+// Abstract: Runs the shell on the script, as an argument in batch mode or on
+// stdin otherwise, with its output going to /dev/null. Returns the elapsed
+// seconds.
+//*****************************************************************************
+static double run_shell(const char *shell, const char *script, int batch)
+{
+	double start = now_sec();
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+
+		if (batch)
+		{
+			execl(shell, shell, script, (char*)NULL);
+		}
+		else
+		{
+			int script_fd = open(script, O_RDONLY);
+			dup2(script_fd, STDIN_FILENO);
+			execl(shell, shell, (char*)NULL);
+		}
+		_exit(127);
+	}
+
+	waitpid(pid, NULL, 0);
+	return now_sec() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *shell = (argc > 1) ? argv[1] : "./simple-shell";
+	int lines = (argc > 2) ? atoi(argv[2]) : DEFAULT_LINES;
+	char home[] = "/tmp/batch-bench-XXXXXX";
+	char script[64];
+	int external;
+
+	//Keep the interactive runs out of the user's history
+	if (mkdtemp(home) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", home, 1);
+	snprintf(script, sizeof(script), "%s/script.osh", home);
+
+	for (external = 0; external <= 1; external++)
+	{
+		int count = external ? lines / EXTERNAL_DIVISOR : lines;
+
+		write_script(script, count, external);
+
+		double batch = run_shell(shell, script, 1);
+		double interactive = run_shell(shell, script, 0);
+
+		printf("%-9s  batch %10.0f cmds/s   interactive %10.0f cmds/s   (%d lines, %.2fx)\n",
+			external ? "external" : "builtins", count / batch, count / interactive, count,
+			interactive / batch);
+	}
+
+	unlink(script);
+	snprintf(script, sizeof(script), "%s/.cs543_history", home);
+	unlink(script);
+	snprintf(script, sizeof(script), "%s/.cs543_history.idx", home);
+	unlink(script);
+	rmdir(home);
+
+	return 0;
+}
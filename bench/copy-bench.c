@@ -0,0 +1,148 @@
+/**
+ * Redirection throughput benchmark.
+ *
+ * Creates a large file and copies it through the shell binary twice: with
+ * the copy builtin, which moves the data inside the kernel, and with
+ * "cat < in > out", which goes through a child process and user space.
+ * Reports the best GB/s of a few runs for each.
+ *
+ * Usage: copy-bench [path to simple-shell] [file size in MB]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_SIZE_MB	2048
+#define CHUNK_SIZE		(1 << 20)
+#define RUNS			3 /* The best of this many runs is reported */
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in seconds
+//*****************************************************************************
+static double now_sec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//*****************************************************************************
+// Abstract: Writes size_mb megabytes of non-repeating text to file_name
+//*****************************************************************************
+static int write_input(const char *file_name, int size_mb)
+{
+	char *chunk = (char*)malloc(CHUNK_SIZE);
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int i, j;
+
+	if (fd < 0)
+	{
+		perror(file_name);
+		return -1;
+	}
+
+	for (i = 0; i < size_mb; i++)
+	{
+		for (j = 0; j < CHUNK_SIZE; j++)
+		{
+			chunk[j] = 'a' + (i + j) % 26;
+		}
+
+		if (write(fd, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+		{
+			perror(file_name);
+			close(fd);
+			return -1;
+		}
+	}
+
+	//Keep writeback of the input out of the first measurement
+	fsync(fd);
+	close(fd);
+	free(chunk);
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Runs "simple-shell -c command" and returns the elapsed seconds
+//*****************************************************************************
+static double run_shell(const char *shell, const char *command)
+{
+	double start = now_sec();
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		execl(shell, shell, "-c", command, (char*)NULL);
+		_exit(127);
+	}
+
+	waitpid(pid, NULL, 0);
+	return now_sec() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *commands[] = { "copy in out", "cat < in > out" };
+	char shell[4096];
+	int size_mb = (argc > 2) ? atoi(argv[2]) : DEFAULT_SIZE_MB;
+	char home[] = "/tmp/copy-bench-XXXXXX";
+	size_t c;
+	int run;
+
+	//The shell is started from inside the scratch directory
+	if (realpath((argc > 1) ? argv[1] : "./simple-shell", shell) == NULL)
+	{
+		perror("simple-shell");
+		return 1;
+	}
+
+	if (mkdtemp(home) == NULL || 0 != chdir(home))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", home, 1);
+
+	if (0 != write_input("in", size_mb))
+	{
+		return 1;
+	}
+
+	for (c = 0; c < sizeof(commands) / sizeof(commands[0]); c++)
+	{
+		double elapsed = 0;
+
+		for (run = 0; run < RUNS; run++)
+		{
+			unlink("out");
+			sync();
+
+			double this_run = run_shell(shell, commands[c]);
+			if (run == 0 || this_run < elapsed)
+			{
+				elapsed = this_run;
+			}
+		}
+
+		printf("%-16s %8.2f GB/s   (%d MB in %.3f s)\n", commands[c],
+			size_mb / 1024.0 / elapsed, size_mb, elapsed);
+	}
+
+	unlink("in");
+	unlink("out");
+	unlink(".cs543_history");
+	unlink(".cs543_history.idx");
+	if (0 != chdir("/") || 0 != rmdir(home))
+	{
+		perror(home);
+	}
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Builtin dispatch benchmark.
+ *
+ * Counts how many lines per second go through the builtin lookup, and for
+ * reference through the regex and strcmp chain the shell used before.
+ *
+ * Usage: dispatch-bench [lines]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#include <time.h>
+
+#define DEFAULT_LINES	2000000
+
+static char *workload[] =
+{
+	"ls -l /tmp",
+	"grep -r pattern src include docs",
+	"history",
+	"make -j8 all",
+	"set verbose off",
+	"alias ll \"ls -l\"",
+	"cat myscript.txt",
+	"hash",
+	"echo one two three four five six",
+	"git status",
+};
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in seconds
+//*****************************************************************************
+static double now_sec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	int line_count = (argc > 1) ? atoi(argv[1]) : DEFAULT_LINES;
+	int workload_size = sizeof(workload) / sizeof(workload[0]);
+	regex_t verbose_regex, script_regex, history_regex;
+	volatile int matches = 0;
+	double start, elapsed;
+	int i;
+
+	init_builtins();
+	regcomp(&g_path_regex, "set path = ([0-9a-zA-Z/_. )]", 0);
+	regcomp(&verbose_regex, "set verbose ", 0);
+	regcomp(&script_regex, "script", 0);
+	regcomp(&history_regex, "![!|0-9]", 0);
+
+	start = now_sec();
+	for (i = 0; i < line_count; i++)
+	{
+		if (find_builtin(workload[i % workload_size]) != NULL)
+		{
+			matches++;
+		}
+	}
+	elapsed = now_sec() - start;
+	printf("builtin table  %12.0f lines/s\n", line_count / elapsed);
+
+	start = now_sec();
+	for (i = 0; i < line_count; i++)
+	{
+		const char *line = workload[i % workload_size];
+
+		if (0 == regexec(&verbose_regex, line, 0, NULL, 0)
+			|| 0 == regexec(&g_path_regex, line, 0, NULL, 0)
+			|| 0 == strcmp(line, "endscript")
+			|| 0 == regexec(&script_regex, line, 0, NULL, 0)
+			|| 0 == regexec(&history_regex, line, 0, NULL, 0)
+			|| 0 == strncmp(line, "alias", 5)
+			|| 0 == strcmp(line, "history")
+			|| 0 == strncmp(line, "exit", 4))
+		{
+			matches++;
+		}
+	}
+	elapsed = now_sec() - start;
+	printf("regex chain    %12.0f lines/s\n", line_count / elapsed);
+
+	return 0;
+}
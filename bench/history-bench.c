@@ -0,0 +1,203 @@
+/**
+ * History search benchmark.
+ *
+ * Writes a history of a million generated commands, builds the trigram
+ * search index over it and replays ^R searches a keystroke at a time: each
+ * query is typed one character more per search, as a user types it.
+ * Reports per keystroke latency percentiles for the index and for a
+ * backwards scan of the log, for queries taken from old commands, for
+ * queries that match nothing and for prefix searches, along with the index
+ * build time and size.
+ *
+ * Usage: history-bench [entries] [queries]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#define DEFAULT_ENTRIES		1000000
+#define DEFAULT_QUERIES		200
+#define SCAN_QUERIES		20 /* The scan is slow, it gets fewer queries */
+#define QUERY_LENGTH		12
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in microseconds
+//*****************************************************************************
+static double now_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+//*****************************************************************************
+// Abstract: qsort comparison for doubles
+//*****************************************************************************
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+//*****************************************************************************
+// Abstract: Search without the index: the newest entry holding the query,
+// found by scanning back through the log
+//*****************************************************************************
+static long scan_history(const char *query, size_t length, int prefix)
+{
+	size_t entry_length;
+	long entry;
+
+	for (entry = history_count() - 1; entry >= 0; entry--)
+	{
+		const char *text = history_entry(entry, &entry_length);
+
+		if (prefix ? (entry_length >= length && 0 == memcmp(text, query, length))
+			: (memmem(text, entry_length, query, length) != NULL))
+		{
+			return entry;
+		}
+	}
+
+	return -1;
+}
+
+//*****************************************************************************
+// Abstract: Writes entry_count generated commands straight into a history
+// log and index, as the shell would have appended them
+//*****************************************************************************
+static void write_history(const char *file_name, int entry_count)
+{
+	static const char *formats[] =
+	{
+		"git commit -m 'fix issue %d in module %d'",
+		"kubectl get pods -n team%d --selector=app=svc%d",
+		"ssh deploy@host%d.dc%d.example.com",
+		"make -j%d target%d",
+		"cd /srv/app%d/releases/%d",
+		"grep -rn error_%d /var/log/service%d",
+		"tail -f /var/log/app%d/worker%d.log",
+		"docker run --rm -it image%d:%d",
+	};
+	char index_name[PATH_MAX], line[256];
+	FILE *log = fopen(file_name, "w");
+	uint64_t offset = 0;
+	int i;
+
+	snprintf(index_name, sizeof(index_name), "%s.idx", file_name);
+	FILE *index = fopen(index_name, "w");
+
+	struct history_header header;
+	memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+	header.first_event = 1;
+	fwrite(&header, sizeof(header), 1, index);
+
+	srand(543);
+	for (i = 0; i < entry_count; i++)
+	{
+		int length = snprintf(line, sizeof(line), formats[rand() % 8], rand() % 5000, rand() % 100);
+
+		fwrite(&offset, sizeof(offset), 1, index);
+		fprintf(log, "%s\n", line);
+		offset += length + 1;
+	}
+
+	fclose(log);
+	fclose(index);
+}
+
+//*****************************************************************************
+// Abstract: Types each query a character at a time, searching after every
+// keystroke, and prints the latency percentiles
+//*****************************************************************************
+static void measure(const char *label, char queries[][QUERY_LENGTH + 1], int query_count, int prefix, int use_index)
+{
+	double *samples = (double*)malloc((size_t)query_count * QUERY_LENGTH * sizeof(double));
+	int count = 0, found = 0, q, k;
+
+	for (q = 0; q < query_count; q++)
+	{
+		long entry = -1;
+
+		for (k = 1; k <= QUERY_LENGTH; k++)
+		{
+			double start = now_usec();
+			entry = use_index ? search_history(queries[q], k, LONG_MAX, prefix) : scan_history(queries[q], k, prefix);
+			samples[count++] = now_usec() - start;
+		}
+		found += (entry >= 0);
+	}
+
+	qsort(samples, count, sizeof(double), compare_doubles);
+	printf("  %-20s %-6s p50 %9.2f us  p90 %9.2f us  p99 %9.2f us  max %9.2f us  (%d/%d found)\n",
+		label, use_index ? "index" : "scan", samples[count / 2], samples[count * 90 / 100],
+		samples[count * 99 / 100], samples[count - 1], found, query_count);
+
+	free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+	int entry_count = (argc > 1) ? atoi(argv[1]) : DEFAULT_ENTRIES;
+	int query_count = (argc > 2) ? atoi(argv[2]) : DEFAULT_QUERIES;
+	char home[] = "/tmp/history-bench-XXXXXX";
+	char file_name[64];
+	size_t length, i;
+	int q;
+
+	if (mkdtemp(home) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	snprintf(file_name, sizeof(file_name), "%s/.cs543_history", home);
+	write_history(file_name, entry_count);
+	history_open(file_name);
+
+	double start = now_usec();
+	history_index_catch_up(-1);
+	double build_usec = now_usec() - start;
+
+	size_t index_bytes = g_history_search.capacity * sizeof(struct trigram_postings);
+	for (i = 0; i < g_history_search.capacity; i++)
+	{
+		index_bytes += g_history_search.slots[i].capacity;
+	}
+	printf("%ld entries (%zu MB of log): index built in %.0f ms, %zu trigrams, %.1f MB\n",
+		history_count(), g_history.log_size >> 20, build_usec / 1e3, g_history_search.used, index_bytes / 1048576.0);
+
+	//Substrings of old commands, nothing, and the starts of old commands
+	char (*found)[QUERY_LENGTH + 1] = malloc((size_t)query_count * (QUERY_LENGTH + 1));
+	char (*missing)[QUERY_LENGTH + 1] = malloc((size_t)query_count * (QUERY_LENGTH + 1));
+	char (*prefixes)[QUERY_LENGTH + 1] = malloc((size_t)query_count * (QUERY_LENGTH + 1));
+
+	srand(1);
+	for (q = 0; q < query_count; q++)
+	{
+		long entry = rand() % (history_count() / 2);
+		const char *text = history_entry(entry, &length);
+		size_t offset = rand() % (length - QUERY_LENGTH);
+
+		memcpy(found[q], &text[offset], QUERY_LENGTH);
+		found[q][QUERY_LENGTH] = '\0';
+		memcpy(prefixes[q], text, QUERY_LENGTH);
+		prefixes[q][QUERY_LENGTH] = '\0';
+		snprintf(missing[q], QUERY_LENGTH + 1, "zq%010d", rand());
+	}
+
+	measure("substring", found, query_count, 0, 1);
+	measure("substring", found, SCAN_QUERIES, 0, 0);
+	measure("no match", missing, query_count, 0, 1);
+	measure("no match", missing, SCAN_QUERIES, 0, 0);
+	measure("prefix", prefixes, query_count, 1, 1);
+	measure("prefix", prefixes, SCAN_QUERIES, 1, 0);
+
+	clear_history_index();
+	unlink(file_name);
+	strcat(file_name, ".idx");
+	unlink(file_name);
+	rmdir(home);
+
+	return 0;
+}
@@ -0,0 +1,274 @@
+/**
+ * PATH lookup benchmark.
+ *
+ * Builds a scratch PATH of many directories holding many executables, as
+ * toolchain hosts have them, and times command lookups that hit the last
+ * directory and lookups that miss, with the stat walk the shell used before
+ * and with the PATH index. Completion of a prefix is timed with readdir on
+ * every directory and with the index. Also reports how long the index takes
+ * to build, to follow a PATH with one directory swapped and to pick up a
+ * new executable.
+ *
+ * Usage: path-bench [directories] [executables] [lookups]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#define DEFAULT_DIRS		50
+#define DEFAULT_EXECUTABLES	100000
+#define DEFAULT_LOOKUPS		20000
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in microseconds
+//*****************************************************************************
+static double now_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+//*****************************************************************************
+// Abstract: The PATH search the shell did before the index, one stat per
+// directory
+//*****************************************************************************
+static char* search_path_stat(const char *command)
+{
+	const char *path = getenv("PATH");
+	size_t command_length = strlen(command);
+	struct stat file_stat;
+
+	while (1)
+	{
+		const char *end = strchr(path, ':');
+		size_t dir_length = (end == NULL) ? strlen(path) : (size_t)(end - path);
+		char *candidate = (char*)malloc(dir_length + command_length + 2);
+
+		memcpy(candidate, path, dir_length);
+		candidate[dir_length] = '/';
+		memcpy(&candidate[dir_length + 1], command, command_length + 1);
+
+		if (0 == stat(candidate, &file_stat) && S_ISREG(file_stat.st_mode)
+			&& 0 == access(candidate, X_OK))
+		{
+			return candidate;
+		}
+
+		free(candidate);
+
+		if (end == NULL)
+		{
+			return NULL;
+		}
+		path = end + 1;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Completion without the index: reads every PATH directory and
+// counts the names starting with prefix
+//*****************************************************************************
+static int complete_with_readdir(const char *prefix)
+{
+	char *path = strdup(getenv("PATH")), *dir_path, *save = NULL;
+	size_t prefix_length = strlen(prefix);
+	int count = 0;
+
+	for (dir_path = strtok_r(path, ":", &save); dir_path != NULL; dir_path = strtok_r(NULL, ":", &save))
+	{
+		DIR *dir = opendir(dir_path);
+		struct dirent *entry;
+
+		if (dir == NULL)
+		{
+			continue;
+		}
+
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (0 == strncmp(entry->d_name, prefix, prefix_length))
+			{
+				count++;
+			}
+		}
+		closedir(dir);
+	}
+
+	free(path);
+	return count;
+}
+
+//*****************************************************************************
+// Abstract: Times lookups of command with both searches and prints the
+// microseconds per lookup
+//*****************************************************************************
+static void measure_lookup(const char *label, const char *command, int lookups)
+{
+	double start, stat_usec, index_usec;
+	int i;
+
+	start = now_usec();
+	for (i = 0; i < lookups; i++)
+	{
+		free(search_path_stat(command));
+	}
+	stat_usec = (now_usec() - start) / lookups;
+
+	start = now_usec();
+	for (i = 0; i < lookups; i++)
+	{
+		update_path_index();
+		free(search_path(command));
+	}
+	index_usec = (now_usec() - start) / lookups;
+
+	printf("  %-22s stat walk %9.2f us   index %7.2f us   %8.1fx\n", label, stat_usec, index_usec,
+		stat_usec / index_usec);
+}
+
+//*****************************************************************************
+// Abstract: Creates dir_count directories under root with executable_count
+// empty executables spread over them, and returns the matching PATH
+//*****************************************************************************
+static char* make_tree(const char *root, int dir_count, int executable_count)
+{
+	char *path = (char*)malloc((size_t)dir_count * (strlen(root) + 16));
+	char name[PATH_MAX];
+	int d, e;
+
+	path[0] = '\0';
+	for (d = 0; d < dir_count; d++)
+	{
+		snprintf(name, sizeof(name), "%s/bin%02d", root, d);
+		mkdir(name, 0755);
+		sprintf(&path[strlen(path)], "%s%s", d ? ":" : "", name);
+	}
+
+	//Every directory also has a cc, as toolchain directories shadow each other
+	for (e = 0; e < executable_count; e++)
+	{
+		d = e % dir_count;
+		if (e < dir_count)
+		{
+			snprintf(name, sizeof(name), "%s/bin%02d/cc", root, d);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "%s/bin%02d/d%02d-tool-%06d", root, d, d, e);
+		}
+		close(open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0755));
+	}
+
+	return path;
+}
+
+//*****************************************************************************
+// Abstract: Removes a scratch directory and the files in it
+//*****************************************************************************
+static void remove_dir(const char *dir_path)
+{
+	DIR *dir = opendir(dir_path);
+	struct dirent *entry;
+
+	while (dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_type != DT_DIR)
+		{
+			unlinkat(dirfd(dir), entry->d_name, 0);
+		}
+	}
+
+	if (dir != NULL)
+	{
+		closedir(dir);
+	}
+	rmdir(dir_path);
+}
+
+int main(int argc, char *argv[])
+{
+	int dir_count = (argc > 1) ? atoi(argv[1]) : DEFAULT_DIRS;
+	int executable_count = (argc > 2) ? atoi(argv[2]) : DEFAULT_EXECUTABLES;
+	int lookups = (argc > 3) ? atoi(argv[3]) : DEFAULT_LOOKUPS;
+	char root[] = "/tmp/path-bench-XXXXXX";
+	char name[PATH_MAX], command[64], prefix[64];
+	double start;
+	int count, i;
+
+	if (mkdtemp(root) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	printf("creating %d executables in %d directories\n", executable_count, dir_count);
+	char *path = make_tree(root, dir_count, executable_count);
+	setenv("PATH", path, 1);
+
+	start = now_usec();
+	update_path_index();
+	printf("  index build            %9.1f ms\n", (now_usec() - start) / 1e3);
+
+	//The first name that lives in the last directory
+	snprintf(command, sizeof(command), "d%02d-tool-%06d", dir_count - 1, 2 * dir_count - 1);
+	measure_lookup("hit, last directory", command, lookups);
+	measure_lookup("hit, first directory", "cc", lookups);
+	measure_lookup("miss", "no-such-command", lookups);
+
+	snprintf(prefix, sizeof(prefix), "d%02d-tool-0", dir_count - 1);
+	start = now_usec();
+	for (i = 0; i < 10; i++)
+	{
+		count = complete_with_readdir(prefix);
+	}
+	double readdir_usec = (now_usec() - start) / 10;
+
+	start = now_usec();
+	for (i = 0; i < 10; i++)
+	{
+		free(complete_command(prefix, &count));
+	}
+	double index_usec = (now_usec() - start) / 10;
+	printf("  complete \"%s\" (%d names) readdir %9.1f us   index %9.1f us   %6.1fx\n", prefix, count,
+		readdir_usec, index_usec, readdir_usec / index_usec);
+
+	//A new executable shows up through inotify, without a rebuild
+	snprintf(name, sizeof(name), "%s/bin00/fresh-tool", root);
+	close(open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0755));
+	start = now_usec();
+	update_path_index();
+	char *found = search_path("fresh-tool");
+	printf("  new executable         %9.1f us   %s\n", now_usec() - start, found ? "found" : "NOT FOUND");
+	free(found);
+
+	//Swapping one directory out of PATH only reads the new one
+	snprintf(name, sizeof(name), "%s/bin%02d", root, dir_count);
+	mkdir(name, 0755);
+	char *swapped = (char*)malloc(strlen(path) + 16);
+	sprintf(swapped, "%s:%s", strchr(path, ':') + 1, name);
+	setenv("PATH", swapped, 1);
+	start = now_usec();
+	update_path_index();
+	printf("  PATH with one swapped  %9.1f us\n", now_usec() - start);
+
+	clear_path_index();
+	start = now_usec();
+	update_path_index();
+	printf("  full rebuild           %9.1f us\n", now_usec() - start);
+	clear_path_index();
+
+	for (i = 0; i <= dir_count; i++)
+	{
+		snprintf(name, sizeof(name), "%s/bin%02d", root, i);
+		remove_dir(name);
+	}
+	if (0 != rmdir(root))
+	{
+		perror(root);
+	}
+
+	free(swapped);
+	free(path);
+	return 0;
+}
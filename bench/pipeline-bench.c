@@ -0,0 +1,343 @@
+/**
+ * Command pipeline stage benchmark.
+ *
+ * Replays synthetic workloads through the shell's own code paths and times
+ * every stage a line goes through: read, dispatch (history expansion and
+ * builtin lookup), alias expansion, argv build, PATH resolution, spawn and
+ * wait, or running the builtin in-process. Reports p50/p90/p99/max latency
+ * and lines per second per stage.
+ *
+ * Workloads: short commands, long argument lists, chained aliases, history
+ * expansion, background jobs, commands run under script capture and the
+ * cd/echo/test glue of control scripts, which never leaves the shell.
+ *
+ * Usage: pipeline-bench [lines per workload]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#define DEFAULT_LINES	2000
+#define LONG_ARGS		256 /* Arguments on each line of the long workload */
+#define ALIAS_DEPTH		16 /* Aliases each line of the alias workload goes through */
+
+enum stage { STAGE_READ, STAGE_DISPATCH, STAGE_BUILTIN, STAGE_ALIAS, STAGE_ARGV, STAGE_PATH, STAGE_SPAWN, STAGE_WAIT, STAGE_COUNT };
+
+static const char *stage_names[STAGE_COUNT] =
+{
+	"read", "dispatch", "builtin", "alias", "argv", "path", "spawn", "wait",
+};
+
+struct samples
+{
+	double *values;		/* microseconds */
+	size_t count;
+};
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in microseconds
+//*****************************************************************************
+static double now_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+//*****************************************************************************
+// Abstract: qsort comparison for doubles
+//*****************************************************************************
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+//*****************************************************************************
+// Abstract: Returns the text of a workload of line_count lines, malloced
+//*****************************************************************************
+static char* make_workload(const char *name, int line_count)
+{
+	size_t capacity = (size_t)line_count * (LONG_ARGS * 8 + 64);
+	char *text = (char*)malloc(capacity);
+	size_t length = 0;
+	int i, j;
+
+	for (i = 0; i < line_count; i++)
+	{
+		if (0 == strcmp(name, "short"))
+		{
+			length += sprintf(&text[length], "printenv -a b%d\n", i);
+		}
+		else if (0 == strcmp(name, "long-args"))
+		{
+			length += sprintf(&text[length], "printenv");
+			for (j = 0; j < LONG_ARGS; j++)
+			{
+				length += sprintf(&text[length], " arg%d", j);
+			}
+			text[length++] = '\n';
+		}
+		else if (0 == strcmp(name, "alias"))
+		{
+			length += sprintf(&text[length], "a%d x%d\n", ALIAS_DEPTH - 1, i);
+		}
+		else if (0 == strcmp(name, "history"))
+		{
+			length += sprintf(&text[length], (i % 2) ? "!!\n" : "!-1\n");
+		}
+		else if (0 == strcmp(name, "background"))
+		{
+			length += sprintf(&text[length], "printenv bg%d &\n", i);
+		}
+		else if (0 == strcmp(name, "glue"))
+		{
+			switch (i % 4)
+			{
+				case 0: length += sprintf(&text[length], "cd /tmp\n"); break;
+				case 1: length += sprintf(&text[length], "test -d /tmp\n"); break;
+				case 2: length += sprintf(&text[length], "echo glue line %d\n", i); break;
+				default: length += sprintf(&text[length], "cd -\n"); break;
+			}
+		}
+		else
+		{
+			length += sprintf(&text[length], "printf captured-line-%d\n", i);
+		}
+	}
+
+	text[length] = '\0';
+	return text;
+}
+
+//*****************************************************************************
+// Abstract: Runs every line of the workload through the shell's stages,
+// recording how long each one took
+//*****************************************************************************
+static double run_workload(const char *text, struct samples *samples)
+{
+	struct line_reader reader;
+	double start = now_usec(), t0, t1;
+	char *line;
+
+	line_reader_from_string(&reader, text);
+
+	while (1)
+	{
+		arena_reset(&g_line_arena);
+
+		t0 = now_usec();
+		line = read_line(&reader);
+		t1 = now_usec();
+		if (line == NULL)
+		{
+			break;
+		}
+		samples[STAGE_READ].values[samples[STAGE_READ].count++] = t1 - t0;
+
+		//Same order as execute_line and run_external
+		t0 = now_usec();
+		if (line[0] == '!')
+		{
+			line = expand_history(line);
+		}
+		struct builtin *builtin = find_builtin(line);
+		t1 = now_usec();
+		samples[STAGE_DISPATCH].values[samples[STAGE_DISPATCH].count++] = t1 - t0;
+		if (builtin != NULL)
+		{
+			t0 = now_usec();
+			run_builtin(builtin, line);
+			t1 = now_usec();
+			samples[STAGE_BUILTIN].values[samples[STAGE_BUILTIN].count++] = t1 - t0;
+			continue;
+		}
+
+		t0 = now_usec();
+		char *replaced = replace_alias(line);
+		t1 = now_usec();
+		samples[STAGE_ALIAS].values[samples[STAGE_ALIAS].count++] = t1 - t0;
+
+		t0 = now_usec();
+		struct token_list tokens;
+		tokenize(replaced, &tokens);
+		int background = (tokens.count > 0 && tokens.operators[tokens.count - 1]);
+		if (background)
+		{
+			tokens.argv[--tokens.count] = NULL;
+		}
+		char **argv = tokens.argv;
+		t1 = now_usec();
+		samples[STAGE_ARGV].values[samples[STAGE_ARGV].count++] = t1 - t0;
+
+		t0 = now_usec();
+		char *path = find_command(argv[0]);
+		t1 = now_usec();
+		samples[STAGE_PATH].values[samples[STAGE_PATH].count++] = t1 - t0;
+
+		if (path == NULL)
+		{
+			continue;
+		}
+
+		sigset_t old_mask;
+		sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+		t0 = now_usec();
+		struct job *job = create_job(argv[0]);
+		struct spawn_request request;
+		init_spawn_request(&request, path, argv);
+		request.set_process_group = background;
+		pid_t child_pid = spawn_command(&request);
+		add_job_process(job, child_pid);
+		t1 = now_usec();
+		samples[STAGE_SPAWN].values[samples[STAGE_SPAWN].count++] = t1 - t0;
+
+		//Background jobs are reaped by the event loop, as in run_batch
+		if (!background)
+		{
+			t0 = now_usec();
+			wait_for_job(job, 0);
+			free_job(job);
+			t1 = now_usec();
+			samples[STAGE_WAIT].values[samples[STAGE_WAIT].count++] = t1 - t0;
+		}
+
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+		if (g_job_count > 0)
+		{
+			run_events(0);
+		}
+
+		if (g_jobs_changed)
+		{
+			notify_jobs();
+		}
+	}
+
+	line_reader_close(&reader);
+
+	//Let the last background jobs finish
+	builtin_wait("wait");
+	notify_jobs();
+
+	return now_usec() - start;
+}
+
+//*****************************************************************************
+// Abstract: Prints the percentiles and rate of every stage that ran
+//*****************************************************************************
+static void report(FILE *out, const char *name, struct samples *samples, double elapsed)
+{
+	int i;
+
+	fprintf(out, "%s: %zu lines in %.1f ms, %.0f lines/s\n", name, samples[STAGE_READ].count,
+		elapsed / 1e3, samples[STAGE_READ].count / (elapsed / 1e6));
+	fprintf(out, "  %-9s %10s %10s %10s %10s %14s\n", "stage", "p50 us", "p90 us", "p99 us", "max us", "lines/s");
+
+	for (i = 0; i < STAGE_COUNT; i++)
+	{
+		struct samples *stage = &samples[i];
+		double total = 0;
+		size_t j;
+
+		if (stage->count == 0)
+		{
+			continue;
+		}
+
+		qsort(stage->values, stage->count, sizeof(double), compare_doubles);
+		for (j = 0; j < stage->count; j++)
+		{
+			total += stage->values[j];
+		}
+
+		fprintf(out, "  %-9s %10.2f %10.2f %10.2f %10.2f %14.0f\n", stage_names[i],
+			stage->values[stage->count / 2], stage->values[stage->count * 90 / 100],
+			stage->values[stage->count * 99 / 100], stage->values[stage->count - 1],
+			stage->count / (total / 1e6));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *workloads[] = { "short", "long-args", "alias", "history", "background", "script", "glue" };
+	int line_count = (argc > 1) ? atoi(argv[1]) : DEFAULT_LINES;
+	char home[] = "/tmp/pipeline-bench-XXXXXX";
+	char file_name[64], definition[64];
+	struct samples samples[STAGE_COUNT];
+	size_t w;
+	int i;
+
+	if (mkdtemp(home) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	//Report to the real stdout, the workloads write to /dev/null
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	int null_fd = open("/dev/null", O_WRONLY);
+	fflush(stdout);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+
+	g_batch_mode = 1;
+	init_builtins();
+	init_job_control(0);
+
+	snprintf(file_name, sizeof(file_name), "%s/.cs543_history", home);
+	history_open(file_name);
+	add_to_history("printenv from-history");
+
+	//a15 expands through every alias down to a0
+	save_alias("alias a0 \"printenv\"");
+	for (i = 1; i < ALIAS_DEPTH; i++)
+	{
+		snprintf(definition, sizeof(definition), "alias a%d \"a%d\"", i, i - 1);
+		save_alias(definition);
+	}
+
+	for (i = 0; i < STAGE_COUNT; i++)
+	{
+		samples[i].values = (double*)malloc((line_count + 1) * sizeof(double));
+	}
+
+	for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+	{
+		char *text = make_workload(workloads[w], line_count);
+		int capture = (0 == strcmp(workloads[w], "script"));
+
+		for (i = 0; i < STAGE_COUNT; i++)
+		{
+			samples[i].count = 0;
+		}
+
+		if (capture)
+		{
+			snprintf(file_name, sizeof(file_name), "%s/transcript.txt", home);
+			start_transcript(file_name);
+		}
+
+		double elapsed = run_workload(text, samples);
+
+		if (capture)
+		{
+			stop_transcript();
+			unlink(file_name);
+		}
+
+		report(out, workloads[w], samples, elapsed);
+		fflush(out);
+		free(text);
+	}
+
+	snprintf(file_name, sizeof(file_name), "%s/.cs543_history", home);
+	unlink(file_name);
+	snprintf(file_name, sizeof(file_name), "%s/.cs543_history.idx", home);
+	unlink(file_name);
+	rmdir(home);
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * Line reader throughput benchmark.
+ *
+ * Pushes a multi-megabyte command stream through a pipe into the shell's
+ * line reader and reports MB/s and lines/s. The stream mixes short
+ * commands, generated command lines several KB long and backslash
+ * continuations.
+ *
+ * Usage: reader-bench [megabytes]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#include <time.h>
+
+#define DEFAULT_MEGABYTES	64
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in seconds
+//*****************************************************************************
+static double now_sec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//*****************************************************************************
+// Abstract: Writes total bytes of synthetic commands to fd
+//*****************************************************************************
+static void write_stream(int fd, size_t total)
+{
+	struct output_buffer *out = (struct output_buffer*)malloc(sizeof(struct output_buffer));
+	char long_line[8192];
+	size_t written = 0;
+	int i, length = 0;
+
+	out->fd = fd;
+	out->used = 0;
+
+	//A generated command of roughly 8 KB
+	length += sprintf(long_line, "cc -o out");
+	for (i = 0; length < (int)sizeof(long_line) - 32; i++)
+	{
+		length += sprintf(&long_line[length], " -Iinclude/dir%d", i);
+	}
+	long_line[length++] = '\n';
+
+	for (i = 0; written < total; i++)
+	{
+		const char *line;
+		size_t line_length;
+
+		switch (i % 4)
+		{
+			case 0: line = "ls -l /tmp\n"; break;
+			case 1: line = "grep -r pattern src \\\ninclude docs\n"; break;
+			case 2: line = "echo done\n"; break;
+			default: line = long_line; break;
+		}
+
+		line_length = (line == long_line) ? (size_t)length : strlen(line);
+		buffer_write(out, line, line_length);
+		written += line_length;
+	}
+
+	buffer_flush(out);
+	free(out);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t total = (size_t)((argc > 1) ? atoi(argv[1]) : DEFAULT_MEGABYTES) << 20;
+	struct line_reader reader;
+	size_t lines = 0, bytes = 0;
+	int pipe_fds[2];
+	char *line;
+
+	if (0 != pipe(pipe_fds))
+	{
+		perror("pipe");
+		return 1;
+	}
+
+	pid_t writer = fork();
+	if (writer == 0)
+	{
+		close(pipe_fds[0]);
+		write_stream(pipe_fds[1], total);
+		_exit(0);
+	}
+	close(pipe_fds[1]);
+
+	double start = now_sec();
+
+	line_reader_init(&reader, pipe_fds[0]);
+	while ((line = read_line(&reader)) != NULL)
+	{
+		bytes += strlen(line) + 1;
+		lines++;
+	}
+	line_reader_close(&reader);
+
+	double elapsed = now_sec() - start;
+	waitpid(writer, NULL, 0);
+
+	printf("line reader    %8.1f MB/s  %12.0f lines/s  (%zu lines, %.1f MB)\n",
+		bytes / elapsed / (1 << 20), lines / elapsed, lines, bytes / (double)(1 << 20));
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * Spawn latency microbenchmark.
+ *
+ * Grows the parent to several resident set sizes and times how long it
+ * takes to launch and reap /bin/true with each spawn backend of the shell:
+ * fork and posix_spawn from the parent itself and the fork server, which
+ * forks from its own small address space. Children are waited for through
+ * the job table, as the shell does, since the fork server's children are
+ * not the parent's to waitpid.
+ *
+ * Usage: spawn-bench [iterations] [rss_mb ...]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#include <time.h>
+
+#define DEFAULT_ITERATIONS	200
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in microseconds
+//*****************************************************************************
+static double now_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+//*****************************************************************************
+// Abstract: qsort comparator for doubles
+//*****************************************************************************
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+//*****************************************************************************
+// Abstract: Launches /bin/true iterations times with the input backend and
+// prints the median, 99th percentile and mean spawn+wait latency.
+//*****************************************************************************
+static void run_backend(int backend, const char *name, int iterations, int rss_mb)
+{
+	char *argv[] = { "true", NULL };
+	double *samples = (double*)malloc(sizeof(double) * iterations);
+	double total = 0;
+	sigset_t old_mask;
+	int i;
+
+	struct spawn_request request;
+	init_spawn_request(&request, "/bin/true", argv);
+
+	g_spawn_backend = backend;
+
+	for (i = 0; i < iterations; i++)
+	{
+		arena_reset(&g_line_arena);
+		sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+		double start = now_usec();
+
+		struct job *job = create_job(argv[0]);
+		pid_t child_pid = spawn_command(&request);
+		if (child_pid < 0)
+		{
+			perror("spawn");
+			exit(1);
+		}
+		add_job_process(job, child_pid);
+		wait_for_job(job, 0);
+		free_job(job);
+
+		samples[i] = now_usec() - start;
+		total += samples[i];
+
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	}
+
+	qsort(samples, iterations, sizeof(double), compare_double);
+
+	printf("%8d MB  %-12s p50 %9.1f us  p99 %9.1f us  mean %9.1f us\n", rss_mb, name,
+		samples[iterations / 2], samples[(iterations * 99) / 100], total / iterations);
+
+	free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+	int default_sizes[] = { 0, 64, 256, 1024 };
+	int iterations = DEFAULT_ITERATIONS;
+	int size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	int *sizes = default_sizes;
+	char *ballast = NULL;
+	size_t ballast_size = 0;
+	int i;
+
+	//The fork server is this binary started again
+	if (argc == 3 && 0 == strcmp(argv[1], FORK_SERVER_ARGUMENT))
+	{
+		return run_fork_server(atoi(argv[2]));
+	}
+
+	init_job_control(0);
+	if (0 != start_fork_server())
+	{
+		perror("fork server");
+		return 1;
+	}
+
+	if (argc > 1)
+	{
+		iterations = atoi(argv[1]);
+	}
+
+	if (argc > 2)
+	{
+		size_count = argc - 2;
+		sizes = (int*)malloc(sizeof(int) * size_count);
+		for (i = 0; i < size_count; i++)
+		{
+			sizes[i] = atoi(argv[i + 2]);
+		}
+	}
+
+	printf("spawn latency, %d iterations per backend\n", iterations);
+
+	for (i = 0; i < size_count; i++)
+	{
+		size_t wanted = (size_t)sizes[i] << 20;
+
+		//Grow and touch the ballast so every page is resident in the parent
+		if (wanted > ballast_size)
+		{
+			ballast = (char*)realloc(ballast, wanted);
+			if (ballast == NULL)
+			{
+				printf("could not allocate %d MB\n", sizes[i]);
+				return 1;
+			}
+			memset(ballast + ballast_size, 1, wanted - ballast_size);
+			ballast_size = wanted;
+		}
+
+		run_backend(SPAWN_FORK, "fork", iterations, sizes[i]);
+		run_backend(SPAWN_POSIX, "posix_spawn", iterations, sizes[i]);
+		run_backend(SPAWN_SERVER, "fork server", iterations, sizes[i]);
+	}
+
+	free(ballast);
+	return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * Startup benchmark.
+ *
+ * Starts the shell binary many times with an empty -c command and reports
+ * startup latency percentiles with no .cs543rc, with a large .cs543rc
+ * parsed every time (the snapshot is deleted before each start, so this
+ * includes writing it) and with the rc state loaded from its snapshot.
+ *
+ * Usage: startup-bench [path to simple-shell] [starts] [aliases]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_STARTS	500
+#define DEFAULT_ALIASES	2000
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in microseconds
+//*****************************************************************************
+static double now_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+//*****************************************************************************
+// Abstract: qsort comparison for doubles
+//*****************************************************************************
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+//*****************************************************************************
+// Abstract: Writes an rc file with alias_count aliases and a few settings
+//*****************************************************************************
+static void write_rc(int alias_count)
+{
+	FILE *rc = fopen(".cs543rc", "w");
+	int i;
+
+	fprintf(rc, "set path = (/usr/local/bin /usr/bin /bin)\n");
+	fprintf(rc, "set pipesize 131072\n");
+	fprintf(rc, "set history 50000\n");
+	for (i = 0; i < alias_count; i++)
+	{
+		fprintf(rc, "alias a%d \"ls -l --color=auto /tmp/dir%d\"\n", i, i);
+	}
+
+	fclose(rc);
+}
+
+//*****************************************************************************
+// Abstract: Starts the shell starts times and prints latency percentiles.
+// With reparse the snapshot is removed before every start.
+//*****************************************************************************
+static void measure(const char *label, const char *shell, int starts, int reparse)
+{
+	double *samples = (double*)malloc(starts * sizeof(double));
+	double total = 0;
+	int i;
+
+	for (i = 0; i < starts; i++)
+	{
+		if (reparse)
+		{
+			unlink(".cs543rc.snap");
+		}
+
+		double start = now_usec();
+		pid_t pid = fork();
+
+		if (pid == 0)
+		{
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(null_fd, STDOUT_FILENO);
+			execl(shell, shell, "-c", "", (char*)NULL);
+			_exit(127);
+		}
+
+		waitpid(pid, NULL, 0);
+		samples[i] = now_usec() - start;
+		total += samples[i];
+	}
+
+	qsort(samples, starts, sizeof(double), compare_doubles);
+
+	printf("%-26s p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  %8.0f starts/s\n", label,
+		samples[starts / 2], samples[starts * 90 / 100], samples[starts * 99 / 100], starts / (total / 1e6));
+
+	free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+	char shell[4096];
+	int starts = (argc > 2) ? atoi(argv[2]) : DEFAULT_STARTS;
+	int alias_count = (argc > 3) ? atoi(argv[3]) : DEFAULT_ALIASES;
+	char home[] = "/tmp/startup-bench-XXXXXX";
+	char label[64];
+
+	//The shell is started from inside the scratch directory
+	if (realpath((argc > 1) ? argv[1] : "./simple-shell", shell) == NULL)
+	{
+		perror("simple-shell");
+		return 1;
+	}
+
+	if (mkdtemp(home) == NULL || 0 != chdir(home))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", home, 1);
+
+	measure("no rc", shell, starts, 0);
+
+	write_rc(alias_count);
+	snprintf(label, sizeof(label), "rc parsed (%d alias)", alias_count);
+	measure(label, shell, starts, 1);
+	snprintf(label, sizeof(label), "rc snapshot (%d alias)", alias_count);
+	measure(label, shell, starts, 0);
+
+	unlink(".cs543rc");
+	unlink(".cs543rc.snap");
+	unlink(".cs543_history");
+	unlink(".cs543_history.idx");
+	if (0 != chdir("/") || 0 != rmdir(home))
+	{
+		perror(home);
+	}
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+/**
+ * Tokenizer benchmark.
+ *
+ * Splits command lines with very long argument lists, as generated scripts
+ * produce them, and reports MB/s and arguments per second for the
+ * strtok splitting the shell used before and for the tokenizer with its
+ * scalar, SSE2 and AVX2 delimiter scans. One line in eight words is quoted.
+ * Fails if any of them splits a line into the wrong number of words.
+ *
+ * Usage: tokenizer-bench [MB per measurement]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#include <time.h>
+
+#define DEFAULT_MEGABYTES	64
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in seconds
+//*****************************************************************************
+static double now_sec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//*****************************************************************************
+// Abstract: Returns a malloced command line with arg_count arguments
+//*****************************************************************************
+static char* make_line(int arg_count)
+{
+	char *line = (char*)malloc((size_t)arg_count * 48 + 16);
+	size_t length = sprintf(line, "cc");
+	int i;
+
+	for (i = 0; i < arg_count; i++)
+	{
+		switch (i % 8)
+		{
+			case 0: length += sprintf(&line[length], " -DVERSION_%d=1", i); break;
+			case 1: length += sprintf(&line[length], " src/module%d/file%d.c", i % 97, i); break;
+			case 2: length += sprintf(&line[length], " \"out dir/obj%d.o\"", i); break;
+			case 3: length += sprintf(&line[length], " --define=key%d", i); break;
+			case 4: length += sprintf(&line[length], " -I/usr/include/lib%d", i % 13); break;
+			case 5: length += sprintf(&line[length], " build/generated/part_%d.h", i); break;
+			case 6: length += sprintf(&line[length], " -Wl,-rpath,/opt/lib%d", i % 7); break;
+			default: length += sprintf(&line[length], " data%d.bin", i); break;
+		}
+	}
+
+	return line;
+}
+
+//*****************************************************************************
+// Abstract: The splitting build_argv did before the tokenizer
+//*****************************************************************************
+static int split_with_strtok(char *line, char **argv)
+{
+	int count = 0;
+	char *token = strtok(line, " ");
+
+	while (token != NULL)
+	{
+		argv[count++] = token;
+		token = strtok(NULL, " ");
+	}
+
+	argv[count] = NULL;
+	return count;
+}
+
+//*****************************************************************************
+// Abstract: Splits the line repeatedly until megabytes have been processed,
+// with the scan width (0 for strtok), and prints the rate. Returns the words
+// in one split of the line.
+//*****************************************************************************
+static long measure(const char *label, const char *line, int scan_width, int megabytes)
+{
+	size_t length = strlen(line);
+	long iterations = (long)megabytes * 1024 * 1024 / length + 1, i;
+	char *work = (char*)malloc(length + 1);
+	char **argv = (char**)malloc((length / 2 + 2) * sizeof(char*));
+	long arg_count = 0;
+
+	g_scan_width = scan_width;
+
+	double start = now_sec();
+	for (i = 0; i < iterations; i++)
+	{
+		memcpy(work, line, length + 1);
+		arena_reset(&g_line_arena);
+
+		if (scan_width == 0)
+		{
+			arg_count += split_with_strtok(work, argv);
+		}
+		else
+		{
+			struct token_list tokens;
+			tokenize(work, &tokens);
+			arg_count += tokens.count;
+		}
+	}
+	double elapsed = now_sec() - start;
+
+	printf("  %-8s %9.0f MB/s %12.0f args/s\n", label,
+		iterations * (double)length / elapsed / 1e6, arg_count / elapsed);
+
+	free(argv);
+	free(work);
+
+	return arg_count / iterations;
+}
+
+//*****************************************************************************
+// Abstract: Reports a split that found the wrong number of words. Returns 1
+// if words differs from expected.
+//*****************************************************************************
+static int check_count(const char *label, long words, long expected)
+{
+	if (words != expected)
+	{
+		fprintf(stderr, "  %s split the line into %ld words, expected %ld\n", label, words, expected);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int arg_counts[] = { 100, 1000, 10000, 100000 };
+	int megabytes = (argc > 1) ? atoi(argv[1]) : DEFAULT_MEGABYTES;
+	size_t i;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(arg_counts) / sizeof(arg_counts[0]); i++)
+	{
+		char *line = make_line(arg_counts[i]);
+
+		//The command word and every argument, strtok also splits each quoted one in two
+		long words = arg_counts[i] + 1;
+		long quoted = (arg_counts[i] + 5) / 8;
+
+		printf("%d arguments (%zu bytes):\n", arg_counts[i], strlen(line));
+		failed |= check_count("strtok", measure("strtok", line, 0, megabytes), words + quoted);
+		failed |= check_count("scalar", measure("scalar", line, 1, megabytes), words);
+#if defined(__x86_64__)
+		failed |= check_count("sse2", measure("sse2", line, 16, megabytes), words);
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			failed |= check_count("avx2", measure("avx2", line, 32, megabytes), words);
+		}
+#endif
+
+		free(line);
+	}
+
+	return failed;
+}
@@ -0,0 +1,154 @@
+/**
+ * Child reaping benchmark.
+ *
+ * Starts many jobs that all block reading one pipe, closes it so they exit
+ * at once, and reports the wall time until every job is recorded as done
+ * and the time the shell itself spent in the event loop reaping them.
+ * Compares reaping through each child's pidfd, where an exit event names
+ * its job, with reaping everything on SIGCHLD, where every exit is looked
+ * up in the job table.
+ *
+ * Usage: wait-bench [rounds] [jobs ...]
+ */
+
+#define SIMPLE_SHELL_NO_MAIN
+#include "simple-shell.c"
+
+#define DEFAULT_ROUNDS	5
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in microseconds
+//*****************************************************************************
+static double now_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+//*****************************************************************************
+// Abstract: Starts job_count cat jobs on one pipe, releases them all and
+// returns the microseconds from the release until every job is done. The
+// microseconds spent in run_events go to reap_usec.
+//*****************************************************************************
+static double run_round(const char *cat_path, int job_count, double *reap_usec)
+{
+	char *argv[] = { "cat", NULL };
+	struct job **jobs = (struct job**)malloc(sizeof(struct job*) * job_count);
+	int pipe_fds[2], null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	int i, done = 0;
+
+	pipe2(pipe_fds, O_CLOEXEC);
+
+	for (i = 0; i < job_count; i++)
+	{
+		struct spawn_request request;
+		init_spawn_request(&request, cat_path, argv);
+		request.redirections[0].fd = STDIN_FILENO;
+		request.redirections[0].source_fd = pipe_fds[0];
+		request.redirections[1].fd = STDOUT_FILENO;
+		request.redirections[1].source_fd = null_fd;
+		request.redirection_count = 2;
+
+		jobs[i] = create_job("cat");
+		add_job_process(jobs[i], spawn_command(&request));
+	}
+
+	close(pipe_fds[0]);
+	close(null_fd);
+
+	double start = now_usec();
+	close(pipe_fds[1]);
+	*reap_usec = 0;
+
+	while (done < job_count)
+	{
+		//Sleeping until the first event is not reaping
+		struct pollfd ready = { g_event_fd, POLLIN, 0 };
+		poll(&ready, 1, -1);
+
+		double t0 = now_usec();
+		run_events(0);
+		*reap_usec += now_usec() - t0;
+
+		for (done = 0; done < job_count && jobs[done]->state == JOB_DONE; done++);
+	}
+
+	double elapsed = now_usec() - start;
+
+	for (i = 0; i < job_count; i++)
+	{
+		free_job(jobs[i]);
+	}
+	free(jobs);
+
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	static int default_counts[] = { 100, 300, 1000 };
+	int rounds = (argc > 1) ? atoi(argv[1]) : DEFAULT_ROUNDS;
+	int *counts = default_counts, count_total = sizeof(default_counts) / sizeof(default_counts[0]);
+	struct rlimit files;
+	int c, reap_all, round;
+
+	if (argc > 2)
+	{
+		count_total = argc - 2;
+		counts = (int*)malloc(sizeof(int) * count_total);
+		for (c = 0; c < count_total; c++)
+		{
+			counts[c] = atoi(argv[c + 2]);
+		}
+	}
+
+	//Every job holds a pidfd
+	getrlimit(RLIMIT_NOFILE, &files);
+	files.rlim_cur = files.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &files);
+
+	init_job_control(0);
+
+	char *cat_path = find_command("cat");
+	cat_path = (cat_path != NULL) ? strdup(cat_path) : NULL;
+	if (cat_path == NULL)
+	{
+		printf("cat not found\n");
+		return 1;
+	}
+
+	for (c = 0; c < count_total; c++)
+	{
+		if (counts[c] > MAX_JOBS)
+		{
+			printf("%d jobs: more than MAX_JOBS (%d)\n", counts[c], MAX_JOBS);
+			continue;
+		}
+
+		for (reap_all = 0; reap_all <= 1; reap_all++)
+		{
+			double best = 0, best_reap = 0, reap;
+
+			g_reap_all = reap_all;
+
+			for (round = 0; round < rounds; round++)
+			{
+				double elapsed = run_round(cat_path, counts[c], &reap);
+				if (round == 0 || elapsed < best)
+				{
+					best = elapsed;
+				}
+				if (round == 0 || reap < best_reap)
+				{
+					best_reap = reap;
+				}
+			}
+
+			printf("%5d jobs  %-8s %10.0f us until all done  %8.0f us reaping  %6.2f us per job\n",
+				counts[c], reap_all ? "SIGCHLD" : "pidfd", best, best_reap, best_reap / counts[c]);
+		}
+	}
+
+	return 0;
+}
@@ -10,6 +10,7 @@
  *
  */
 
+#define _GNU_SOURCE /* pipe2, F_SETPIPE_SZ */
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -17,862 +18,9319 @@
 #include <string.h>
 #include <regex.h>
 #include <stdarg.h>
+#include <sys/stat.h>
+#include <spawn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-#define MAX_LINE		80 /* 80 chars per line, per command */
-#define BUFFER_LENGTH (MAX_LINE/2) + 1
-#define MAX_HISTORY		10 /* Max Number of History Items*/
+#define READ_BLOCK_SIZE		65536 /* Bytes requested from read(2) at a time */
+#define MAX_HISTORY		10 /* History items printed by default */
+#define HISTORY_SIZE		100000 /* History items kept on disk by default */
+#define HISTORY_MAP_CHUNK	(1 << 24) /* History mappings grow in steps of this many bytes */
+#define HISTORY_MAGIC		"CS543HI1"
+#define HISTORY_SEARCH_SLOTS	4096 /* Initial slots in the history trigram table, power of 2 */
+#define HISTORY_INDEX_STEP	16384 /* History entries indexed at a time while the prompt is idle */
+#define HISTORY_BLOCK_SHIFT	6 /* Shorter keys are posted per block of 64 entries */
+#define HISTORY_KEY_PAIR	(1u << 24) /* Key space of two byte keys, trigrams are below it */
+#define HISTORY_KEY_BYTE	(2u << 24) /* Key space of one byte keys */
+#define PROMPT				"osh>"
+#define EDIT_INPUT_SIZE		4096 /* Bytes of typed or pasted input read at a time */
+#define EDIT_QUERY_SIZE		256 /* Max length of a reverse search query */
+#define EDIT_ESCAPE_WAIT	25 /* Milliseconds to wait for the rest of an escape sequence */
+#define KEY_UP				256 /* Line editor keys above the byte values */
+#define KEY_DOWN			257
+#define KEY_RIGHT			258
+#define KEY_LEFT			259
+#define KEY_HOME			260
+#define KEY_END				261
+#define KEY_DELETE			262
+#define KEY_WORD_LEFT		263
+#define KEY_WORD_RIGHT		264
+#define KEY_ESCAPE			265
+#define KEY_NONE			-1 /* An escape sequence the editor does not handle */
+#define KEY_MORE			-2 /* The input ends inside an escape sequence */
+#define ALIAS_TABLE_SIZE	64 /* Initial slots in the alias table, power of 2 */
+#define MAX_JOBS			1024 /* Max jobs, running or finished but not yet reported */
+#define JOB_FREE			0
+#define JOB_RUNNING			1
+#define JOB_STOPPED			2
+#define JOB_DONE			3
+#define COMMAND_HASH_SIZE	64 /* Buckets in the command location cache */
+#define PATH_NAME_SLOTS		64 /* Initial slots in a PATH directory's name set, power of 2 */
+#define PATH_NAME_REMOVED	UINT32_MAX /* Name set slot whose name was deleted */
+#define PATH_EVENTS			(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define DIRENT_BUFFER_SIZE	(1 << 18) /* Bytes of directory entries read by one getdents64 */
+#define MAX_REDIRECTIONS	8 /* Max fd redirections applied to one child */
+#define SPAWN_POSIX			0 /* Launch children with posix_spawn (vfork semantics) */
+#define SPAWN_FORK			1 /* Launch children with a full fork() */
+#define SPAWN_SERVER		2 /* Launch children from the fork server process */
+#define FORK_SERVER_ARGUMENT	"--fork-server" /* argv[1] of the fork server, argv[2] is its socket */
+#define FORK_SERVER_PACKET_SIZE	65536 /* Bytes of request strings sent in one packet */
+#define FORK_SERVER_SPAWNED	0 /* Fork server message: reply to a request */
+#define FORK_SERVER_CHANGED	1 /* Fork server message: a child changed state */
+#define MAX_PIPELINE		32 /* Max commands joined with | in one line */
+#define OUTPUT_BUFFER_SIZE	65536 /* Bytes buffered before a transcript write */
+#define TRANSCRIPT_PIPE_SIZE	(1 << 20) /* Room for child output between drains */
+#define MAX_BUILTINS		64 /* Max commands the shell runs itself, at most half of BUILTIN_INDEX_SIZE */
+#define BUILTIN_INDEX_SIZE	128 /* Slots in the builtin lookup table, power of 2 */
+#define BUILTIN_NO_HISTORY	1 /* Builtin flag: do not record the line in history */
+#define BUILTIN_RAW_LINE	2 /* Builtin flag: gets the whole line, operators and all */
+#define ARENA_BLOCK_SIZE	65536 /* Default size of each arena block */
+#define MAX_PARALLEL_JOBS	256 /* Max children a parallel builtin keeps running */
+#define RC_SNAPSHOT_MAGIC	"CS543RS3"
+#define TRACE_RING_SIZE		4096 /* Trace events held before a flush, power of 2 */
+#define TRACE_DETAIL_SIZE	64 /* Bytes of detail text kept per trace event */
+#define EVENT_SIGNAL		1 /* Event loop source: the signalfd */
+#define EVENT_INPUT			2 /* Event loop source: the line reader's descriptor */
+#define EVENT_TRANSCRIPT	4 /* Event loop source: the transcript pipe */
+#define EVENT_FORK_SERVER	8 /* Event loop source: the fork server socket */
+#define EVENT_CHILD			16 /* Event loop source: a job process's pidfd, job and process index above the tag */
+#define EVENT_PATH_INDEX	32 /* Event loop source: the inotify descriptor watching PATH */
+#define EVENT_TAG_MASK		0xffff
+#define TIMEOUT_STATUS		124 /* Status of a job stopped by timeout, as with timeout(1) */
+#define TIMEOUT_KILL_DELAY	1000 /* Milliseconds between SIGTERM and SIGKILL for a job past its timeout */
+#define LAUNCH_LIMIT_COUNT	3 /* Resource limits a launch can set: mem, files and cputime */
+#define NUMA_NODE_PATH		"/sys/devices/system/node/node%d/cpulist"
 
 //Data Structures
 //*****************************************************************************
-struct parameters
+struct history_header
 {
-	char *parameter;
-	struct parameters *next;
+	char magic[8];
+	uint64_t first_event;	/* event number of offsets[0] */
+	uint64_t offsets[];		/* where each event starts in the log */
 };
 
-struct param_list
+struct history_store
 {
-	int length;
-	struct parameters *head;
+	int log_fd;
+	int index_fd;
+	char *log;
+	struct history_header *index;
+	size_t log_size;
+	size_t log_mapped;
+	size_t index_size;
+	size_t index_mapped;
+	long size_limit;
+	long checked;			/* offsets already known to be in order */
+	uint64_t checked_first_event;	/* first_event when they were checked */
 };
 
-struct previous_commands
+struct trigram_postings
 {
-	int index;
-	char *string;
+	uint32_t trigram;		/* three bytes of a command, or one or two in the HISTORY_KEY_ spaces, 0 for an empty slot */
+	uint32_t count;
+	uint32_t last;			/* newest entry, or block for the shorter keys, in the list */
+	uint32_t length;		/* bytes of postings used */
+	uint32_t capacity;
+	unsigned char *postings;	/* LEB128 gaps between entries, oldest first */
+};
+
+struct history_search_index
+{
+	struct trigram_postings *slots;
+	size_t capacity;		/* power of 2 */
+	size_t used;
+	uint64_t first_event;	/* entries are numbered from this history event */
+	long indexed;			/* entries added so far */
+};
+
+struct line_editor
+{
+	int fd;
+	int columns;			/* terminal width the line was last drawn for */
+	char *line;
+	size_t length;
+	size_t cursor;
+	size_t capacity;
+	size_t kept;			/* line joined by a trailing backslash, edited on from here */
+	char input[EDIT_INPUT_SIZE];	/* read but not yet handled, a paste can hold several lines */
+	size_t input_start;
+	size_t input_end;
+	long browsing;			/* history entry shown by up and down, -1 while typing */
+	char *typed;			/* the line as typed before browsing or searching */
+	int searching;			/* in a ^R search */
+	char query[EDIT_QUERY_SIZE];
+	size_t query_length;
+	long match;				/* entry of the search match, -1 if there is none */
+	int last_key;
 };
 
 struct alias_command
 {
-	char *string;
+	char *string;			/* alias name, NULL for an empty slot */
+	char *command;			/* NULL once the alias is removed */
+	char *expansion;		/* memoized full expansion of command */
+	unsigned int generation;	/* alias generation the expansion was made in */
+	int expanding;			/* set while the expansion is being built */
+};
+
+struct alias_table
+{
+	struct alias_command *slots;
+	size_t capacity;
+	size_t used;			/* slots holding a name, removed or not */
+	unsigned int generation;	/* bumped by every change to any alias */
+};
+
+struct command_hash_entry
+{
+	char *command;
+	char *path;
+	int hits;
+	struct command_hash_entry *next;
+};
+
+struct path_name_slot
+{
+	uint32_t hash;
+	uint32_t name;			/* offset + 1 into names, 0 for empty, PATH_NAME_REMOVED */
+};
+
+struct path_dir
+{
+	char *path;
+	int watch;				/* inotify watch descriptor, -1 if none */
+	int indexed;			/* 0 for relative or unwatchable entries, which are searched with stat */
+	int stale;				/* rebuild before the next lookup */
+	char *names;			/* every name ever added, NUL terminated, back to back */
+	size_t names_used;
+	size_t names_capacity;
+	struct path_name_slot *slots;
+	size_t capacity;		/* power of 2 */
+	size_t used;			/* slots holding a name, removed or not */
+	size_t count;			/* names not removed */
+};
+
+struct path_index
+{
+	char *path;				/* the PATH the directories were built for */
+	struct path_dir *dirs;	/* in PATH order, each directory once */
+	int count;
+	int inotify_fd;
+};
+
+struct line_reader
+{
+	int fd;
+	int interactive;	/* prompt for continuation lines */
+	int eof;
+	char *buffer;
+	size_t capacity;
+	size_t start;		/* first byte not yet returned as a line */
+	size_t end;			/* one past the last byte read */
+};
+
+struct arena_block
+{
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct arena
+{
+	struct arena_block *first;
+	struct arena_block *current;
+};
+
+struct builtin
+{
+	const char *name;
+	int (*handler)(char *input_buffer);
+	int flags;
+};
+
+struct job_process
+{
+	pid_t pid;
+	int state;
+	int status;
+	int pidfd;		/* signals go through this, -1 if pidfd_open failed */
+	int cpu;		/* core round robin placed it on, -1 if it was not placed */
+};
+
+struct resource_usage
+{
+	long long wall_usec;
+	long long user_usec;		/* CPU time of every reaped process */
+	long long system_usec;
+	long max_rss_kb;			/* largest resident set of any process */
+	long voluntary_switches;
+	long involuntary_switches;
+};
+
+struct job
+{
+	int state;
+	int notified;			/* the latest state has been reported */
+	pid_t process_group;
+	int process_count;
+	struct job_process processes[MAX_PIPELINE];
+	int status;				/* exit status of the last process */
+	struct timespec started;
+	struct timespec finished;
+	struct resource_usage usage;
+	struct termios terminal_modes;	/* saved when the job stops */
+	int64_t deadline;		/* monotonic ms when timeout signals the job next, 0 for none */
+	int timed_out;
 	char *command;
-	struct alias_command *next;
+};
+
+struct parallel_task
+{
+	struct job *job;
+	int fds[2];				/* stdout and stderr pipes, -1 once closed */
+	char *output[2];		/* everything read from each pipe so far */
+	size_t length[2];
+	size_t capacity[2];
+	int finished;
+	int status;
+};
+
+struct output_buffer
+{
+	int fd;
+	size_t used;
+	char data[OUTPUT_BUFFER_SIZE];
+};
+
+struct launch_settings
+{
+	int set_cpus;			/* run on cpus instead of wherever the shell may run */
+	cpu_set_t cpus;
+	int set_nice;
+	int nice;				/* niceness to run at, not an increment */
+	int64_t limits[LAUNCH_LIMIT_COUNT];	/* soft and hard limit, -1 keeps the shell's */
+};
+
+struct rc_snapshot_header
+{
+	char magic[8];
+	uint64_t rc_size;		/* the rc file the snapshot was made from */
+	int64_t rc_mtime_sec;
+	int64_t rc_mtime_nsec;
+	uint64_t rc_inode;
+	uint64_t rc_device;
+	int32_t verbose;
+	int32_t spawn_backend;
+	int32_t pipe_size;
+	int32_t time_log;
+	int32_t editing;
+	int32_t round_robin;
+	int64_t history_size;
+	struct launch_settings launch_defaults;
+	cpu_set_t round_robin_cpus;
+	uint32_t path_length;	/* 0 if the rc file does not set the path */
+	uint32_t alias_count;
+	/* followed by the path and then name\0command\0 for every alias */
+};
+
+struct trace_event
+{
+	uint64_t sequence;		/* slot number + 1 once the event is complete */
+	uint64_t timestamp;		/* microseconds */
+	uint64_t duration;
+	const char *stage;
+	char phase;				/* Chrome trace phase: X complete, i instant */
+	int pid;				/* child the event is about, 0 if none */
+	int status;
+	char detail[TRACE_DETAIL_SIZE];
+};
+
+struct trace_ring
+{
+	struct trace_event *events;
+	uint64_t head;			/* next slot to fill */
+	uint64_t tail;			/* next slot to flush */
+	uint64_t dropped;
+	struct output_buffer *out;
+};
+
+struct redirection
+{
+	int fd;			/* descriptor in the child */
+	int source_fd;	/* descriptor in the shell that is duplicated onto fd */
+};
+
+struct file_redirection
+{
+	int fd;				/* descriptor in the child */
+	const char *path;	/* file to open, NULL to duplicate source_fd */
+	int flags;
+	int source_fd;
+};
+
+struct token_list
+{
+	char **argv;				/* NULL terminated, words are slices of the line */
+	unsigned char *operators;	/* operators[i] is set if argv[i] is an unquoted operator */
+	int count;
+	int capacity;
+};
+
+struct plain_scan
+{
+	const char *chunk;		/* 64 byte aligned block bits describes */
+	uint64_t bits;			/* bit n is set if chunk[n] is not a plain character */
+	uint64_t (*classify)(const char *chunk);
+};
+
+struct spawn_request
+{
+	const char *path;
+	char **argv;
+	int set_process_group;	/* put the child in process_group */
+	pid_t process_group;	/* 0 starts a new group */
+	int take_terminal;		/* make the child's group the terminal's foreground */
+	struct builtin *builtin;	/* run this builtin in the child instead of path */
+	struct launch_settings launch;
+	int redirection_count;
+	struct redirection redirections[MAX_REDIRECTIONS + 3];	/* the fork server adds stdin, stdout and stderr */
+};
+
+struct fork_server_request
+{
+	uint32_t length;		/* bytes of strings in the packets that follow */
+	int32_t argc;
+	int32_t envc;
+	int32_t set_process_group;
+	int32_t process_group;
+	int32_t take_terminal;
+	struct launch_settings launch;
+	int32_t redirection_count;
+	int32_t redirection_fds[MAX_REDIRECTIONS];	/* descriptor in the child */
+	int32_t redirection_sources[MAX_REDIRECTIONS];	/* child descriptor to duplicate, -1 for the next one passed */
+	/* followed by path\0cwd\0, argv and then the environment, each string NUL terminated */
+};
+
+struct fork_server_message
+{
+	int32_t type;			/* FORK_SERVER_SPAWNED or FORK_SERVER_CHANGED */
+	int32_t pid;			/* -1 if the request failed */
+	int32_t status;			/* wait status, or errno of a failed request */
+	struct rusage usage;
 };
 //*****************************************************************************
 
 //Function Prototypes
 //*****************************************************************************
+void* arena_alloc(struct arena *arena, size_t size);
+char* arena_strdup(struct arena *arena, const char *string);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
 void print_aliases();
-void add_to_history(struct previous_commands *item, struct previous_commands *queue[MAX_HISTORY]);
-void print_history(struct previous_commands *prev_commands[MAX_HISTORY]);
-char* get_history_command(struct previous_commands *prev_commands[MAX_HISTORY], int id);
-char* remove_newline(char *input_buffer);
-int is_run_is_background_set(char *input_buffer);
+int history_open(const char *file_name);
+int history_refresh();
+void history_rebuild();
+int history_index_valid();
+long history_count();
+void history_compact();
+void add_to_history(const char *command);
+void print_history(long count);
+char* get_history_command(long id, int relative);
+int set_history_size(const char *input_buffer);
+const char* history_entry(long i, size_t *length);
+long history_index_catch_up(long limit);
+void history_index_entry(uint32_t entry, const char *text, size_t length);
+void add_posting(uint32_t key, uint32_t id);
+struct trigram_postings* find_trigram(uint32_t trigram, int create);
+long search_history(const char *query, size_t length, long before, int prefix);
+long search_history_newer(const char *query, size_t length, long after, int prefix);
+void clear_history_index();
+int set_editing(const char *input_buffer);
+char* edit_line(struct line_reader *reader);
+int edit_read_key();
+int edit_key(int key);
+int edit_search_key(int key);
+void edit_refresh();
+void edit_write(const char *text, size_t length);
+void edit_insert(const char *text, size_t length);
+void edit_set_line(const char *text, size_t length);
+void edit_history(int older);
+void edit_search(long before, int skip_same);
+void edit_complete();
+void line_reader_init(struct line_reader *reader, int fd);
+int line_reader_open(struct line_reader *reader, const char *file_name);
+void line_reader_from_string(struct line_reader *reader, const char *text);
+void line_reader_close(struct line_reader *reader);
+char* read_line(struct line_reader *reader);
 void save_alias(char *input_buffer);
 void print_aliases();
 char* replace_alias(char *input_buffer);
-void switch_stdout_to_file(int append_to_file);
-void switch_stdout_to_terminal();
+int compare_aliases(const void *a, const void *b);
+struct alias_command* find_alias(const char *name, size_t length);
+struct alias_command* add_alias_slot(const char *name);
+void grow_alias_table();
+const char* expand_alias(struct alias_command *alias, struct alias_command **loop);
+int remove_alias(const char *name);
+int builtin_unalias(char *input_buffer);
+int write_all(int fd, const char *data, size_t length);
+void buffer_write(struct output_buffer *buffer, const char *data, size_t length);
+void buffer_flush(struct output_buffer *buffer);
+ssize_t transcript_stdout_write(void *cookie, const char *data, size_t length);
+int start_transcript(const char *file_name);
+void stop_transcript();
+void transcript_drain();
+void transcript_record_input(const char *input_buffer);
+void init_job_control(int interactive);
+void reap_children();
+void watch_fd(int fd, uint64_t tag);
+void unwatch_fd(int fd);
+int run_events(int timeout);
+void handle_signals();
+void wait_for_input(struct line_reader *reader);
+void update_job_process(pid_t pid, int status, struct rusage *usage);
+struct job_process* find_process(pid_t pid, struct job **job);
+int process_state(int status);
+void update_process(struct job *job, struct job_process *process, int state, int status, struct rusage *usage);
+void reap_process(struct job *job, struct job_process *process);
+void signal_job(struct job *job, int signal_number);
+int64_t enforce_deadlines(int64_t now);
+int64_t now_msec();
+struct job* create_job(const char *command);
+void add_job_process(struct job *job, pid_t pid);
+void free_job(struct job *job);
+int job_id(struct job *job);
+struct job* find_job(const char *spec);
+int wait_for_job(struct job *job, int foreground);
+int wait_for_job_until(struct job *job, int foreground, int64_t deadline);
+int wait_for_any_job(struct job **jobs, int job_count, int64_t deadline);
+int builtin_timeout(char *input_buffer);
+int builtin_on(char *input_buffer);
+int set_affinity(const char *input_buffer);
+int set_limits(const char *input_buffer);
+int parse_launch_setting(const char *word, struct launch_settings *settings);
+int parse_cpus(const char *text, cpu_set_t *cpus);
+int launch_settings_empty(const struct launch_settings *settings);
+int next_round_robin_cpu();
+void continue_job(struct job *job);
+void print_job(struct job *job, int verbose_times);
+void add_rusage(struct resource_usage *usage, const struct rusage *rusage);
+void record_job_usage(struct job *job);
+void print_usage(FILE *out, const struct resource_usage *usage);
+int builtin_time(char *input_buffer);
+int builtin_times(char *input_buffer);
+int set_time_log(const char *input_buffer);
+void notify_jobs();
+int count_unreported_jobs();
+int builtin_jobs(char *input_buffer);
+int builtin_fg(char *input_buffer);
+int builtin_bg(char *input_buffer);
+int builtin_wait(char *input_buffer);
+int builtin_kill(char *input_buffer);
+int builtin_parallel(char *input_buffer);
+char** expand_parallel_template(char **template_args, int template_count, const char *item);
+int start_parallel_task(struct parallel_task *task, const char *path, char **argv);
+void signal_parallel_tasks(struct parallel_task **tasks, int task_count, int signal_number);
+void read_parallel_output(struct parallel_task *task, int stream);
+void print_parallel_output(struct parallel_task *task);
 void verbose_print(const char* string, ...);
+int set_trace(const char *input_buffer);
+int trace_open(const char *file_name);
+void trace_close();
+uint64_t trace_now();
+void trace_record(const char *stage, char phase, uint64_t start, const char *detail, int pid, int status);
+void trace_complete(const char *stage, uint64_t start, const char *detail, int pid);
+void trace_flush();
+void trace_write_string(struct output_buffer *out, const char *string);
 void load_init_file();
+int rc_snapshot_load(const char *snapshot_name, const struct stat *rc_stat);
+void rc_snapshot_save(const char *snapshot_name, const struct stat *rc_stat, int path_set);
+int run_batch(struct line_reader *input);
 int set_path(const char *buffer);
+unsigned int hash_string(const char *string);
+unsigned int hash_bytes(const char *data, size_t length);
+void register_builtin(const char *name, int (*handler)(char *input_buffer), int flags);
+void init_builtins();
+struct builtin* find_builtin(const char *input_buffer);
+int run_builtin(struct builtin *builtin, char *input_buffer);
+int run_tokens(struct token_list *tokens);
+int run_builtin_argv(struct builtin *builtin, char **argv, unsigned char *operators);
+int execute_line(char *input_buffer);
+char* expand_history(char *input_buffer);
+void record_history(const char *input_buffer);
+int run_external(char *input_buffer);
+char** build_argv(char *input_buffer);
+int tokenize(char *line, struct token_list *tokens);
+int lex_operator(char c, const char *next, const char *fd_prefix, size_t fd_length, struct token_list *tokens);
+void add_token(struct token_list *tokens, char *text, int is_operator);
+int is_operator_char(char c);
+void init_plain_scan(struct plain_scan *scan);
+const char* plain_run_end(struct plain_scan *scan, const char *text);
+size_t scan_plain(const char *text);
+uint64_t classify_chunk_scalar(const char *chunk);
+#if defined(__x86_64__)
+uint64_t classify_chunk_sse2(const char *chunk);
+uint64_t classify_chunk_avx2(const char *chunk);
+#endif
+char* join_argv(char **argv, unsigned char *operators);
+int builtin_alias(char *input_buffer);
+int builtin_endscript(char *input_buffer);
+int builtin_exit(char *input_buffer);
+int builtin_hash(char *input_buffer);
+int builtin_history(char *input_buffer);
+int builtin_script(char *input_buffer);
+int builtin_set(char *input_buffer);
+char* search_path(const char *command);
+char* search_path_from(const char *command, int *dir_index);
+void update_path_index();
+void sync_path_index(const char *path);
+void read_path_events();
+void build_path_dir(struct path_dir *dir);
+void free_path_dir(struct path_dir *dir);
+void clear_path_index();
+struct path_name_slot* find_path_name(struct path_dir *dir, const char *name, unsigned int hash);
+void add_path_name(struct path_dir *dir, const char *name);
+void remove_path_name(struct path_dir *dir, const char *name);
+char** complete_command(const char *prefix, int *count);
+int builtin_which(char *input_buffer);
+char* find_command(const char *command);
+void forget_command(const char *command);
+void clear_command_hash();
+void print_command_hash();
+int set_spawn_backend(const char *input_buffer);
+void init_spawn_request(struct spawn_request *request, const char *path, char **argv);
+pid_t spawn_command(struct spawn_request *request);
+pid_t spawn_with_posix_spawn(struct spawn_request *request);
+pid_t spawn_with_fork(struct spawn_request *request);
+char** build_script_argv(const char *path, char **argv);
+void print_spawn_error(const char *command, int error);
+int apply_launch_settings(const struct launch_settings *settings);
+int start_fork_server();
+void stop_fork_server();
+pid_t spawn_with_server(struct spawn_request *request);
+int send_with_fds(int socket_fd, const void *data, size_t length, const int *fds, int fd_count);
+void fork_server_collect();
+void fork_server_record(struct fork_server_message *message);
+void fork_server_sigchld(int signal_number);
+int run_fork_server(int socket_fd);
+int set_pipe_size(const char *input_buffer);
+int run_pipeline(char *params[], unsigned char *operators, int run_in_background);
+int parse_redirections(char **argv, unsigned char *operators, struct file_redirection *redirections, int max_redirections);
+int builtin_copy(char *input_buffer);
+int copy_fd(int in_fd, int out_fd);
+int builtin_cd(char *input_buffer);
+int builtin_pwd(char *input_buffer);
+int builtin_echo(char *input_buffer);
+int builtin_true(char *input_buffer);
+int builtin_false(char *input_buffer);
+int builtin_export(char *input_buffer);
+int builtin_test(char *input_buffer);
+int evaluate_test(char **args, int count);
 //*****************************************************************************
 
 //Globals
 //*****************************************************************************
-static char args[BUFFER_LENGTH];
-static int head = -1, tail = -1;
-static struct alias_command *alias_head = NULL;
-static struct alias_command *alias_curr = NULL;
+static struct arena g_line_arena;		/* everything that only lives for one line */
+static struct arena g_session_arena;	/* aliases */
+static struct history_store g_history = { -1, -1, NULL, NULL, 0, 0, 0, 0, HISTORY_SIZE };
+static struct history_search_index g_history_search = { NULL, 0, 0, 0, 0 };
+static struct line_editor g_editor;
+static int g_editing = 1;					/* edit lines at a terminal, "set editing off" for cooked input */
+static struct alias_table g_aliases = { NULL, 0, 0, 1 };
 static int running_script = 0;
 static char *script_file_name = NULL;
-static int current_file_line_number = 0;
-static int fd = 0;
-static fpos_t pos;
+static int g_terminal_fd = -1;
+static int g_saved_stderr_fd = -1;
+static int g_transcript_pipe = -1;
+static FILE *g_terminal_stdout = NULL;
+static struct output_buffer g_transcript;
 static int verbose = 0;
 static regex_t g_path_regex;
+static int g_path_regex_compiled = 0;
+static struct command_hash_entry *g_command_hash[COMMAND_HASH_SIZE];
+static struct path_index g_path_index = { NULL, NULL, 0, -1 };
+static int g_spawn_backend = SPAWN_POSIX;
+static int g_fork_server_fd = -1;		/* the shell's end of the fork server socket */
+static pid_t g_fork_server_pid = 0;
+static volatile sig_atomic_t g_fork_server_reap = 0;	/* the fork server has children to reap */
+static int g_pipe_size = 0;
+static int g_last_status = 0;
+static int g_scan_width = 0;		/* bytes classified per instruction (1, 16, 32), 0 until the CPU is probed */
+static struct builtin g_builtins[MAX_BUILTINS];
+static int g_builtin_count = 0;
+static struct builtin *g_builtin_index[BUILTIN_INDEX_SIZE];
+static struct job g_jobs[MAX_JOBS];		/* job N lives in g_jobs[N - 1] */
+static int g_job_count = 0;				/* one past the highest slot in use */
+static int g_current_job = 0;			/* job used by fg/bg without an argument */
+static int g_event_fd = -1;				/* epoll instance every wait of the shell goes through */
+static int g_signal_fd = -1;			/* SIGCHLD, and SIGINT and SIGWINCH when interactive */
+static int g_jobs_changed = 0;
+static int g_interrupted = 0;			/* ^C reached the shell itself */
+static int g_reap_all = 0;				/* some child has no pidfd, so SIGCHLD reaps exits too */
+static int g_deadline_jobs = 0;			/* jobs with a deadline set */
+static int64_t g_command_deadline = 0;	/* set by timeout for the jobs its command starts */
+static struct launch_settings g_launch_defaults = { 0, { { 0 } }, 0, 0, { -1, -1, -1 } };	/* set affinity and set limits */
+static struct launch_settings *g_command_launch = NULL;	/* set by on for the commands it starts */
+static int g_round_robin = 0;			/* place each background process on the next core */
+static cpu_set_t g_round_robin_cpus;
+static int g_next_cpu = 0;				/* where the round robin search for a core starts */
+static const char *g_limit_names[LAUNCH_LIMIT_COUNT] = { "mem", "files", "cputime" };
+static const int g_limit_resources[LAUNCH_LIMIT_COUNT] = { RLIMIT_AS, RLIMIT_NOFILE, RLIMIT_CPU };
+static struct winsize g_window_size;
+static int g_interactive = 0;
+static int g_batch_mode = 0;			/* running -c or a script file, no prompt */
+static pid_t g_shell_process_group = 0;
+static struct termios g_shell_terminal_modes;
+static sigset_t g_sigchld_mask;
+static struct resource_usage g_last_usage;	/* the job that finished last */
+static struct resource_usage g_total_usage;	/* every job that has finished */
+static long g_finished_jobs = 0;
+static int g_time_log = 0;					/* print usage after every job */
+static int g_tracing = 0;
+static struct trace_ring g_trace = { NULL, 0, 0, 0, NULL };
 //*****************************************************************************
 
-int main(void)
+#ifndef SIMPLE_SHELL_NO_MAIN
+int main(int argc, char *argv[])
 {
-	int child_status, history_num = 1;
-	const char space_delimiter[2] = " ";
+	struct line_reader input;
 
-	//Initialize the parameter list and pointer to the current parameter
-	struct param_list *parameter_list = (struct param_list*)malloc(sizeof(struct param_list));
-	struct parameters *current_parameter = NULL;
-	struct previous_commands *prev_commands[MAX_HISTORY];
-
-	//Initialize all of previous commands
-	int cmd_indx;
-	for(cmd_indx = 0; cmd_indx < MAX_HISTORY; cmd_indx++)
+	//The fork server started by "set spawn server" is this binary, run again
+	if (argc == 3 && 0 == strcmp(argv[1], FORK_SERVER_ARGUMENT))
 	{
-		prev_commands[cmd_indx] = (struct previous_commands*)malloc(sizeof(struct previous_commands));
-		prev_commands[cmd_indx]->string = (char*)malloc(sizeof(char));
+		return run_fork_server(atoi(argv[2]));
 	}
 
-	//Compile the regex for finding history commands (!!, !#, etc)
-	regex_t history_command_regex;
-	regcomp(&history_command_regex, "![!|0-9]", 0);
+	//-c "commands" or a script file run in batch mode
+	if (argc > 1)
+	{
+		g_batch_mode = 1;
 
-	regex_t script_regex;
-	regcomp(&script_regex, "script", 0);
+		if (0 == strcmp(argv[1], "-c"))
+		{
+			if (argc < 3)
+			{
+				printf("Error: -c requires an argument\n");
+				return 2;
+			}
 
-	regcomp(&g_path_regex, "set path = ([0-9a-zA-Z/_. )]", 0);
+			line_reader_from_string(&input, argv[2]);
+		}
+		else if (!line_reader_open(&input, argv[1]))
+		{
+			printf("Error: cannot open %s: %s\n", argv[1], strerror(errno));
+			return 127;
+		}
+	}
 
-	regex_t verbose_regex;
-	regcomp(&verbose_regex, "set verbose ", 0);
+	//Open the history shared by every shell of this user
+	char *home = getenv("HOME");
+	char *history_file = (char*)arena_alloc(&g_session_arena, strlen(home ? home : ".") + 16);
+	sprintf(history_file, "%s/.cs543_history", home ? home : ".");
+	history_open(history_file);
 
+	init_builtins();
 	load_init_file();
 
+	if (g_batch_mode)
+	{
+		init_job_control(0);
+		return run_batch(&input);
+	}
+
+	line_reader_init(&input, STDIN_FILENO);
+	input.interactive = isatty(STDIN_FILENO);
+	init_job_control(input.interactive);
+
+	//A terminal that cannot move the cursor gets plain cooked input
+	const char *terminal = getenv("TERM");
+	if (terminal == NULL || 0 == strcmp(terminal, "dumb"))
+	{
+		g_editing = 0;
+	}
+
     while (1)
     {
-    	//If a script is running, print to terminal what was written to the file
+    	//Everything allocated for the previous line is released at once
+    	arena_reset(&g_line_arena);
+
+    	//If a script is running, show and record what its commands wrote since the last prompt
     	if (running_script)
     	{
-    		switch_stdout_to_terminal();
-
-			int ch, num_of_lines = 0;
-			
-			//Get number of lines in the file
-			FILE *file2 = fopen(script_file_name, "r");
-			do
-			{
-				ch = fgetc(file2);
-				if (ch == '\n')
-				{
-					num_of_lines++;
-				}
-			} while (ch != EOF);
-			fclose(file2);
-
-			//Print the most recently added lines from the file to the terminal
-			FILE *file = fopen(script_file_name, "r");
-			int first_newline = 1;
-			int ch2, cur_line_num = 0;;
-			do
-			{
-				ch2 = fgetc(file);
-				
-				if (ch2 == '\n') cur_line_num++;
-
-				if (cur_line_num >= (current_file_line_number + 1) && ch2 != EOF) 
-				{
-					//Do not print the first newline
-					if (cur_line_num == (current_file_line_number + 1) && first_newline)
-					{
-						first_newline = 0;
-					}
-					else
-					{
-						putchar(ch2);
-					}
-				}
-			} while (ch2 != EOF);
-			fclose(file);
+    		transcript_drain();
+    	}
 
-			//Point to the last line printed
-			current_file_line_number = (num_of_lines - current_file_line_number);
+    	//Report background jobs that finished or stopped since the last prompt
+    	if (g_jobs_changed)
+    	{
+    		notify_jobs();
+    	}
 
-		    printf("osh>"); //prints to terminal only
-		    fflush(stdout);
+    	if (running_script)
+    	{
+    		buffer_flush(&g_transcript);
+    	}
 
-			switch_stdout_to_file(1);
+    	//Someone is typing, so this is a free moment to write out trace events
+    	if (g_tracing && input.interactive)
+    	{
+    		trace_flush();
     	}
 
-    	char *command;
+        printf(PROMPT);
+        fflush(stdout);
 
-		int run_in_background = 0;
-		int start_script = 0;
+        char *input_buffer;
 
-        printf("osh>");
-        fflush(stdout);
-        
-        //Get input from stdin
-        fgets(args, BUFFER_LENGTH, stdin);
-        char *input_buffer = remove_newline(args);
-        char *input_copy = (char*)malloc(sizeof(char));
-        strcpy(input_copy, input_buffer);
-
-        if (0 == regexec(&verbose_regex, input_buffer, 0, NULL, 0))
+        if (input.interactive && g_editing)
         {
-        	if (0 == strcmp(input_buffer, "set verbose on"))
-        	{
-        		verbose = 1;
-        		verbose_print("VEBOSE: Enabled verbose\n");
-        	}
-        	else
+        	input_buffer = edit_line(&input);
+        }
+        else
+        {
+        	//Stay responsive to jobs and output until there is a line to read
+        	if (input.interactive)
         	{
-        		verbose_print("VEBOSE: Disabled verbose\n");
-        		verbose = 0;
+        		wait_for_input(&input);
         	}
 
-	        if (running_script)
-	        {
-	        	printf("%s\n", args); //print the stdin to the file
-	        	fflush(stdout);
-	        }
-
-	        if (running_script)
-	        {
-	        	printf("%s\n", args); //print the stdin to the file
-	        	fflush(stdout);
-	        }
-        	continue;
+        	//Get input from stdin
+        	input_buffer = read_line(&input);
         }
 
-        if (set_path(input_buffer))
+        //End of input behaves like exit
+        if (input_buffer == NULL)
         {
-        	if (running_script)
+        	if (input.interactive)
         	{
-        		printf("%s\n", args); //print the stdin to the file
-        		fflush(stdout);	
+        		printf("\n");
         	}
 
-        	continue;
+        	builtin_exit("exit");
         }
-        
-        //if input is endscript and we are writing to a file
-        if (0 == strcmp(input_buffer, "endscript") && running_script)
+
+        if (running_script)
         {
-			printf("%s\n", args); //print the stdin to the file
-			printf("Script done, output file is %s\n", script_file_name); //write to file
-			fflush(stdout);
+        	transcript_record_input(input_buffer);
+        }
+
+        execute_line(input_buffer);
+    }
+   
+	return 0;
+}
+#endif
+
+//*****************************************************************************
+// Abstract: Runs every line of the input without prompting. Output is left
+// to stdio buffering and only flushed before a command is started. Exits
+// with the status of the last command.
+//*****************************************************************************
+int run_batch(struct line_reader *input)
+{
+	char *input_buffer;
+
+	while ((input_buffer = read_line(input)) != NULL)
+	{
+		arena_reset(&g_line_arena);
+
+		if (running_script)
+		{
+			transcript_drain();
+			transcript_record_input(input_buffer);
+		}
+
+		//Finished background jobs only need their slots back
+		if (g_job_count > 0)
+		{
+			run_events(0);
+		}
+
+		if (g_jobs_changed)
+		{
+			notify_jobs();
+		}
+
+		execute_line(input_buffer);
+	}
+
+	line_reader_close(input);
+	return builtin_exit("exit");
+}
+
+//*****************************************************************************
+// Abstract: Runs one line of input. History references are expanded first,
+// then the first word is looked up once in the builtin table; anything that
+// is not a builtin has its alias replaced and is run as an external command.
+// Returns the exit status of the line.
+//*****************************************************************************
+int execute_line(char *input_buffer)
+{
+	uint64_t trace_start = g_tracing ? trace_now() : 0;
+
+	//Check if the line is a history command ex !# or !!
+	if (input_buffer[0] == '!')
+	{
+		input_buffer = expand_history(input_buffer);
+
+		if (g_tracing)
+		{
+			trace_complete("history", trace_start, input_buffer, 0);
+		}
+	}
+
+	//Skip blank lines
+	if (input_buffer[strspn(input_buffer, " ")] == '\0')
+	{
+		return g_last_status;
+	}
+
+	struct builtin *builtin = find_builtin(input_buffer);
+
+	if (builtin == NULL || !(builtin->flags & BUILTIN_NO_HISTORY))
+	{
+		record_history(input_buffer);
+	}
+
+	//Copied now, the line is split up while it runs
+	const char *line = g_tracing ? arena_strdup(&g_line_arena, input_buffer) : NULL;
+
+	if (builtin != NULL)
+	{
+		g_last_status = run_builtin(builtin, input_buffer);
+	}
+	else
+	{
+		g_last_status = run_external(input_buffer);
+	}
+
+	//Skip the line that turned tracing on
+	if (g_tracing && trace_start != 0)
+	{
+		trace_complete("line", trace_start, line, 0);
+	}
+
+	return g_last_status;
+}
+
+//*****************************************************************************
+// Abstract: Replaces a !!, !#, !-# or !prefix line with the matching
+// history command, the newest one starting with prefix for the last.
+// Returns the command, or an empty string if there is no such command.
+//*****************************************************************************
+char* expand_history(char *input_buffer)
+{
+	long history_id;
+	int relative = 0;
+
+	//If the second character is a "!"
+	if (input_buffer[1] == '!')
+	{
+		//get previous history #
+		history_id = 1;
+		relative = 1;
+	}
+	else if (input_buffer[1] == '-')
+	{
+		//count back from the newest command
+		history_id = atol(&input_buffer[2]);
+		relative = 1;
+	}
+	else if (isdigit((unsigned char)input_buffer[1]))
+	{
+		//get input history number
+		history_id = atol(&input_buffer[1]);
+	}
+	else
+	{
+		const char *prefix = &input_buffer[1];
+		size_t length = strcspn(prefix, " \t");
+
+		//0 is never an event, so no match reports "not found"
+		history_id = 0;
+
+		if (length > 0 && g_history.index_fd >= 0)
+		{
+			flock(g_history.index_fd, LOCK_SH);
+			if (0 == history_refresh())
+			{
+				history_index_catch_up(-1);
+
+				long entry = search_history(prefix, length, LONG_MAX, 1);
+				if (entry >= 0)
+				{
+					history_id = (long)g_history.index->first_event + entry;
+				}
+			}
+			flock(g_history.index_fd, LOCK_UN);
+		}
+	}
+
+	return get_history_command(history_id, relative);
+}
+
+//*****************************************************************************
+// Abstract: Adds the input line to the history list
+//*****************************************************************************
+void record_history(const char *input_buffer)
+{
+	//Scripts do not add to the user's history
+	if (!g_batch_mode)
+	{
+		uint64_t trace_start = g_tracing ? trace_now() : 0;
+
+		add_to_history(input_buffer);
+
+		if (g_tracing)
+		{
+			trace_complete("history", trace_start, input_buffer, 0);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Replaces any alias in the input, splits it into tokens and runs
+// the commands. Returns the exit status of the last one.
+//*****************************************************************************
+int run_external(char *input_buffer)
+{
+	uint64_t trace_start = g_tracing ? trace_now() : 0;
+
+	//Check the input to see if we need to replace anything with the aliased commands
+	char *replaced_with_alias = replace_alias(input_buffer);
+
+	if (g_tracing)
+	{
+		trace_complete("alias", trace_start, replaced_with_alias, 0);
+		trace_start = trace_now();
+	}
+
+	//An alias may expand to a builtin
+	struct builtin *builtin = find_builtin(replaced_with_alias);
+	if (builtin != NULL)
+	{
+		return run_builtin(builtin, replaced_with_alias);
+	}
+
+	struct token_list tokens;
+	int error = tokenize(replaced_with_alias, &tokens);
+
+	if (g_tracing)
+	{
+		trace_complete("parse", trace_start, tokens.argv[0], 0);
+	}
+
+	if (error)
+	{
+		return 2;
+	}
+
+	return run_tokens(&tokens);
+}
+
+//*****************************************************************************
+// Abstract: Splits the input line into a NULL terminated argv allocated from
+// the line arena, dropping a trailing &. The line itself is modified. Used
+// by builtins, which only need the words.
+//*****************************************************************************
+char** build_argv(char *input_buffer)
+{
+	struct token_list tokens;
+
+	tokenize(input_buffer, &tokens);
+
+	if (tokens.count > 0 && tokens.operators[tokens.count - 1] && 0 == strcmp(tokens.argv[tokens.count - 1], "&"))
+	{
+		tokens.argv[--tokens.count] = NULL;
+	}
+
+	return tokens.argv;
+}
 
-			switch_stdout_to_terminal();
+//*****************************************************************************
+// Abstract: Splits the line into words and operators in one pass. Words are
+// slices of the line: quotes and backslashes are removed by moving the rest
+// of the word down in place and each word is terminated where it ends.
+// Operators (| & ; < > >> N> N>&M &>) are separate tokens, flagged in
+// tokens->operators so a quoted ">" stays a word. Returns 0, or -1 after
+// printing an error, leaving the words found before it.
+//*****************************************************************************
+int tokenize(char *line, struct token_list *tokens)
+{
+	char *in = line, *out = line;
+	struct plain_scan scan;
+
+	init_plain_scan(&scan);
+	tokens->count = 0;
+	tokens->capacity = strlen(line) / 4 + 8;
+	tokens->argv = (char**)arena_alloc(&g_line_arena, tokens->capacity * sizeof(char*));
+	tokens->operators = (unsigned char*)arena_alloc(&g_line_arena, tokens->capacity);
+	tokens->argv[0] = NULL;
 
-			running_script = 0;
-			current_file_line_number = 0;
+	while (1)
+	{
+		const char *fd_prefix = NULL;
+		size_t fd_length = 0;
+
+		while (*in == ' ' || *in == '\t' || *in == '\n')
+		{
+			in++;
+		}
+
+		char c = *in;
+		if (c == '\0')
+		{
+			break;
+		}
+
+		if (!is_operator_char(c))
+		{
+			//Words are only moved down inside themselves, when quotes are removed
+			char *word = out = in;
+			int quoted = 0;
+
+			while (1)
+			{
+				char *run_end = (char*)plain_run_end(&scan, in);
+				size_t run = run_end - in;
+				if (out != in)
+				{
+					memmove(out, in, run);
+				}
+				out += run;
+				in = run_end;
+				c = *in;
+
+				if (c == '\'')
+				{
+					char *close = strchr(in + 1, '\'');
+					if (close == NULL)
+					{
+						printf("Error: unterminated quote\n");
+						return -1;
+					}
+
+					memmove(out, in + 1, close - (in + 1));
+					out += close - (in + 1);
+					in = close + 1;
+					quoted = 1;
+				}
+				else if (c == '"')
+				{
+					in++;
+					while (*in != '"')
+					{
+						run = strcspn(in, "\"\\");
+						memmove(out, in, run);
+						out += run;
+						in += run;
+
+						if (*in == '\0')
+						{
+							printf("Error: unterminated quote\n");
+							return -1;
+						}
+
+						//Inside double quotes a backslash only escapes these
+						if (*in == '\\')
+						{
+							if (in[1] != '\0' && strchr("\"\\$`\n", in[1]) != NULL)
+							{
+								in++;
+							}
+							*out++ = *in++;
+						}
+					}
+					in++;
+					quoted = 1;
+				}
+				else if (c == '\\')
+				{
+					//A backslash at the very end escapes nothing
+					if (in[1] != '\0')
+					{
+						*out++ = in[1];
+						in++;
+					}
+					in++;
+					quoted = 1;
+				}
+				else if ((unsigned char)c < ' ' && c != '\0' && c != '\t' && c != '\n')
+				{
+					*out++ = *in++;
+				}
+				else
+				{
+					break;
+				}
+			}
+
+			//Digits right before < or > are the descriptor the redirection applies to
+			size_t digits = 0;
+			fd_length = out - word;
+			while (digits < fd_length && isdigit((unsigned char)word[digits]))
+			{
+				digits++;
+			}
+
+			if (!quoted && (c == '<' || c == '>') && fd_length > 0 && digits == fd_length)
+			{
+				fd_prefix = word;
+				out = word;
+			}
+			else
+			{
+				add_token(tokens, word, 0);
+
+				//This may land on the character that ended the word, which is in c
+				*out++ = '\0';
+
+				if (c == '\0')
+				{
+					break;
+				}
+				if (c == ' ' || c == '\t' || c == '\n')
+				{
+					in++;
+					continue;
+				}
+				fd_length = 0;
+			}
+		}
+
+		in += lex_operator(c, in + 1, fd_prefix, fd_length, tokens);
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Adds the operator starting with c (followed by next) to the
+// token list, with the descriptor digits in fd_prefix in front of it.
+// Returns the number of characters of the line it took.
+//*****************************************************************************
+int lex_operator(char c, const char *next, const char *fd_prefix, size_t fd_length, struct token_list *tokens)
+{
+	size_t length = 1;
+
+	if (c == '|' || c == ';' || (c == '&' && next[0] != '>'))
+	{
+		add_token(tokens, (c == '|') ? "|" : (c == ';') ? ";" : "&", 1);
+		return 1;
+	}
+
+	if (c == '&')
+	{
+		length = (next[1] == '>') ? 3 : 2;
+		add_token(tokens, (length == 3) ? "&>>" : "&>", 1);
+		return length;
+	}
+
+	//< > >> <& >& with the descriptor they duplicate
+	if (c == '>' && next[0] == '>')
+	{
+		length = 2;
+	}
+	else if (next[0] == '&')
+	{
+		length = 2 + strspn(&next[1], "0123456789");
+	}
+
+	char *text = (char*)arena_alloc(&g_line_arena, fd_length + length + 1);
+	if (fd_length > 0)
+	{
+		memcpy(text, fd_prefix, fd_length);
+	}
+	text[fd_length] = c;
+	memcpy(&text[fd_length + 1], next, length - 1);
+	text[fd_length + length] = '\0';
+
+	add_token(tokens, text, 1);
+	return length;
+}
+
+//*****************************************************************************
+// Abstract: Appends a token to the list, growing it in the line arena when
+// it is full. The argv is kept NULL terminated.
+//*****************************************************************************
+void add_token(struct token_list *tokens, char *text, int is_operator)
+{
+	if (tokens->count + 2 > tokens->capacity)
+	{
+		int capacity = tokens->capacity * 2;
+		char **argv = (char**)arena_alloc(&g_line_arena, capacity * sizeof(char*));
+		unsigned char *operators = (unsigned char*)arena_alloc(&g_line_arena, capacity);
+
+		memcpy(argv, tokens->argv, tokens->count * sizeof(char*));
+		memcpy(operators, tokens->operators, tokens->count);
+
+		tokens->argv = argv;
+		tokens->operators = operators;
+		tokens->capacity = capacity;
+	}
+
+	tokens->operators[tokens->count] = is_operator;
+	tokens->argv[tokens->count++] = text;
+	tokens->argv[tokens->count] = NULL;
+}
+
+//*****************************************************************************
+// Abstract: Returns true if c starts an operator
+//*****************************************************************************
+int is_operator_char(char c)
+{
+	return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+//*****************************************************************************
+// Abstract: Prepares a scan of text for plain runs with the widest vectors
+// the CPU has
+//*****************************************************************************
+void init_plain_scan(struct plain_scan *scan)
+{
+#if defined(__x86_64__)
+	if (g_scan_width == 0)
+	{
+		__builtin_cpu_init();
+		g_scan_width = __builtin_cpu_supports("avx2") ? 32 : 16;
+	}
+
+	scan->classify = (g_scan_width == 32) ? classify_chunk_avx2
+		: (g_scan_width == 16) ? classify_chunk_sse2 : classify_chunk_scalar;
+#else
+	scan->classify = classify_chunk_scalar;
+#endif
+	scan->chunk = NULL;
+	scan->bits = 0;
+}
+
+//*****************************************************************************
+// Abstract: Returns where the run of plain characters starting at text
+// ends: the first blank, control character, quote, backslash, operator or
+// the terminator. Each 64 byte block is classified once, so the words of a
+// block cost a bit scan each. The scan must only move forward.
+//*****************************************************************************
+const char* plain_run_end(struct plain_scan *scan, const char *text)
+{
+	while (1)
+	{
+		if (scan->chunk == NULL || text >= scan->chunk + 64)
+		{
+			scan->chunk = (const char*)((uintptr_t)text & ~(uintptr_t)63);
+			scan->bits = scan->classify(scan->chunk);
+		}
+
+		uint64_t bits = scan->bits & (~0ULL << (text - scan->chunk));
+		if (bits != 0)
+		{
+			return scan->chunk + __builtin_ctzll(bits);
+		}
+
+		text = scan->chunk + 64;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Returns how many characters at the start of text are plain
+//*****************************************************************************
+size_t scan_plain(const char *text)
+{
+	struct plain_scan scan;
+
+	init_plain_scan(&scan);
+	return plain_run_end(&scan, text) - text;
+}
+
+//*****************************************************************************
+// Abstract: Classifies the 64 byte aligned block a byte at a time. Bit n of
+// the result is set if chunk[n] is not plain, which includes the terminator.
+// The whole block is classified even past a NUL: the block can start before
+// the string, and a NUL there ends some other string. Aligned blocks never
+// cross a page, but the address sanitizer cannot know that is harmless.
+//*****************************************************************************
+__attribute__((no_sanitize_address))
+uint64_t classify_chunk_scalar(const char *chunk)
+{
+	uint64_t bits = 0;
+	int i;
+
+	for (i = 0; i < 64; i++)
+	{
+		unsigned char c = chunk[i];
+
+		if (c <= ' ' || c == '\'' || c == '"' || c == '\\' || is_operator_char(c))
+		{
+			bits |= 1ULL << i;
+		}
+	}
+
+	return bits;
+}
+
+#if defined(__x86_64__)
+//*****************************************************************************
+// Abstract: classify_chunk_scalar 16 bytes at a time. Everything after the
+// terminator is classified too, which only sets more bits past it.
+//*****************************************************************************
+__attribute__((no_sanitize_address))
+uint64_t classify_chunk_sse2(const char *chunk)
+{
+	const __m128i blank = _mm_set1_epi8(' ');
+	uint64_t bits = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		__m128i bytes = _mm_load_si128((const __m128i*)&chunk[i * 16]);
+
+		//Unsigned bytes up to ' ' cover the terminator, blanks and control characters
+		__m128i special = _mm_cmpeq_epi8(_mm_max_epu8(bytes, blank), blank);
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\'')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('|')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('&')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(';')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<')));
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>')));
+
+		bits |= (uint64_t)(unsigned int)_mm_movemask_epi8(special) << (i * 16);
+	}
+
+	return bits;
+}
+
+//*****************************************************************************
+// Abstract: classify_chunk_scalar 32 bytes at a time
+//*****************************************************************************
+__attribute__((target("avx2"), no_sanitize_address))
+uint64_t classify_chunk_avx2(const char *chunk)
+{
+	const __m256i blank = _mm256_set1_epi8(' ');
+	uint64_t bits = 0;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		__m256i bytes = _mm256_load_si256((const __m256i*)&chunk[i * 32]);
+
+		__m256i special = _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, blank), blank);
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\'')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('|')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('&')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(';')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('<')));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('>')));
+
+		bits |= (uint64_t)(unsigned int)_mm256_movemask_epi8(special) << (i * 32);
+	}
+
+	return bits;
+}
+#endif
+
+//*****************************************************************************
+// Abstract: Joins argv back into a line that tokenizes to the same tokens,
+// single quoting the words that need it. Tokens flagged in operators (which
+// may be NULL) are left as they are. Allocated from the line arena.
+//*****************************************************************************
+char* join_argv(char **argv, unsigned char *operators)
+{
+	size_t length = 1;
+	int i;
+
+	//A ' becomes '\'' in the worst case
+	for (i = 0; argv[i] != NULL; i++)
+	{
+		length += 4 * strlen(argv[i]) + 3;
+	}
+
+	char *line = (char*)arena_alloc(&g_line_arena, length);
+	char *out = line;
+
+	for (i = 0; argv[i] != NULL; i++)
+	{
+		const char *word = argv[i];
+		size_t word_length = strlen(word);
+
+		if (i > 0)
+		{
+			*out++ = ' ';
+		}
+
+		if ((word_length > 0 && scan_plain(word) == word_length) || (operators != NULL && operators[i]))
+		{
+			memcpy(out, word, word_length);
+			out += word_length;
+			continue;
+		}
+
+		*out++ = '\'';
+		for (; *word != '\0'; word++)
+		{
+			if (*word == '\'')
+			{
+				memcpy(out, "'\\''", 4);
+				out += 4;
+			}
+			else
+			{
+				*out++ = *word;
+			}
+		}
+		*out++ = '\'';
+	}
+
+	*out = '\0';
+	return line;
+}
+
+//*****************************************************************************
+// Abstract: Returns the hash of length bytes of data. Matches hash_string
+// for the same characters.
+//*****************************************************************************
+unsigned int hash_bytes(const char *data, size_t length)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+//*****************************************************************************
+// Abstract: Adds a builtin to the builtin table. Builtins registered later
+// replace earlier ones with the same name. A full table stops the shell at
+// startup, a builtin must never quietly become a PATH lookup.
+//*****************************************************************************
+void register_builtin(const char *name, int (*handler)(char *input_buffer), int flags)
+{
+	unsigned int slot = hash_string(name) & (BUILTIN_INDEX_SIZE - 1);
+
+	//Linear probing, the index is kept at most half full
+	while (g_builtin_index[slot] != NULL)
+	{
+		if (0 == strcmp(g_builtin_index[slot]->name, name))
+		{
+			g_builtin_index[slot]->handler = handler;
+			g_builtin_index[slot]->flags = flags;
+			return;
+		}
+		slot = (slot + 1) & (BUILTIN_INDEX_SIZE - 1);
+	}
+
+	if (g_builtin_count == MAX_BUILTINS)
+	{
+		printf("Error: no room for builtin \"%s\", raise MAX_BUILTINS\n", name);
+		exit(1);
+	}
+
+	struct builtin *builtin = &g_builtins[g_builtin_count++];
+	builtin->name = name;
+	builtin->handler = handler;
+	builtin->flags = flags;
+	g_builtin_index[slot] = builtin;
+}
+
+//*****************************************************************************
+// Abstract: Registers the commands the shell runs itself
+//*****************************************************************************
+void init_builtins()
+{
+	register_builtin("[", builtin_test, 0);
+	register_builtin("alias", builtin_alias, 0);
+	register_builtin("bg", builtin_bg, 0);
+	register_builtin("cd", builtin_cd, 0);
+	register_builtin("copy", builtin_copy, 0);
+	register_builtin("echo", builtin_echo, 0);
+	register_builtin("endscript", builtin_endscript, BUILTIN_NO_HISTORY);
+	register_builtin("exit", builtin_exit, 0);
+	register_builtin("export", builtin_export, 0);
+	register_builtin("false", builtin_false, 0);
+	register_builtin("fg", builtin_fg, 0);
+	register_builtin("hash", builtin_hash, 0);
+	register_builtin("history", builtin_history, 0);
+	register_builtin("jobs", builtin_jobs, 0);
+	register_builtin("kill", builtin_kill, 0);
+	register_builtin("on", builtin_on, BUILTIN_RAW_LINE);
+	register_builtin("parallel", builtin_parallel, 0);
+	register_builtin("pwd", builtin_pwd, 0);
+	register_builtin("rehash", builtin_hash, 0);
+	register_builtin("script", builtin_script, BUILTIN_NO_HISTORY);
+	register_builtin("set", builtin_set, BUILTIN_NO_HISTORY);
+	register_builtin("test", builtin_test, 0);
+	register_builtin("time", builtin_time, BUILTIN_RAW_LINE);
+	register_builtin("timeout", builtin_timeout, BUILTIN_RAW_LINE);
+	register_builtin("times", builtin_times, 0);
+	register_builtin("true", builtin_true, 0);
+	register_builtin("unalias", builtin_unalias, 0);
+	register_builtin("wait", builtin_wait, 0);
+	register_builtin("which", builtin_which, 0);
+}
+
+//*****************************************************************************
+// Abstract: Looks up the first word of the input in the builtin table.
+// Returns the builtin or NULL if the word is not a builtin.
+//*****************************************************************************
+struct builtin* find_builtin(const char *input_buffer)
+{
+	const char *word = input_buffer + strspn(input_buffer, " ");
+	size_t length = strcspn(word, " ");
+	unsigned int slot = hash_bytes(word, length) & (BUILTIN_INDEX_SIZE - 1);
+
+	while (g_builtin_index[slot] != NULL)
+	{
+		const char *name = g_builtin_index[slot]->name;
+
+		if (0 == strncmp(name, word, length) && name[length] == '\0')
+		{
+			return g_builtin_index[slot];
+		}
+		slot = (slot + 1) & (BUILTIN_INDEX_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+//*****************************************************************************
+// Abstract: Runs a builtin inside the shell. A line with nothing but words
+// goes straight to the builtin, anything with operators is tokenized and
+// run as a command list. A raw line builtin gets the whole line unless it
+// may hold more than one command. Returns the builtin's exit status.
+//*****************************************************************************
+int run_builtin(struct builtin *builtin, char *input_buffer)
+{
+	struct token_list tokens;
+	const char *special = (builtin->flags & BUILTIN_RAW_LINE) ? ";&" : "<>|;&'\"\\";
+
+	//Nearly every line is a single command of plain words
+	if (strpbrk(input_buffer, special) == NULL)
+	{
+		return builtin->handler(input_buffer);
+	}
+
+	if (0 != tokenize(arena_strdup(&g_line_arena, input_buffer), &tokens))
+	{
+		return 2;
+	}
+
+	return run_tokens(&tokens);
+}
+
+//*****************************************************************************
+// Abstract: Runs the commands of a token list one after another. A command
+// ends at ; or at &, which also puts it in the background. Builtins run in
+// the shell unless they are part of a pipeline or in the background, and
+// aliases are replaced in every command. A raw line builtin such as time or
+// on wraps only its own command. Returns the status of the last command.
+//*****************************************************************************
+int run_tokens(struct token_list *tokens)
+{
+	int start = 0, end, status = 0;
+
+	while (start < tokens->count)
+	{
+		int run_in_background = 0, pipeline = 0;
+
+		for (end = start; end < tokens->count; end++)
+		{
+			const char *token = tokens->argv[end];
+
+			if (tokens->operators[end] && (0 == strcmp(token, ";") || 0 == strcmp(token, "&")))
+			{
+				run_in_background = (token[0] == '&');
+				break;
+			}
+
+			if (tokens->operators[end] && 0 == strcmp(token, "|"))
+			{
+				pipeline = 1;
+			}
+		}
+
+		if (end == start)
+		{
+			printf("Error: syntax error near \"%s\"\n", tokens->argv[end]);
+			return 2;
+		}
+
+		char **argv = &tokens->argv[start];
+		unsigned char *operators = &tokens->operators[start];
+		tokens->argv[end] = NULL;
+
+		struct builtin *builtin = find_builtin(argv[0]);
+
+		//The first command of the line has had its alias replaced already
+		int aliased = (start > 0 && find_alias(argv[0], strlen(argv[0])) != NULL);
+		int raw_line = (builtin != NULL && (builtin->flags & BUILTIN_RAW_LINE));
+
+		if (aliased || raw_line)
+		{
+			char *line = join_argv(argv, operators);
+
+			if (run_in_background)
+			{
+				char *background_line = (char*)arena_alloc(&g_line_arena, strlen(line) + 3);
+				sprintf(background_line, "%s &", line);
+				line = background_line;
+			}
+
+			status = aliased ? run_external(line) : builtin->handler(line);
+		}
+		else if (builtin != NULL && !pipeline && !run_in_background)
+		{
+			status = run_builtin_argv(builtin, argv, operators);
+		}
+		else
+		{
+			status = run_pipeline(argv, operators, run_in_background);
+		}
+
+		start = end + 1;
+	}
+
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: Runs a builtin inside the shell with the words in argv.
+// Redirections are applied to the shell's own descriptors while it runs,
+// the way a child would get them, and the builtin sees the line without
+// them. Returns the builtin's exit status.
+//*****************************************************************************
+int run_builtin_argv(struct builtin *builtin, char **argv, unsigned char *operators)
+{
+	struct file_redirection redirections[MAX_REDIRECTIONS];
+	int saved_fds[MAX_REDIRECTIONS];
+	const char *failed_path = NULL;
+	int count, applied, failed_errno = 0, status = 1, i;
+
+	count = parse_redirections(argv, operators, redirections, MAX_REDIRECTIONS);
+	if (count < 0)
+	{
+		return 1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	for (applied = 0; applied < count; applied++)
+	{
+		struct file_redirection *redirection = &redirections[applied];
+		int source_fd = redirection->source_fd;
+
+		if (redirection->path != NULL)
+		{
+			source_fd = open(redirection->path, redirection->flags | O_CLOEXEC, 0666);
+			if (source_fd < 0)
+			{
+				failed_path = redirection->path;
+				failed_errno = errno;
+				break;
+			}
+		}
+
+		//Kept out of the way of low descriptors a later redirection may name
+		saved_fds[applied] = fcntl(redirection->fd, F_DUPFD_CLOEXEC, 10);
+
+		//The descriptors of a failed redirection go here, the ones before it are undone below
+		if (dup2(source_fd, redirection->fd) < 0)
+		{
+			failed_errno = errno;
+			if (saved_fds[applied] >= 0)
+			{
+				close(saved_fds[applied]);
+			}
+			if (redirection->path != NULL)
+			{
+				close(source_fd);
+			}
+			break;
+		}
+
+		if (redirection->path != NULL && source_fd != redirection->fd)
+		{
+			close(source_fd);
+		}
+	}
+
+	if (applied == count)
+	{
+		//While a script runs stdout does not write to descriptor 1, so it follows it here
+		FILE *saved_stdout = NULL;
+		for (i = 0; i < count && running_script; i++)
+		{
+			if (redirections[i].fd == STDOUT_FILENO && saved_stdout == NULL)
+			{
+				saved_stdout = stdout;
+				stdout = fdopen(fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10), "w");
+			}
+		}
+
+		//The builtin parses the line again, so hand it the words that are left
+		status = builtin->handler(join_argv(argv, NULL));
+
+		if (saved_stdout != NULL)
+		{
+			fclose(stdout);
+			stdout = saved_stdout;
+		}
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	//Undo in reverse so a descriptor redirected twice ends up as it started
+	for (i = applied - 1; i >= 0; i--)
+	{
+		if (saved_fds[i] >= 0)
+		{
+			dup2(saved_fds[i], redirections[i].fd);
+			close(saved_fds[i]);
+		}
+		else
+		{
+			close(redirections[i].fd);
+		}
+	}
+
+	if (failed_path != NULL)
+	{
+		printf("Error: cannot open %s: %s\n", failed_path, strerror(failed_errno));
+	}
+	else if (applied < count)
+	{
+		//With a file opened it can only be the descriptor it goes to that is bad
+		int bad_fd = (redirections[applied].path != NULL) ? redirections[applied].fd : redirections[applied].source_fd;
+		printf("Error: %d: %s\n", bad_fd, strerror(failed_errno));
+	}
+
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: alias with no arguments prints the aliases, otherwise the alias
+// in the input is saved
+//*****************************************************************************
+int builtin_alias(char *input_buffer)
+{
+	//if the input is more than "alias"
+	if ((int)strlen(input_buffer) > 5)
+	{
+		save_alias(input_buffer);
+	}
+	//Else the user wants to print the aliases
+	else
+	{
+		print_aliases();
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Stops the running script
+//*****************************************************************************
+int builtin_endscript(char *input_buffer)
+{
+	//if we are writing to a file
+	if (running_script)
+	{
+		printf("Script done, output file is %s\n", script_file_name); //write to console and file
+		fflush(stdout);
+
+		stop_transcript();
+
+		free(script_file_name);
+		script_file_name = NULL;
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Frees the shell's memory and exits with the input status, or the
+// status of the last command if none is given
+//*****************************************************************************
+int builtin_exit(char *input_buffer)
+{
+	const char *status = input_buffer + strlen("exit");
+	int exit_status = (*status == ' ') ? atoi(status) : g_last_status;
+
+	if (running_script)
+	{
+		builtin_endscript(input_buffer);
+	}
+
+	trace_close();
+
+	//cleanup memory here
+	remove_alias(NULL);
+	free(g_aliases.slots);
+	clear_command_hash();
+	clear_path_index();
+	clear_history_index();
+	arena_free(&g_line_arena);
+	arena_free(&g_session_arena);
+
+	fflush(stdout);
+	exit(exit_status);
+}
+
+//*****************************************************************************
+// Abstract: hash shows the command location cache, hash -r and rehash
+// reset it and the PATH index
+//*****************************************************************************
+int builtin_hash(char *input_buffer)
+{
+	if (0 == strncmp(input_buffer, "rehash", 6) || NULL != strstr(input_buffer, " -r"))
+	{
+		clear_command_hash();
+		clear_path_index();
+	}
+	else
+	{
+		print_command_hash();
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: which [-a] name ... prints where each name would be run from,
+// or every match in PATH with -a. Returns 1 if a name was not found.
+//*****************************************************************************
+int builtin_which(char *input_buffer)
+{
+	char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	int all = 0, status = 0, i = 1;
+	struct stat file_stat;
+
+	if (argv[i] != NULL && 0 == strcmp(argv[i], "-a"))
+	{
+		all = 1;
+		i++;
+	}
+
+	update_path_index();
+
+	for (; argv[i] != NULL; i++)
+	{
+		int dir_index = 0, found = 0;
+		char *path;
+
+		if (strchr(argv[i], '/') != NULL)
+		{
+			if (0 == stat(argv[i], &file_stat) && S_ISREG(file_stat.st_mode) && 0 == access(argv[i], X_OK))
+			{
+				printf("%s\n", argv[i]);
+				found = 1;
+			}
+		}
+		else
+		{
+			while ((found == 0 || all) && (path = search_path_from(argv[i], &dir_index)) != NULL)
+			{
+				printf("%s\n", path);
+				free(path);
+				found = 1;
+			}
+		}
+
+		if (!found)
+		{
+			status = 1;
+		}
+	}
+
+	fflush(stdout);
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: history [n] prints the last n (default 10) history commands
+//*****************************************************************************
+int builtin_history(char *input_buffer)
+{
+	const char *count = input_buffer + strlen("history");
+
+	print_history((*count == ' ') ? atol(count) : MAX_HISTORY);
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: script [file] starts teeing the session into file (typescript
+// if no file is given)
+//*****************************************************************************
+int builtin_script(char *input_buffer)
+{
+	char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	char *file_name = argv[1];
+	int status = 1;
+
+	if (running_script)
+	{
+		printf("Error: script already running, output file is %s\n", script_file_name);
+	}
+	else if (start_transcript((file_name == NULL) ? "typescript" : file_name))
+	{
+		script_file_name = strdup((file_name == NULL) ? "typescript" : file_name);
+
+		printf("Script started, output file is %s\n", script_file_name); //write to console and file
+		fflush(stdout);
+		status = 0;
+	}
+
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: Handles every "set" command: verbose, path, spawn, pipesize,
+// history, timelog, trace, editing, affinity and limits
+//*****************************************************************************
+int builtin_set(char *input_buffer)
+{
+	if (0 == strncmp(input_buffer, "set verbose ", 12))
+	{
+		if (0 == strcmp(input_buffer, "set verbose on"))
+		{
+			verbose = 1;
+			verbose_print("VEBOSE: Enabled verbose\n");
+		}
+		else
+		{
+			verbose_print("VEBOSE: Disabled verbose\n");
+			verbose = 0;
+		}
+
+		return 0;
+	}
+
+	if (set_path(input_buffer) || set_spawn_backend(input_buffer) || set_pipe_size(input_buffer)
+		|| set_history_size(input_buffer) || set_time_log(input_buffer) || set_trace(input_buffer)
+		|| set_editing(input_buffer) || set_affinity(input_buffer) || set_limits(input_buffer))
+	{
+		return 0;
+	}
+
+	printf("Error: unknown setting \"%s\"\n", input_buffer);
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Opens the history log file_name and its offset index
+// file_name.idx and maps both. The log holds one command per line and the
+// index holds a header and the log offset of every event, so event N is a
+// single array lookup. If the files cannot be opened the history only lasts
+// for this session. Returns 1 if the history is persistent.
+//*****************************************************************************
+int history_open(const char *file_name)
+{
+	char index_name[strlen(file_name) + 5];
+	int persistent = 1;
+
+	sprintf(index_name, "%s.idx", file_name);
+
+	g_history.log_fd = open(file_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	g_history.index_fd = open(index_name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+
+	if (g_history.log_fd < 0 || g_history.index_fd < 0)
+	{
+		if (g_history.log_fd >= 0) close(g_history.log_fd);
+		if (g_history.index_fd >= 0) close(g_history.index_fd);
+
+		g_history.log_fd = open("/tmp", O_RDWR | O_TMPFILE | O_APPEND | O_CLOEXEC, 0600);
+		g_history.index_fd = open("/tmp", O_RDWR | O_TMPFILE | O_APPEND | O_CLOEXEC, 0600);
+		persistent = 0;
+	}
+
+	//The first shell to see an empty index writes its header
+	flock(g_history.index_fd, LOCK_EX);
+
+	struct stat index_stat;
+	if (0 == fstat(g_history.index_fd, &index_stat) && index_stat.st_size == 0)
+	{
+		struct history_header header;
+		memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+		header.first_event = 1;
+		write_all(g_history.index_fd, (const char*)&header, sizeof(header));
+	}
+
+	if (0 != history_refresh())
+	{
+		history_rebuild();
+	}
+
+	flock(g_history.index_fd, LOCK_UN);
+
+	return persistent;
+}
+
+//*****************************************************************************
+// Abstract: Picks up entries appended by other shells. The mappings are
+// reserved in large steps, so they only move when a file outgrows them.
+// Must be called with the index locked. Returns 0 on success.
+//*****************************************************************************
+int history_refresh()
+{
+	struct stat log_stat, index_stat;
+
+	if (0 != fstat(g_history.log_fd, &log_stat) || 0 != fstat(g_history.index_fd, &index_stat))
+	{
+		return -1;
+	}
+
+	g_history.log_size = log_stat.st_size;
+	g_history.index_size = index_stat.st_size;
+
+	if (g_history.log_size > g_history.log_mapped || g_history.log == NULL)
+	{
+		if (g_history.log != NULL) munmap(g_history.log, g_history.log_mapped);
+
+		g_history.log_mapped = (g_history.log_size / HISTORY_MAP_CHUNK + 1) * HISTORY_MAP_CHUNK;
+		g_history.log = (char*)mmap(NULL, g_history.log_mapped, PROT_READ | PROT_WRITE,
+			MAP_SHARED, g_history.log_fd, 0);
+	}
+
+	if (g_history.index_size > g_history.index_mapped || g_history.index == NULL)
+	{
+		if (g_history.index != NULL) munmap(g_history.index, g_history.index_mapped);
+
+		g_history.index_mapped = (g_history.index_size / HISTORY_MAP_CHUNK + 1) * HISTORY_MAP_CHUNK;
+		g_history.index = (struct history_header*)mmap(NULL, g_history.index_mapped,
+			PROT_READ | PROT_WRITE, MAP_SHARED, g_history.index_fd, 0);
+	}
+
+	//Drop both mappings, so the next refresh maps them again and no lookup uses a stale one
+	if (g_history.log == MAP_FAILED || g_history.index == MAP_FAILED || !history_index_valid())
+	{
+		if (g_history.log != MAP_FAILED) munmap(g_history.log, g_history.log_mapped);
+		if (g_history.index != MAP_FAILED) munmap(g_history.index, g_history.index_mapped);
+
+		g_history.log = NULL;
+		g_history.index = NULL;
+		g_history.log_mapped = g_history.index_mapped = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Returns 1 if the mapped index is ours, holds whole offsets and
+// every offset is in order and inside the log. Offsets checked by an earlier
+// refresh are not checked again until the history is compacted.
+//*****************************************************************************
+int history_index_valid()
+{
+	struct history_header *index = g_history.index;
+	long total, i;
+
+	if (g_history.index_size < sizeof(struct history_header)
+		|| (g_history.index_size - sizeof(struct history_header)) % sizeof(uint64_t) != 0
+		|| 0 != memcmp(index->magic, HISTORY_MAGIC, sizeof(index->magic)))
+	{
+		return 0;
+	}
+
+	total = history_count();
+	if (g_history.checked > total || g_history.checked_first_event != index->first_event)
+	{
+		g_history.checked = 0;
+		g_history.checked_first_event = index->first_event;
+	}
+
+	for (i = (g_history.checked > 0) ? g_history.checked : 1; i < total; i++)
+	{
+		if (index->offsets[i] <= index->offsets[i - 1])
+		{
+			return 0;
+		}
+	}
+
+	if (total > 0 && index->offsets[total - 1] >= g_history.log_size)
+	{
+		return 0;
+	}
+
+	g_history.checked = total;
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Writes the index again from the newlines in the log, for an
+// index that history_refresh refused. Event numbers carry on from the old
+// header when it is still readable. Must be called with the index locked
+// exclusively.
+//*****************************************************************************
+void history_rebuild()
+{
+	struct history_header header;
+	uint64_t offset = 0, line_start = 0;
+	char buffer[65536];
+	ssize_t count;
+
+	memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+	if (sizeof(header) != pread(g_history.index_fd, &header, sizeof(header), 0)
+		|| 0 != memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic)))
+	{
+		memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+		header.first_event = 1;
+	}
+
+	printf("Error: history index is damaged, rebuilding it\n");
+
+	ftruncate(g_history.index_fd, 0);
+	write_all(g_history.index_fd, (const char*)&header, sizeof(header));
+
+	while ((count = pread(g_history.log_fd, buffer, sizeof(buffer), offset)) > 0)
+	{
+		ssize_t i;
+
+		for (i = 0; i < count; i++)
+		{
+			if (buffer[i] == '\n')
+			{
+				write_all(g_history.index_fd, (const char*)&line_start, sizeof(line_start));
+				line_start = offset + i + 1;
+			}
+		}
+
+		offset += count;
+	}
+
+	//A torn last line is dropped from the log, so the next append starts clean
+	ftruncate(g_history.log_fd, line_start);
+
+	g_history.checked = 0;
+	history_refresh();
+}
+
+//*****************************************************************************
+// Abstract: Returns the number of events in the index
+//*****************************************************************************
+long history_count()
+{
+	return (g_history.index_size - sizeof(struct history_header)) / sizeof(uint64_t);
+}
+
+//*****************************************************************************
+// Abstract: Drops the oldest events so only size_limit remain. Both files
+// are rewritten in place through their mappings, which other shells only
+// read under the lock. Must be called with the index locked exclusively.
+//*****************************************************************************
+void history_compact()
+{
+	long count = history_count();
+	long keep = g_history.size_limit;
+	long drop = count - keep;
+	long i;
+
+	if (drop <= 0)
+	{
+		return;
+	}
+
+	uint64_t base = g_history.index->offsets[drop];
+
+	if (base > g_history.log_size)
+	{
+		history_rebuild();
+		return;
+	}
+
+	memmove(g_history.log, &g_history.log[base], g_history.log_size - base);
+	ftruncate(g_history.log_fd, g_history.log_size - base);
+
+	for (i = 0; i < keep; i++)
+	{
+		g_history.index->offsets[i] = g_history.index->offsets[drop + i] - base;
+	}
+	g_history.index->first_event += drop;
+	ftruncate(g_history.index_fd, sizeof(struct history_header) + keep * sizeof(uint64_t));
+
+	history_refresh();
+}
+
+//*****************************************************************************
+// Abstract: Appends a command to the history. The log and index are both
+// opened O_APPEND and written under an exclusive lock, so any number of
+// shells can share the same files.
+//*****************************************************************************
+void add_to_history(const char *command)
+{
+	if (g_history.index_fd < 0)
+	{
+		return;
+	}
+
+	flock(g_history.index_fd, LOCK_EX);
+
+	struct stat log_stat;
+	if (0 == fstat(g_history.log_fd, &log_stat))
+	{
+		size_t length = strlen(command);
+		uint64_t offset = log_stat.st_size;
+		char *entry = (char*)arena_alloc(&g_line_arena, length + 1);
+
+		memcpy(entry, command, length);
+		entry[length] = '\n';
+
+		write_all(g_history.log_fd, entry, length + 1);
+		write_all(g_history.index_fd, (const char*)&offset, sizeof(offset));
+
+		if (0 != history_refresh())
+		{
+			history_rebuild();
+		}
+
+		//Compacting only once twice the limit is reached keeps it rare
+		if (g_history.index != NULL && history_count() > 2 * g_history.size_limit)
+		{
+			history_compact();
+		}
+	}
+
+	flock(g_history.index_fd, LOCK_UN);
+}
+
+//*****************************************************************************
+// Abstract: Prints up to the input number of the most recent commands,
+// newest first
+//*****************************************************************************
+void print_history(long count)
+{
+	long i;
+
+	if (g_history.index_fd < 0)
+	{
+		return;
+	}
+
+	flock(g_history.index_fd, LOCK_SH);
+
+	if (0 == history_refresh())
+	{
+		long total = history_count();
+		uint64_t first_event = g_history.index->first_event;
+
+		if (count > total || count <= 0)
+		{
+			count = total;
+		}
+
+		for (i = total - 1; i >= total - count; i--)
+		{
+			size_t length;
+			const char *text = history_entry(i, &length);
+
+			printf("%lu %.*s\n", (unsigned long)(first_event + i), (int)length, text);
+		}
+	}
+
+	flock(g_history.index_fd, LOCK_UN);
+}
+
+//*****************************************************************************
+// Abstract: Returns the command with the input history ID number, or with
+// relative set, the command id places back from the newest (1 is the last).
+// If nothing matches, an empty string is returned.
+//*****************************************************************************
+char* get_history_command(long id, int relative)
+{
+	char *return_val = "";
+
+	if (g_history.index_fd < 0)
+	{
+		return return_val;
+	}
+
+	flock(g_history.index_fd, LOCK_SH);
+
+	if (0 == history_refresh())
+	{
+		long total = history_count();
+		long i = relative ? total - id : id - (long)g_history.index->first_event;
+
+		//!-0 and !0 are never events
+		if (id <= 0)
+		{
+			i = -1;
+		}
+
+		if (i >= 0 && i < total)
+		{
+			size_t length;
+			const char *text = history_entry(i, &length);
+
+			return_val = (char*)arena_alloc(&g_line_arena, length + 1);
+			memcpy(return_val, text, length);
+			return_val[length] = '\0';
+
+			printf("%s\n", return_val);
+		}
+		else
+		{
+			printf("Error: history event not found\n");
+		}
+	}
+
+	flock(g_history.index_fd, LOCK_UN);
+
+	return return_val;
+}
+
+//*****************************************************************************
+// Abstract: Sets how many commands the history keeps from
+// "set history <n>". Returns 1 if the input was a history setting.
+//*****************************************************************************
+int set_history_size(const char *input_buffer)
+{
+	const char setting[] = "set history ";
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	long size = atol(&input_buffer[strlen(setting)]);
+	g_history.size_limit = (size > 0) ? size : 1;
+
+	verbose_print("VEBOSE: History size set to %ld\n", g_history.size_limit);
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Returns entry i of the history log (0 is the oldest kept) and
+// its length without the newline. An entry whose offsets are out of order
+// or past the log reads as empty. Must be called with the index locked.
+//*****************************************************************************
+const char* history_entry(long i, size_t *length)
+{
+	uint64_t start = g_history.index->offsets[i];
+	uint64_t end = (i + 1 < history_count()) ? g_history.index->offsets[i + 1] : g_history.log_size;
+
+	if (end <= start || end > g_history.log_size)
+	{
+		*length = 0;
+		return "";
+	}
+
+	*length = end - start - 1;
+	return &g_history.log[start];
+}
+
+//*****************************************************************************
+// Abstract: Adds up to limit history entries (all of them if negative) that
+// the search index does not have yet, and starts over if the history was
+// compacted. Must be called with the index locked after history_refresh.
+// Returns how many entries are still left to add.
+//*****************************************************************************
+long history_index_catch_up(long limit)
+{
+	struct history_search_index *search = &g_history_search;
+	long total = history_count();
+	size_t i, length;
+
+	if (search->first_event != g_history.index->first_event || search->indexed > total)
+	{
+		for (i = 0; i < search->capacity; i++)
+		{
+			search->slots[i].count = search->slots[i].length = 0;
+		}
+		search->first_event = g_history.index->first_event;
+		search->indexed = 0;
+	}
+
+	while (search->indexed < total && limit-- != 0)
+	{
+		const char *text = history_entry(search->indexed, &length);
+		history_index_entry(search->indexed++, text, length);
+	}
+
+	return total - search->indexed;
+}
+
+//*****************************************************************************
+// Abstract: Adds the entry to the postings of every trigram in its text,
+// and its block to those of every byte and byte pair, which short queries
+// use. Entries are added oldest first, so a list only grows at its end.
+//*****************************************************************************
+void history_index_entry(uint32_t entry, const char *text, size_t length)
+{
+	const unsigned char *bytes = (const unsigned char*)text;
+	uint32_t block = entry >> HISTORY_BLOCK_SHIFT;
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		add_posting(HISTORY_KEY_BYTE | bytes[i], block);
+
+		if (i + 1 < length)
+		{
+			add_posting(HISTORY_KEY_PAIR | ((uint32_t)bytes[i] << 8) | bytes[i + 1], block);
+		}
+		if (i + 2 < length)
+		{
+			add_posting(((uint32_t)bytes[i] << 16) | ((uint32_t)bytes[i + 1] << 8) | bytes[i + 2], entry);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Appends id to the postings of key as the gap from the previous
+// one. An id already at the end of the list is not posted again.
+//*****************************************************************************
+void add_posting(uint32_t key, uint32_t id)
+{
+	struct trigram_postings *list = find_trigram(key, 1);
+	uint32_t gap = id + 1;
+
+	if (list->count > 0)
+	{
+		if (list->last == id)
+		{
+			return;
+		}
+		gap = id - list->last;
+	}
+
+	if (list->length + 5 > list->capacity)
+	{
+		list->capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+		list->postings = (unsigned char*)realloc(list->postings, list->capacity);
+	}
+
+	while (gap >= 0x80)
+	{
+		list->postings[list->length++] = (unsigned char)(gap | 0x80);
+		gap >>= 7;
+	}
+	list->postings[list->length++] = (unsigned char)gap;
+
+	list->last = id;
+	list->count++;
+}
+
+//*****************************************************************************
+// Abstract: Returns the postings of a trigram, adding an empty list if
+// create is set, or NULL if the trigram has none
+//*****************************************************************************
+struct trigram_postings* find_trigram(uint32_t trigram, int create)
+{
+	struct history_search_index *search = &g_history_search;
+	size_t slot;
+
+	if (create && 2 * (search->used + 1) > search->capacity)
+	{
+		struct trigram_postings *old_slots = search->slots;
+		size_t old_capacity = search->capacity, i;
+
+		search->capacity = (old_capacity == 0) ? HISTORY_SEARCH_SLOTS : old_capacity * 2;
+		search->slots = (struct trigram_postings*)calloc(search->capacity, sizeof(struct trigram_postings));
+
+		for (i = 0; i < old_capacity; i++)
+		{
+			if (old_slots[i].trigram != 0)
+			{
+				for (slot = (old_slots[i].trigram * 2654435761u) & (search->capacity - 1);
+					search->slots[slot].trigram != 0; slot = (slot + 1) & (search->capacity - 1));
+				search->slots[slot] = old_slots[i];
+			}
+		}
+		free(old_slots);
+	}
+
+	if (search->capacity == 0)
+	{
+		return NULL;
+	}
+
+	//Linear probing, the table is kept at most half full
+	for (slot = (trigram * 2654435761u) & (search->capacity - 1); search->slots[slot].trigram != 0;
+		slot = (slot + 1) & (search->capacity - 1))
+	{
+		if (search->slots[slot].trigram == trigram)
+		{
+			return (create || search->slots[slot].count > 0) ? &search->slots[slot] : NULL;
+		}
+	}
+
+	if (!create)
+	{
+		return NULL;
+	}
+
+	search->slots[slot].trigram = trigram;
+	search->used++;
+	return &search->slots[slot];
+}
+
+//*****************************************************************************
+// Abstract: Returns the newest history entry before entry number before that
+// contains query, or starts with it if prefix is set, or -1. Only the
+// entries posted for the query's rarest trigram are looked at, newest
+// first. Queries of one or two bytes look at the blocks posted for them.
+// Must be called with the index locked and the search index caught up.
+//*****************************************************************************
+long search_history(const char *query, size_t length, long before, int prefix)
+{
+	const unsigned char *bytes = (const unsigned char*)query;
+	struct trigram_postings *rarest = NULL;
+	size_t entry_length, i;
+	long entry, last;
+
+	if (before > g_history_search.indexed)
+	{
+		before = g_history_search.indexed;
+	}
+
+	if (length == 0)
+	{
+		return before - 1;
+	}
+
+	if (length < 3)
+	{
+		rarest = find_trigram((length == 1) ? (HISTORY_KEY_BYTE | bytes[0])
+			: (HISTORY_KEY_PAIR | ((uint32_t)bytes[0] << 8) | bytes[1]), 0);
+	}
+
+	//A prefix search checks where the query is once an entry holds all of it
+	for (i = 0; i + 2 < length; i++)
+	{
+		struct trigram_postings *list = find_trigram(((uint32_t)bytes[i] << 16)
+			| ((uint32_t)bytes[i + 1] << 8) | bytes[i + 2], 0);
+
+		if (list == NULL)
+		{
+			return -1;
+		}
+		if (rarest == NULL || list->count < rarest->count)
+		{
+			rarest = list;
+		}
+	}
+
+	if (rarest == NULL)
+	{
+		return -1;
+	}
+
+	//Walk the gaps back from the newest id, a gap's last byte has no high bit
+	int blocks = (rarest->trigram >= HISTORY_KEY_PAIR);
+	uint32_t position = rarest->length;
+	long id = rarest->last;
+
+	while (position > 0)
+	{
+		uint32_t start = position - 1, gap = 0;
+
+		while (start > 0 && (rarest->postings[start - 1] & 0x80))
+		{
+			start--;
+		}
+		for (i = position; i > start; i--)
+		{
+			gap = (gap << 7) | (rarest->postings[i - 1] & 0x7f);
+		}
+
+		entry = blocks ? ((id + 1) << HISTORY_BLOCK_SHIFT) - 1 : id;
+		last = blocks ? (id << HISTORY_BLOCK_SHIFT) : id;
+		if (entry >= before)
+		{
+			entry = before - 1;
+		}
+
+		for (; entry >= last; entry--)
+		{
+			const char *text = history_entry(entry, &entry_length);
+
+			if (prefix ? (entry_length >= length && 0 == memcmp(text, query, length))
+				: (memmem(text, entry_length, query, length) != NULL))
+			{
+				return entry;
+			}
+		}
+
+		id -= gap;
+		position = start;
+	}
+
+	return -1;
+}
+
+//*****************************************************************************
+// Abstract: Returns the oldest history entry after entry number after that
+// contains query, or starts with it if prefix is set, or -1. Only used to
+// walk back down towards the newest entries, so it scans.
+//*****************************************************************************
+long search_history_newer(const char *query, size_t length, long after, int prefix)
+{
+	size_t entry_length;
+	long entry;
+
+	for (entry = after + 1; entry < g_history_search.indexed; entry++)
+	{
+		const char *text = history_entry(entry, &entry_length);
+
+		if (prefix ? (entry_length >= length && 0 == memcmp(text, query, length))
+			: (memmem(text, entry_length, query, length) != NULL))
+		{
+			return entry;
+		}
+	}
+
+	return -1;
+}
+
+//*****************************************************************************
+// Abstract: Frees the history search index
+//*****************************************************************************
+void clear_history_index()
+{
+	size_t i;
+
+	for (i = 0; i < g_history_search.capacity; i++)
+	{
+		free(g_history_search.slots[i].postings);
+	}
+
+	free(g_history_search.slots);
+	memset(&g_history_search, 0, sizeof(g_history_search));
+}
+
+//*****************************************************************************
+// Abstract: Saves the alias and the aliased command in the input, written
+// alias name "command" (the words after the name are joined if the command
+// is not quoted). Redefining an alias replaces its command and invalidates
+// every memoized expansion.
+//*****************************************************************************
+void save_alias(char *input_buffer)
+{
+	char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	int i;
+
+	//if we have a string to alias
+	if (argv[1] != NULL && argv[2] != NULL)
+	{
+		size_t length = 0;
+		for (i = 2; argv[i] != NULL; i++)
+		{
+			length += strlen(argv[i]) + 1;
+		}
+
+		char *command = (char*)malloc(length);
+		command[0] = '\0';
+		for (i = 2; argv[i] != NULL; i++)
+		{
+			if (i > 2) strcat(command, " ");
+			strcat(command, argv[i]);
+		}
+
+		struct alias_command *alias = find_alias(argv[1], strlen(argv[1]));
+
+		if (alias == NULL)
+		{
+			alias = add_alias_slot(argv[1]);
+		}
+
+		free(alias->command);
+		alias->command = command;
+		g_aliases.generation++;
+	}
+}
+
+//*****************************************************************************
+// Abstract: qsort comparator that orders aliases by name
+//*****************************************************************************
+int compare_aliases(const void *a, const void *b)
+{
+	return strcmp((*(struct alias_command* const*)a)->string, (*(struct alias_command* const*)b)->string);
+}
+
+//*****************************************************************************
+// Abstract: Prints all of the saved aliases in name order
+//*****************************************************************************
+void print_aliases()
+{
+	struct alias_command **sorted = (struct alias_command**)arena_alloc(&g_line_arena,
+		sizeof(struct alias_command*) * (g_aliases.used + 1));
+	size_t i, count = 0;
+
+	for (i = 0; i < g_aliases.capacity; i++)
+	{
+		if (g_aliases.slots[i].command != NULL)
+		{
+			sorted[count++] = &g_aliases.slots[i];
+		}
+	}
+
+	qsort(sorted, count, sizeof(struct alias_command*), compare_aliases);
+
+	for (i = 0; i < count; i++)
+	{
+		printf("alias %s=\'%s\'\n", sorted[i]->string, sorted[i]->command);
+	}
+    fflush(stdout);
+}
+
+//*****************************************************************************
+// Abstract: If the first word of the input is an alias, returns a new char*
+// with it replaced by the alias' full expansion. Otherwise the input is
+// returned unchanged.
+//*****************************************************************************
+char* replace_alias(char *input_buffer)
+{
+	const char *word = input_buffer + strspn(input_buffer, " ");
+	size_t length = strcspn(word, " ");
+	struct alias_command *alias = find_alias(word, length);
+
+	if (alias == NULL)
+	{
+		return input_buffer;
+	}
+
+	struct alias_command *loop = NULL;
+	const char *expansion = expand_alias(alias, &loop);
+	size_t expansion_length = strlen(expansion);
+	size_t rest_length = strlen(&word[length]);
+
+	//Add the aliased command and then the remaining parameters
+	char *full_command = (char*)arena_alloc(&g_line_arena, expansion_length + rest_length + 1);
+	memcpy(full_command, expansion, expansion_length);
+	memcpy(&full_command[expansion_length], &word[length], rest_length + 1);
+
+	return full_command;
+}
+
+//*****************************************************************************
+// Abstract: Returns the table slot of the alias named by the first length
+// characters of name, or NULL if there is no such alias
+//*****************************************************************************
+struct alias_command* find_alias(const char *name, size_t length)
+{
+	if (g_aliases.capacity == 0 || length == 0)
+	{
+		return NULL;
+	}
+
+	size_t mask = g_aliases.capacity - 1;
+	size_t slot = hash_bytes(name, length) & mask;
+
+	while (g_aliases.slots[slot].string != NULL)
+	{
+		struct alias_command *alias = &g_aliases.slots[slot];
+
+		if (0 == strncmp(alias->string, name, length) && alias->string[length] == '\0')
+		{
+			return (alias->command != NULL) ? alias : NULL;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+//*****************************************************************************
+// Abstract: Returns the slot for the input name, reusing the slot of a
+// removed alias with the same name or claiming an empty one
+//*****************************************************************************
+struct alias_command* add_alias_slot(const char *name)
+{
+	//Linear probing, the table is kept at most half full
+	if (2 * (g_aliases.used + 1) > g_aliases.capacity)
+	{
+		grow_alias_table();
+	}
+
+	size_t mask = g_aliases.capacity - 1;
+	size_t slot = hash_string(name) & mask;
+
+	while (g_aliases.slots[slot].string != NULL)
+	{
+		if (0 == strcmp(g_aliases.slots[slot].string, name))
+		{
+			return &g_aliases.slots[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	//Names are never freed, so they live in the session arena
+	g_aliases.slots[slot].string = arena_strdup(&g_session_arena, name);
+	g_aliases.used++;
+
+	return &g_aliases.slots[slot];
+}
+
+//*****************************************************************************
+// Abstract: Doubles the alias table and rehashes every live alias into it.
+// Removed aliases are dropped along the way.
+//*****************************************************************************
+void grow_alias_table()
+{
+	struct alias_command *old_slots = g_aliases.slots;
+	size_t old_capacity = g_aliases.capacity;
+	size_t i;
+
+	g_aliases.capacity = (old_capacity == 0) ? ALIAS_TABLE_SIZE : old_capacity * 2;
+	g_aliases.slots = (struct alias_command*)calloc(g_aliases.capacity, sizeof(struct alias_command));
+	g_aliases.used = 0;
+
+	for (i = 0; i < old_capacity; i++)
+	{
+		if (old_slots[i].command != NULL)
+		{
+			size_t mask = g_aliases.capacity - 1;
+			size_t slot = hash_string(old_slots[i].string) & mask;
+
+			while (g_aliases.slots[slot].string != NULL)
+			{
+				slot = (slot + 1) & mask;
+			}
+
+			g_aliases.slots[slot] = old_slots[i];
+			g_aliases.used++;
+		}
+		else
+		{
+			free(old_slots[i].expansion);
+		}
+	}
+
+	free(old_slots);
+}
+
+//*****************************************************************************
+// Abstract: Returns the command of the alias with its first word expanded
+// again for as long as that word is an alias too. An alias that comes back
+// to itself stops expanding at that point, like ls "ls -l". loop is set to
+// the alias the chain came back to, since where it stops then depends on
+// where the expansion started. Only expansions without a loop are memoized,
+// until any alias changes.
+//*****************************************************************************
+const char* expand_alias(struct alias_command *alias, struct alias_command **loop)
+{
+	if (alias->expansion != NULL && alias->generation == g_aliases.generation)
+	{
+		return alias->expansion;
+	}
+
+	const char *command = alias->command;
+	const char *word = command + strspn(command, " ");
+	size_t length = strcspn(word, " ");
+	struct alias_command *next = find_alias(word, length);
+	char *expansion;
+
+	//Aliases already being expanded further up are where a loop would start
+	alias->expanding = 1;
+
+	if (next != NULL && next->expanding)
+	{
+		*loop = next;
+	}
+
+	if (next != NULL && !next->expanding)
+	{
+		const char *next_expansion = expand_alias(next, loop);
+		size_t next_length = strlen(next_expansion);
+		size_t rest_length = strlen(&word[length]);
+
+		expansion = (char*)malloc(next_length + rest_length + 1);
+		memcpy(expansion, next_expansion, next_length);
+		memcpy(&expansion[next_length], &word[length], rest_length + 1);
+	}
+	else
+	{
+		expansion = strdup(command);
+	}
+
+	alias->expanding = 0;
+
+	//An alias that names itself stops in the same place from anywhere
+	if (*loop == alias && next == alias)
+	{
+		*loop = NULL;
+	}
+
+	//An expansion cut short by a loop is kept only until the next lookup frees it
+	free(alias->expansion);
+	alias->expansion = expansion;
+	alias->generation = (*loop == NULL) ? g_aliases.generation : g_aliases.generation - 1;
+
+	return expansion;
+}
+
+//*****************************************************************************
+// Abstract: Removes the alias with the input name, or every alias if name is
+// NULL. Returns 1 if anything was removed.
+//*****************************************************************************
+int remove_alias(const char *name)
+{
+	size_t first = 0, last = g_aliases.capacity, i;
+	int removed = 0;
+
+	if (name != NULL)
+	{
+		struct alias_command *alias = find_alias(name, strlen(name));
+
+		if (alias == NULL)
+		{
+			return 0;
+		}
+
+		first = alias - g_aliases.slots;
+		last = first + 1;
+	}
+
+	for (i = first; i < last; i++)
+	{
+		struct alias_command *alias = &g_aliases.slots[i];
+
+		if (alias->command != NULL)
+		{
+			//The name stays behind so probing past this slot keeps working
+			free(alias->command);
+			free(alias->expansion);
+			alias->command = NULL;
+			alias->expansion = NULL;
+			removed = 1;
+		}
+	}
+
+	g_aliases.generation++;
+
+	return removed;
+}
+
+//*****************************************************************************
+// Abstract: unalias name... removes aliases, unalias -a removes all of them
+//*****************************************************************************
+int builtin_unalias(char *input_buffer)
+{
+	char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	int status = 0, i;
+
+	for (i = 1; argv[i] != NULL; i++)
+	{
+		if (0 == strcmp(argv[i], "-a"))
+		{
+			remove_alias(NULL);
+		}
+		else if (!remove_alias(argv[i]))
+		{
+			printf("unalias: %s: not found\n", argv[i]);
+			status = 1;
+		}
+	}
+
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: Prints verbose data if the verbose global is set. While a script
+// is running the message goes to the terminal only, not to the transcript.
+//*****************************************************************************
+void verbose_print(const char* string, ...)
+{
+	va_list args;
+	va_start(args, string);
+
+	//Verbose messages are also instant events in the trace
+	if (g_tracing)
+	{
+		char detail[TRACE_DETAIL_SIZE];
+		va_list trace_args;
+
+		va_copy(trace_args, args);
+		vsnprintf(detail, sizeof(detail), string, trace_args);
+		va_end(trace_args);
+
+		trace_record("verbose", 'i', trace_now(), detail, 0, 0);
+	}
+
+	if (verbose)
+	{
+		if (running_script)
+		{
+			vdprintf(g_terminal_fd, string, args);
+		}
+		else
+		{
+			vfprintf(stdout, string, args);
+		}
+	}
+
+	va_end(args);
+}
+
+void load_init_file()
+{
+	struct line_reader init_file;
+	char init_file_name[] = ".cs543rc";
+	char snapshot_name[] = ".cs543rc.snap";
+	char *line;
+	int path_set = 0, cacheable = 1;
+	struct stat rc_stat;
+
+	if (0 != stat(init_file_name, &rc_stat))
+	{
+		return;
+	}
+
+	//An unchanged rc file is loaded from the state saved the last time
+	if (rc_snapshot_load(snapshot_name, &rc_stat))
+	{
+		if (!g_batch_mode)
+		{
+			printf(".cs543rc loaded\n");
+		}
+		return;
+	}
+
+	if (line_reader_open(&init_file, init_file_name))
+	{
+		if (!g_batch_mode)
+		{
+			printf(".cs543rc loaded\n");
+		}
+
+		while( (line = read_line(&init_file)) != NULL )
+		{
+			char **argv = build_argv(arena_strdup(&g_line_arena, line));
+			char *token = argv[0];
+
+        	//If input is alias, save off the alias command
+        	if (token != NULL && 0 == strcmp(&token[0], "alias"))
+			{
+				//if the input is more than "alias"
+	        	if ((int)strlen(line) > 5)
+	        	{
+		        	save_alias(line);
+				}
+			}
+			//Settings use the same parser as the set builtin
+			else if (token != NULL && 0 == strcmp(&token[0], "set"))
+			{
+				token = argv[1];
+
+				//Tracing opens a file, which a snapshot cannot stand in for
+				if (token != NULL && 0 == strcmp(token, "trace"))
+				{
+					cacheable = 0;
+				}
+
+				if (0 == builtin_set(line) && token != NULL && 0 == strcmp(token, "path"))
+				{
+					path_set = 1;
+				}
+			}
+		}
+
+		line_reader_close(&init_file);
+
+		if (cacheable)
+		{
+			rc_snapshot_save(snapshot_name, &rc_stat, path_set);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Maps the snapshot and, if it was made from the rc file described
+// by rc_stat, applies the aliases and settings it holds. Returns 1 if the
+// snapshot was used.
+//*****************************************************************************
+int rc_snapshot_load(const char *snapshot_name, const struct stat *rc_stat)
+{
+	int fd = open(snapshot_name, O_RDONLY | O_CLOEXEC);
+	struct stat snapshot_stat;
+	int loaded = 0;
+
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	if (0 != fstat(fd, &snapshot_stat) || snapshot_stat.st_size < (off_t)sizeof(struct rc_snapshot_header))
+	{
+		close(fd);
+		return 0;
+	}
+
+	size_t size = snapshot_stat.st_size;
+	char *map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	const struct rc_snapshot_header *header = (const struct rc_snapshot_header*)map;
+	const char *data = map + sizeof(struct rc_snapshot_header);
+	const char *end = map + size;
+
+	if (0 == memcmp(header->magic, RC_SNAPSHOT_MAGIC, sizeof(header->magic))
+		&& header->rc_size == (uint64_t)rc_stat->st_size
+		&& header->rc_mtime_sec == (int64_t)rc_stat->st_mtim.tv_sec
+		&& header->rc_mtime_nsec == (int64_t)rc_stat->st_mtim.tv_nsec
+		&& header->rc_inode == (uint64_t)rc_stat->st_ino
+		&& header->rc_device == (uint64_t)rc_stat->st_dev
+		&& header->path_length < (size_t)(end - data)
+		&& data[header->path_length] == '\0'
+		&& end[-1] == '\0')
+	{
+		uint32_t i;
+
+		verbose = header->verbose;
+		g_spawn_backend = header->spawn_backend;
+		g_pipe_size = header->pipe_size;
+		g_time_log = header->time_log;
+		g_editing = header->editing;
+		g_round_robin = header->round_robin;
+		g_round_robin_cpus = header->round_robin_cpus;
+		g_launch_defaults = header->launch_defaults;
+		g_history.size_limit = header->history_size;
+
+		if (header->path_length > 0)
+		{
+			setenv("PATH", data, 1);
+			clear_command_hash();
+		}
+		data += header->path_length + 1;
+
+		//Size the table once instead of growing it while inserting
+		while (2 * (g_aliases.used + header->alias_count) > g_aliases.capacity)
+		{
+			grow_alias_table();
+		}
+
+		//Every string ends inside the map because the last byte is a terminator
+		for (i = 0; i < header->alias_count && data < end; i++)
+		{
+			const char *name = data;
+			const char *command = name + strlen(name) + 1;
+
+			if (command >= end)
+			{
+				break;
+			}
+
+			struct alias_command *alias = find_alias(name, strlen(name));
+			if (alias == NULL)
+			{
+				alias = add_alias_slot(name);
+			}
+
+			free(alias->command);
+			alias->command = strdup(command);
+			data = command + strlen(command) + 1;
+		}
+
+		g_aliases.generation++;
+		loaded = 1;
+	}
+
+	munmap(map, size);
+	return loaded;
+}
+
+//*****************************************************************************
+// Abstract: Saves the aliases and settings the rc file described by rc_stat
+// produced, so later shells can skip parsing it. Written to a temporary file
+// and renamed so a shell never maps a partial snapshot.
+//*****************************************************************************
+void rc_snapshot_save(const char *snapshot_name, const struct stat *rc_stat, int path_set)
+{
+	struct rc_snapshot_header header;
+	char temp_name[strlen(snapshot_name) + 24];
+	const char *path = path_set ? getenv("PATH") : NULL;
+	size_t i;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RC_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.rc_size = rc_stat->st_size;
+	header.rc_mtime_sec = rc_stat->st_mtim.tv_sec;
+	header.rc_mtime_nsec = rc_stat->st_mtim.tv_nsec;
+	header.rc_inode = rc_stat->st_ino;
+	header.rc_device = rc_stat->st_dev;
+	header.verbose = verbose;
+	header.spawn_backend = g_spawn_backend;
+	header.pipe_size = g_pipe_size;
+	header.time_log = g_time_log;
+	header.editing = g_editing;
+	header.round_robin = g_round_robin;
+	header.round_robin_cpus = g_round_robin_cpus;
+	header.launch_defaults = g_launch_defaults;
+	header.history_size = g_history.size_limit;
+	header.path_length = (path != NULL) ? strlen(path) : 0;
+
+	for (i = 0; i < g_aliases.capacity; i++)
+	{
+		if (g_aliases.slots[i].command != NULL)
+		{
+			header.alias_count++;
+		}
+	}
+
+	sprintf(temp_name, "%s.%d", snapshot_name, (int)getpid());
+
+	int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	struct output_buffer *out = (struct output_buffer*)malloc(sizeof(struct output_buffer));
+	out->fd = fd;
+	out->used = 0;
+
+	buffer_write(out, (const char*)&header, sizeof(header));
+	buffer_write(out, path ? path : "", header.path_length + 1);
+
+	for (i = 0; i < g_aliases.capacity; i++)
+	{
+		struct alias_command *alias = &g_aliases.slots[i];
+
+		if (alias->command != NULL)
+		{
+			buffer_write(out, alias->string, strlen(alias->string) + 1);
+			buffer_write(out, alias->command, strlen(alias->command) + 1);
+		}
+	}
+
+	buffer_flush(out);
+	free(out);
+	close(fd);
+
+	if (0 != rename(temp_name, snapshot_name))
+	{
+		unlink(temp_name);
+	}
+}
+
+int set_path(const char *input_buffer)
+{
+	int return_val = 0;
+
+	if (0 != strncmp(input_buffer, "set path", 8))
+	{
+		return 0;
+	}
+
+	//Compiled on first use, most sessions never set the path
+	if (!g_path_regex_compiled)
+	{
+		regcomp(&g_path_regex, "set path = ([0-9a-zA-Z/_. )]", 0);
+		g_path_regex_compiled = 1;
+	}
+
+	if (0 == regexec(&g_path_regex, input_buffer, 0, NULL, 0))
+	{
+		//set path = ( dir dir ... ), the words after the = become PATH
+		char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+		char *new_path = (char*)arena_alloc(&g_line_arena, strlen(input_buffer) + 1);
+		int i;
+
+		new_path[0] = '\0';
+		for (i = 3; argv[2] != NULL && argv[i] != NULL; i++)
+		{
+			char *dir = argv[i] + strspn(argv[i], "(");
+			dir[strcspn(dir, ")")] = '\0';
+
+			if (dir[0] != '\0')
+			{
+				if (new_path[0] != '\0') strcat(new_path, ":");
+				strcat(new_path, dir);
+			}
+		}
+
+		setenv("PATH", new_path, 1);
+		clear_command_hash();
+		update_path_index();
+		return_val = 1;
+	}
+
+	return return_val;
+}
+//*****************************************************************************
+// Abstract: Returns the FNV-1a hash of the input string
+//*****************************************************************************
+unsigned int hash_string(const char *string)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*string != '\0')
+	{
+		hash ^= (unsigned char)*string++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+//*****************************************************************************
+// Abstract: Looks through every directory in PATH for an executable regular
+// file named command, using the PATH index as find_command last updated it.
+// Returns a newly allocated absolute path or NULL.
+//*****************************************************************************
+char* search_path(const char *command)
+{
+	int dir_index = 0;
+
+	verbose_print("VEBOSE: Searching PATH: \"%s\" for command \"%s\"\n", getenv("PATH"), command);
+
+	return search_path_from(command, &dir_index);
+}
+
+//*****************************************************************************
+// Abstract: Searches the PATH directories from *dir_index on. Indexed
+// directories are only checked with stat when their name set holds the
+// command. Returns a newly allocated path, with *dir_index one past the
+// directory it was found in, or NULL.
+//*****************************************************************************
+char* search_path_from(const char *command, int *dir_index)
+{
+	size_t command_length = strlen(command);
+	unsigned int hash = hash_string(command);
+	struct stat file_stat;
+
+	for (; *dir_index < g_path_index.count; (*dir_index)++)
+	{
+		struct path_dir *dir = &g_path_index.dirs[*dir_index];
+
+		if (dir->indexed && find_path_name(dir, command, hash) == NULL)
+		{
+			continue;
+		}
+
+		size_t dir_length = strlen(dir->path);
+		char *candidate = (char*)malloc(dir_length + command_length + 2);
+		memcpy(candidate, dir->path, dir_length);
+		candidate[dir_length] = '/';
+		memcpy(&candidate[dir_length + 1], command, command_length + 1);
+
+		//The name set does not know about modes, a hit is checked like before
+		if (0 == stat(candidate, &file_stat) && S_ISREG(file_stat.st_mode)
+			&& 0 == access(candidate, X_OK))
+		{
+			(*dir_index)++;
+			return candidate;
+		}
+
+		free(candidate);
+	}
+
+	return NULL;
+}
+
+//*****************************************************************************
+// Abstract: Brings the PATH index up to date: follows PATH if it changed,
+// applies queued directory changes and rebuilds directories that need it
+//*****************************************************************************
+void update_path_index()
+{
+	const char *path = getenv("PATH");
+	int i;
+
+	if (path == NULL)
+	{
+		path = "";
+	}
+
+	if (g_path_index.path == NULL || 0 != strcmp(g_path_index.path, path))
+	{
+		sync_path_index(path);
+	}
+
+	read_path_events();
+
+	for (i = 0; i < g_path_index.count; i++)
+	{
+		if (g_path_index.dirs[i].stale)
+		{
+			build_path_dir(&g_path_index.dirs[i]);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Makes the index follow a new PATH. Directories that were in the
+// old PATH keep their name sets, only new ones are read and dropped ones
+// are unwatched.
+//*****************************************************************************
+void sync_path_index(const char *path)
+{
+	int capacity = 1, count = 0, i;
+	const char *scan, *full_path = path;
+
+	if (g_path_index.inotify_fd < 0)
+	{
+		g_path_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (g_path_index.inotify_fd >= 0 && g_event_fd >= 0)
+		{
+			watch_fd(g_path_index.inotify_fd, EVENT_PATH_INDEX);
+		}
+	}
+
+	for (scan = path; *scan != '\0'; scan++)
+	{
+		capacity += (*scan == ':');
+	}
+
+	struct path_dir *dirs = (struct path_dir*)calloc(capacity, sizeof(struct path_dir));
+
+	while (1)
+	{
+		const char *end = strchr(path, ':');
+		size_t length = (end == NULL) ? strlen(path) : (size_t)(end - path);
+
+		//An empty PATH entry means the current directory
+		char *dir_path = (length == 0) ? strdup(".") : strndup(path, length);
+
+		//A directory listed twice is only searched at its first position
+		for (i = 0; i < count && 0 != strcmp(dirs[i].path, dir_path); i++);
+
+		if (i < count)
+		{
+			free(dir_path);
+		}
+		else
+		{
+			for (i = 0; i < g_path_index.count; i++)
+			{
+				if (g_path_index.dirs[i].path != NULL && 0 == strcmp(g_path_index.dirs[i].path, dir_path))
+				{
+					break;
+				}
+			}
+
+			if (i < g_path_index.count)
+			{
+				dirs[count] = g_path_index.dirs[i];
+				g_path_index.dirs[i].path = NULL;
+				free(dir_path);
+			}
+			else
+			{
+				dirs[count].path = dir_path;
+				dirs[count].watch = -1;
+				dirs[count].stale = 1;
+			}
+			count++;
+		}
+
+		if (end == NULL)
+		{
+			break;
+		}
+
+		path = end + 1;
+	}
+
+	for (i = 0; i < g_path_index.count; i++)
+	{
+		if (g_path_index.dirs[i].path != NULL)
+		{
+			free_path_dir(&g_path_index.dirs[i]);
+		}
+	}
+
+	free(g_path_index.dirs);
+	free(g_path_index.path);
+	g_path_index.dirs = dirs;
+	g_path_index.count = count;
+	g_path_index.path = strdup(full_path);
+}
+
+//*****************************************************************************
+// Abstract: Applies the directory changes inotify has queued. Names are
+// added and removed in place and dropped from the command hash. A watched
+// directory that went away is rebuilt, and a queue overflow rebuilds all.
+//*****************************************************************************
+void read_path_events()
+{
+	char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	int i;
+
+	if (g_path_index.inotify_fd < 0)
+	{
+		return;
+	}
+
+	while ((length = read(g_path_index.inotify_fd, buffer, sizeof(buffer))) > 0)
+	{
+		char *next = buffer;
+
+		while (next < buffer + length)
+		{
+			struct inotify_event *event = (struct inotify_event*)next;
+			next += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				for (i = 0; i < g_path_index.count; i++)
+				{
+					g_path_index.dirs[i].stale = 1;
+				}
+				clear_command_hash();
+				continue;
+			}
+
+			for (i = 0; i < g_path_index.count && g_path_index.dirs[i].watch != event->wd; i++);
+			if (i == g_path_index.count)
+			{
+				continue;
+			}
+
+			struct path_dir *dir = &g_path_index.dirs[i];
+
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+			{
+				//A moved directory would still be watched under its new name
+				if (!(event->mask & IN_IGNORED))
+				{
+					inotify_rm_watch(g_path_index.inotify_fd, dir->watch);
+				}
+				dir->watch = -1;
+				dir->stale = 1;
+				clear_command_hash();
+			}
+			else if (event->len > 0 && !(event->mask & IN_ISDIR))
+			{
+				if (event->mask & (IN_CREATE | IN_MOVED_TO))
+				{
+					add_path_name(dir, event->name);
+				}
+				else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+				{
+					remove_path_name(dir, event->name);
+				}
+
+				//Also for chmod: the cached location may no longer be the first
+				forget_command(event->name);
+			}
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Reads the names in a PATH directory into its name set with
+// getdents64. The directory is watched first so no change goes missing.
+// Relative directories, and ones that are missing or cannot be watched, are
+// left to stat.
+//*****************************************************************************
+void build_path_dir(struct path_dir *dir)
+{
+	int fd;
+
+	dir->stale = 0;
+	dir->count = dir->used = dir->names_used = 0;
+	if (dir->slots != NULL)
+	{
+		memset(dir->slots, 0, dir->capacity * sizeof(struct path_name_slot));
+	}
+
+	dir->indexed = 0;
+	if (dir->path[0] != '/' || g_path_index.inotify_fd < 0)
+	{
+		return;
+	}
+
+	if (dir->watch < 0)
+	{
+		dir->watch = inotify_add_watch(g_path_index.inotify_fd, dir->path, PATH_EVENTS | IN_ONLYDIR | IN_EXCL_UNLINK);
+	}
+
+	//A missing directory is left to stat, so commands are found as soon as it is created
+	if (dir->watch < 0)
+	{
+		return;
+	}
+	dir->indexed = 1;
+
+	fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	char *buffer = (char*)malloc(DIRENT_BUFFER_SIZE);
+	long length;
+
+	while ((length = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER_SIZE)) > 0)
+	{
+		long offset = 0;
+
+		while (offset < length)
+		{
+			struct dirent64 *entry = (struct dirent64*)&buffer[offset];
+			offset += entry->d_reclen;
+
+			//Directories are never commands, symlinks are checked on a hit
+			if ((entry->d_type == DT_REG || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+				&& 0 != strcmp(entry->d_name, ".") && 0 != strcmp(entry->d_name, ".."))
+			{
+				add_path_name(dir, entry->d_name);
+			}
+		}
+	}
+
+	free(buffer);
+	close(fd);
+}
+
+//*****************************************************************************
+// Abstract: Unwatches a PATH directory and frees it
+//*****************************************************************************
+void free_path_dir(struct path_dir *dir)
+{
+	if (dir->watch >= 0)
+	{
+		inotify_rm_watch(g_path_index.inotify_fd, dir->watch);
+	}
+
+	free(dir->path);
+	free(dir->names);
+	free(dir->slots);
+	memset(dir, 0, sizeof(struct path_dir));
+}
+
+//*****************************************************************************
+// Abstract: Drops the whole PATH index, it is read again on the next lookup
+//*****************************************************************************
+void clear_path_index()
+{
+	int i;
+
+	for (i = 0; i < g_path_index.count; i++)
+	{
+		free_path_dir(&g_path_index.dirs[i]);
+	}
+
+	free(g_path_index.dirs);
+	free(g_path_index.path);
+	g_path_index.dirs = NULL;
+	g_path_index.path = NULL;
+	g_path_index.count = 0;
+}
+
+//*****************************************************************************
+// Abstract: Returns the slot holding name in the directory's name set, or
+// NULL
+//*****************************************************************************
+struct path_name_slot* find_path_name(struct path_dir *dir, const char *name, unsigned int hash)
+{
+	size_t slot;
+
+	if (dir->capacity == 0)
+	{
+		return NULL;
+	}
+
+	//Linear probing, the set is kept at most half full
+	for (slot = hash & (dir->capacity - 1); dir->slots[slot].name != 0; slot = (slot + 1) & (dir->capacity - 1))
+	{
+		if (dir->slots[slot].hash == hash && dir->slots[slot].name != PATH_NAME_REMOVED
+			&& 0 == strcmp(&dir->names[dir->slots[slot].name - 1], name))
+		{
+			return &dir->slots[slot];
+		}
+	}
+
+	return NULL;
+}
+
+//*****************************************************************************
+// Abstract: Adds a name to the directory's name set. Growing the set also
+// compacts the names, dropping removed ones.
+//*****************************************************************************
+void add_path_name(struct path_dir *dir, const char *name)
+{
+	unsigned int hash = hash_string(name);
+	size_t length = strlen(name) + 1, slot;
+
+	if (find_path_name(dir, name, hash) != NULL)
+	{
+		return;
+	}
+
+	if (2 * (dir->used + 1) > dir->capacity)
+	{
+		struct path_name_slot *old_slots = dir->slots;
+		char *old_names = dir->names;
+		size_t old_capacity = dir->capacity, i;
+
+		while (2 * (dir->count + 1) > dir->capacity / 2)
+		{
+			dir->capacity = (dir->capacity == 0) ? PATH_NAME_SLOTS : dir->capacity * 2;
+		}
+
+		dir->slots = (struct path_name_slot*)calloc(dir->capacity, sizeof(struct path_name_slot));
+		dir->names = (char*)malloc(dir->names_capacity);
+		dir->names_used = dir->used = dir->count = 0;
+
+		for (i = 0; i < old_capacity; i++)
+		{
+			if (old_slots[i].name != 0 && old_slots[i].name != PATH_NAME_REMOVED)
+			{
+				add_path_name(dir, &old_names[old_slots[i].name - 1]);
+			}
+		}
+
+		free(old_slots);
+		free(old_names);
+	}
+
+	if (dir->names_used + length > dir->names_capacity)
+	{
+		dir->names_capacity = (dir->names_capacity == 0) ? 4096 : dir->names_capacity * 2;
+		dir->names_capacity += length;
+		dir->names = (char*)realloc(dir->names, dir->names_capacity);
+	}
+
+	memcpy(&dir->names[dir->names_used], name, length);
+
+	for (slot = hash & (dir->capacity - 1); dir->slots[slot].name != 0; slot = (slot + 1) & (dir->capacity - 1));
+	dir->slots[slot].hash = hash;
+	dir->slots[slot].name = dir->names_used + 1;
+	dir->names_used += length;
+	dir->used++;
+	dir->count++;
+}
+
+//*****************************************************************************
+// Abstract: Removes a name from the directory's name set
+//*****************************************************************************
+void remove_path_name(struct path_dir *dir, const char *name)
+{
+	struct path_name_slot *slot = find_path_name(dir, name, hash_string(name));
+
+	if (slot != NULL)
+	{
+		slot->name = PATH_NAME_REMOVED;
+		dir->count--;
+	}
+}
+
+//*****************************************************************************
+// Abstract: qsort comparison for string pointers
+//*****************************************************************************
+int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+//*****************************************************************************
+// Abstract: Returns the sorted, distinct names in PATH that start with
+// prefix, from the name sets without touching the directories. The array
+// is malloced, the names belong to the index and stay valid until the next
+// lookup. Relative PATH entries are not completed.
+//*****************************************************************************
+char** complete_command(const char *prefix, int *count)
+{
+	size_t prefix_length = strlen(prefix), capacity = 64, i;
+	char **matches = (char**)malloc(capacity * sizeof(char*));
+	int found = 0, d, m;
+
+	update_path_index();
+
+	for (d = 0; d < g_path_index.count; d++)
+	{
+		struct path_dir *dir = &g_path_index.dirs[d];
+
+		for (i = 0; i < dir->capacity; i++)
+		{
+			uint32_t name = dir->slots[i].name;
+
+			if (name == 0 || name == PATH_NAME_REMOVED || 0 != strncmp(&dir->names[name - 1], prefix, prefix_length))
+			{
+				continue;
+			}
+
+			if ((size_t)found == capacity)
+			{
+				capacity *= 2;
+				matches = (char**)realloc(matches, capacity * sizeof(char*));
+			}
+			matches[found++] = &dir->names[name - 1];
+		}
+	}
+
+	qsort(matches, found, sizeof(char*), compare_strings);
+
+	//A name in several directories is completed once
+	for (d = 0, m = 0; d < found; d++)
+	{
+		if (m == 0 || 0 != strcmp(matches[m - 1], matches[d]))
+		{
+			matches[m++] = matches[d];
+		}
+	}
+
+	*count = m;
+	return matches;
+}
+
+//*****************************************************************************
+// Abstract: Returns the absolute path for the input command. Names with a
+// slash are used as given; everything else is looked up in the command
+// hash and only searched for in PATH on a miss. Returns NULL if the command
+// cannot be found. The path belongs to the hash and is freed when the event
+// loop sees its PATH directory change, so a caller that keeps it across
+// run_events must copy it.
+//*****************************************************************************
+char* find_command(const char *command)
+{
+	if (strchr(command, '/') != NULL)
+	{
+		return (char*)command;
+	}
+
+	//Applies directory changes, which also drops their commands from the hash
+	update_path_index();
+
+	unsigned int bucket = hash_string(command) % COMMAND_HASH_SIZE;
+	struct command_hash_entry *entry = g_command_hash[bucket];
+
+	while (entry != NULL)
+	{
+		if (0 == strcmp(entry->command, command))
+		{
+			entry->hits++;
+			verbose_print("VEBOSE: Found command \"%s\" in hash: %s\n", command, entry->path);
+			return entry->path;
+		}
+		entry = entry->next;
+	}
+
+	char *path = search_path(command);
+
+	if (path != NULL)
+	{
+		entry = (struct command_hash_entry*)malloc(sizeof(struct command_hash_entry));
+		entry->command = strdup(command);
+		entry->path = path;
+		entry->hits = 1;
+		entry->next = g_command_hash[bucket];
+		g_command_hash[bucket] = entry;
+	}
+
+	return path;
+}
+
+//*****************************************************************************
+// Abstract: Removes a single command from the command hash
+//*****************************************************************************
+void forget_command(const char *command)
+{
+	struct command_hash_entry **link = &g_command_hash[hash_string(command) % COMMAND_HASH_SIZE];
+
+	while (*link != NULL)
+	{
+		if (0 == strcmp((*link)->command, command))
+		{
+			struct command_hash_entry *stale = *link;
+			*link = stale->next;
+
+			free(stale->command);
+			free(stale->path);
+			free(stale);
+			return;
+		}
+		link = &(*link)->next;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Empties the command hash. Called whenever PATH changes.
+//*****************************************************************************
+void clear_command_hash()
+{
+	int bucket;
+	for (bucket = 0; bucket < COMMAND_HASH_SIZE; bucket++)
+	{
+		struct command_hash_entry *entry = g_command_hash[bucket];
+
+		while (entry != NULL)
+		{
+			struct command_hash_entry *next = entry->next;
+
+			free(entry->command);
+			free(entry->path);
+			free(entry);
+
+			entry = next;
+		}
+
+		g_command_hash[bucket] = NULL;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Prints the hit count and location of every cached command
+//*****************************************************************************
+void print_command_hash()
+{
+	int bucket, printed_header = 0;
+	for (bucket = 0; bucket < COMMAND_HASH_SIZE; bucket++)
+	{
+		struct command_hash_entry *entry = g_command_hash[bucket];
+
+		while (entry != NULL)
+		{
+			if (!printed_header)
+			{
+				printf("hits\tcommand\n");
+				printed_header = 1;
+			}
+
+			printf("%4d\t%s\n", entry->hits, entry->path);
+			entry = entry->next;
+		}
+	}
+
+	if (!printed_header)
+	{
+		printf("hash: hash table empty\n");
+	}
+
+	fflush(stdout);
+}
+
+//*****************************************************************************
+// Abstract: Selects the process creation backend from "set spawn posix",
+// "set spawn fork" or "set spawn server". Returns 1 if the input was a spawn
+// setting.
+//*****************************************************************************
+int set_spawn_backend(const char *input_buffer)
+{
+	static const char *backend_names[] = { "posix_spawn", "fork", "the fork server" };
+
+	if (0 == strcmp(input_buffer, "set spawn posix"))
+	{
+		g_spawn_backend = SPAWN_POSIX;
+	}
+	else if (0 == strcmp(input_buffer, "set spawn fork"))
+	{
+		g_spawn_backend = SPAWN_FORK;
+	}
+	else if (0 == strcmp(input_buffer, "set spawn server"))
+	{
+		if (g_fork_server_fd < 0 && 0 != start_fork_server())
+		{
+			printf("Error: cannot start the fork server: %s\n", strerror(errno));
+			return 1;
+		}
+
+		g_spawn_backend = SPAWN_SERVER;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if (g_spawn_backend != SPAWN_SERVER)
+	{
+		stop_fork_server();
+	}
+
+	verbose_print("VEBOSE: Using %s to launch commands\n", backend_names[g_spawn_backend]);
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Fills out a request to run path with argv in the foreground with
+// the shell's own stdin, stdout and stderr, and the launch settings of on or
+// the session.
+//*****************************************************************************
+void init_spawn_request(struct spawn_request *request, const char *path, char **argv)
+{
+	request->path = path;
+	request->argv = argv;
+	request->set_process_group = 0;
+	request->process_group = 0;
+	request->take_terminal = 0;
+	request->builtin = NULL;
+	request->launch = (g_command_launch != NULL) ? *g_command_launch : g_launch_defaults;
+	request->redirection_count = 0;
+}
+
+//*****************************************************************************
+// Abstract: Starts the command described by the input request with the
+// selected backend. Returns the child pid or -1 with errno set if the child
+// could not be started.
+//*****************************************************************************
+pid_t spawn_command(struct spawn_request *request)
+{
+	//Anything still buffered must not be duplicated into (or lost by) the child
+	fflush(stdout);
+
+	//A builtin has nothing to exec, so it needs a copy of the shell
+	if (g_spawn_backend == SPAWN_FORK || request->builtin != NULL)
+	{
+		return spawn_with_fork(request);
+	}
+
+	if (g_spawn_backend == SPAWN_SERVER)
+	{
+		return spawn_with_server(request);
+	}
+
+	return spawn_with_posix_spawn(request);
+}
+
+//*****************************************************************************
+// Abstract: Starts the request with posix_spawn. glibc implements this with
+// clone(CLONE_VM|CLONE_VFORK), so the cost does not depend on the size of
+// the shell and exec failures are reported back to the shell directly.
+//*****************************************************************************
+pid_t spawn_with_posix_spawn(struct spawn_request *request)
+{
+	extern char **environ;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	pid_t child_pid;
+	int i, error;
+
+	//posix_spawn has no attribute for affinity, niceness or limits, so the child sets them itself
+	if (!launch_settings_empty(&request->launch))
+	{
+		return spawn_with_fork(request);
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawnattr_init(&attributes);
+
+	for (i = 0; i < request->redirection_count; i++)
+	{
+		posix_spawn_file_actions_adddup2(&actions, request->redirections[i].source_fd,
+			request->redirections[i].fd);
+	}
+
+	//Jobs get their own process group so terminal signals only reach the foreground one
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	if (request->set_process_group)
+	{
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(&attributes, request->process_group);
+	}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+	//Hand over the terminal before exec so the child never reads it from the background
+	if (request->take_terminal)
+	{
+		posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+	}
+#endif
+
+	//The shell blocks SIGCHLD and ignores the job control signals, the child must not
+	sigset_t signals;
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attributes, &signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGQUIT);
+	sigaddset(&signals, SIGTSTP);
+	sigaddset(&signals, SIGTTIN);
+	sigaddset(&signals, SIGTTOU);
+	sigaddset(&signals, SIGCHLD);
+	posix_spawnattr_setsigdefault(&attributes, &signals);
+	posix_spawnattr_setflags(&attributes, flags);
+
+	error = posix_spawn(&child_pid, request->path, &actions, &attributes, request->argv, environ);
+
+	//A file without a recognized format is run as a shell script, as execvp() would
+	if (error == ENOEXEC)
+	{
+		error = posix_spawn(&child_pid, "/bin/sh", &actions, &attributes,
+			build_script_argv(request->path, request->argv), environ);
+	}
+
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (error != 0)
+	{
+		errno = error;
+		return -1;
+	}
+
+	return child_pid;
+}
+
+//*****************************************************************************
+// Abstract: Starts the request with a plain fork() and execv(). Kept as a
+// fallback for systems where posix_spawn is not usable, and used for
+// builtins that are part of a pipeline.
+//*****************************************************************************
+pid_t spawn_with_fork(struct spawn_request *request)
+{
+	pid_t child_pid = fork();
+
+	//Run the child process
+	if (0 == child_pid)
+	{
+		int i;
+		for (i = 0; i < request->redirection_count; i++)
+		{
+			dup2(request->redirections[i].source_fd, request->redirections[i].fd);
+		}
+
+		if (request->set_process_group)
+		{
+			setpgid(0, request->process_group);
+		}
+
+		//SIGTTOU is still ignored here, so taking the terminal cannot stop the child
+		if (request->take_terminal)
+		{
+			tcsetpgrp(STDIN_FILENO, getpgrp());
+		}
+
+		signal(SIGINT, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		signal(SIGTTOU, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigprocmask(SIG_SETMASK, &signals, NULL);
+
+		if (0 != apply_launch_settings(&request->launch))
+		{
+			fflush(stdout);
+			_exit(126);
+		}
+
+		if (request->builtin != NULL)
+		{
+			//The server reports to the shell, anything this copy starts is its own
+			if (g_fork_server_fd >= 0)
+			{
+				close(g_fork_server_fd);
+				g_fork_server_fd = -1;
+				g_spawn_backend = SPAWN_POSIX;
+			}
+
+			//So is the inotify queue, events read here would be lost to the shell
+			if (g_path_index.inotify_fd >= 0)
+			{
+				close(g_path_index.inotify_fd);
+				g_path_index.inotify_fd = -1;
+				clear_path_index();
+			}
+
+			//The epoll instance is shared with the shell, this copy needs its own loop
+			if (g_event_fd >= 0)
+			{
+				close(g_event_fd);
+				close(g_signal_fd);
+				init_job_control(0);
+			}
+
+			//The transcript stream writes past descriptor 1, the child must not
+			if (running_script)
+			{
+				stdout = fdopen(STDOUT_FILENO, "w");
+			}
+
+			int status = request->builtin->handler(join_argv(request->argv, NULL));
+			fflush(stdout);
+			fflush(stderr);
+			_exit(status);
+		}
+
+		execv(request->path, request->argv);
+
+		if (errno == ENOEXEC)
+		{
+			execv("/bin/sh", build_script_argv(request->path, request->argv));
+		}
+
+		print_spawn_error(request->argv[0], errno);
+		fflush(stdout);
+		_exit((errno == ENOENT) ? 127 : 126);
+	}
+
+	return child_pid;
+}
+
+//*****************************************************************************
+// Abstract: Builds the argv that runs path as a script under /bin/sh, for a
+// file the kernel refused with ENOEXEC. The array lives in the line arena.
+//*****************************************************************************
+char** build_script_argv(const char *path, char **argv)
+{
+	int count = 0;
+
+	while (argv[count] != NULL)
+	{
+		count++;
+	}
+
+	char **script_argv = (char**)arena_alloc(&g_line_arena, (count + 2) * sizeof(char*));
+	int i;
+
+	script_argv[0] = "/bin/sh";
+	script_argv[1] = (char*)path;
+	for (i = 1; i <= count; i++)
+	{
+		script_argv[i + 1] = argv[i];
+	}
+
+	return script_argv;
+}
+
+//*****************************************************************************
+// Abstract: Reports why a command could not be started
+//*****************************************************************************
+void print_spawn_error(const char *command, int error)
+{
+	if (error == ENOENT)
+	{
+		printf("Error: command \"%s\" not found\n", command);
+	}
+	else
+	{
+		printf("Error: %s: %s\n", command, strerror(error));
+	}
+}
+
+//*****************************************************************************
+// Abstract: Applies the launch settings to the calling process, a child that
+// is about to exec or run a builtin. Returns 0 on success or -1 after
+// printing why a setting could not be applied.
+//*****************************************************************************
+int apply_launch_settings(const struct launch_settings *settings)
+{
+	int i;
+
+	if (settings->set_cpus && 0 != sched_setaffinity(0, sizeof(cpu_set_t), &settings->cpus))
+	{
+		printf("Error: cannot set cpu affinity: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (settings->set_nice && 0 != setpriority(PRIO_PROCESS, 0, settings->nice))
+	{
+		printf("Error: cannot set nice %d: %s\n", settings->nice, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < LAUNCH_LIMIT_COUNT; i++)
+	{
+		//The hard limit too, so the command cannot raise it again
+		struct rlimit limit = { settings->limits[i], settings->limits[i] };
+
+		if (settings->limits[i] >= 0 && 0 != setrlimit(g_limit_resources[i], &limit))
+		{
+			printf("Error: cannot set %s limit: %s\n", g_limit_names[i], strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Starts the fork server: a copy of the shell binary that is
+// exec'd fresh, so its address space holds none of the history, aliases or
+// other state the shell builds up, and that launches commands for the shell
+// over a socket pair. Returns 0 on success.
+//*****************************************************************************
+int start_fork_server()
+{
+	int fds[2];
+	char fd_argument[16];
+
+	if (0 != socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds))
+	{
+		return -1;
+	}
+
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		//The server's end is the only descriptor it inherits on purpose
+		int server_fd = dup(fds[1]);
+		snprintf(fd_argument, sizeof(fd_argument), "%d", server_fd);
+		execl("/proc/self/exe", "simple-shell", FORK_SERVER_ARGUMENT, fd_argument, (char*)NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+
+	if (pid < 0)
+	{
+		close(fds[0]);
+		return -1;
+	}
+
+	g_fork_server_fd = fds[0];
+	g_fork_server_pid = pid;
+	watch_fd(g_fork_server_fd, EVENT_FORK_SERVER);
+
+	verbose_print("VEBOSE: Started fork server %d\n", (int)pid);
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Closes the shell's end of the fork server socket. The server
+// exits when it sees the socket close.
+//*****************************************************************************
+void stop_fork_server()
+{
+	if (g_fork_server_fd >= 0)
+	{
+		unwatch_fd(g_fork_server_fd);
+		close(g_fork_server_fd);
+		g_fork_server_fd = -1;
+
+		//The server is not in a job, nothing else reaps it
+		waitpid(g_fork_server_pid, NULL, 0);
+		g_fork_server_pid = 0;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Sends the request to the fork server along with the shell's
+// stdin, stdout and stderr, the working directory and the environment, and
+// waits for the server to report the pid. Child state changes that arrive
+// first are recorded in the job table, the event loop gets the rest. Falls back to posix_spawn if the
+// server is gone. Returns the child pid or -1 with errno set.
+//*****************************************************************************
+pid_t spawn_with_server(struct spawn_request *request)
+{
+	extern char **environ;
+	struct fork_server_request header;
+	int fds[3 + MAX_REDIRECTIONS], fd_count = 3;
+	char cwd[PATH_MAX];
+	size_t length = 0;
+	int i, j;
+
+	if (g_fork_server_fd < 0 && 0 != start_fork_server())
+	{
+		return spawn_with_posix_spawn(request);
+	}
+
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+	{
+		cwd[0] = '\0';
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.set_process_group = request->set_process_group;
+	header.process_group = request->process_group;
+	header.take_terminal = request->take_terminal;
+	header.launch = request->launch;
+	header.redirection_count = request->redirection_count;
+
+	//path, cwd, argv and the environment go as one run of strings
+	length = strlen(request->path) + 1 + strlen(cwd) + 1;
+	for (header.argc = 0; request->argv[header.argc] != NULL; header.argc++)
+	{
+		length += strlen(request->argv[header.argc]) + 1;
+	}
+	for (header.envc = 0; environ[header.envc] != NULL; header.envc++)
+	{
+		length += strlen(environ[header.envc]) + 1;
+	}
+	header.length = length;
+
+	char *strings = (char*)arena_alloc(&g_line_arena, length), *end = strings;
+	end = stpcpy(end, request->path) + 1;
+	end = stpcpy(end, cwd) + 1;
+	for (i = 0; i < header.argc; i++)
+	{
+		end = stpcpy(end, request->argv[i]) + 1;
+	}
+	for (i = 0; i < header.envc; i++)
+	{
+		end = stpcpy(end, environ[i]) + 1;
+	}
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	for (i = 0; i < request->redirection_count; i++)
+	{
+		int source_fd = request->redirections[i].source_fd;
+
+		//2>&1 after a pipe means the pipe: a source that is already set up in the child stays there
+		header.redirection_fds[i] = request->redirections[i].fd;
+		header.redirection_sources[i] = (source_fd <= STDERR_FILENO) ? source_fd : -1;
+		for (j = 0; j < i; j++)
+		{
+			if (source_fd == request->redirections[j].fd)
+			{
+				header.redirection_sources[i] = source_fd;
+			}
+		}
+
+		if (header.redirection_sources[i] < 0)
+		{
+			fds[fd_count++] = source_fd;
+		}
+	}
+
+	int sent = (0 == send_with_fds(g_fork_server_fd, &header, sizeof(header), fds, fd_count));
+	size_t offset;
+
+	for (offset = 0; sent && offset < length; offset += FORK_SERVER_PACKET_SIZE)
+	{
+		size_t packet = (length - offset < FORK_SERVER_PACKET_SIZE) ? length - offset : FORK_SERVER_PACKET_SIZE;
+		sent = (send(g_fork_server_fd, strings + offset, packet, MSG_NOSIGNAL) == (ssize_t)packet);
+	}
+
+	pid_t child_pid = -1;
+	int error = EPIPE;
+
+	while (sent)
+	{
+		struct fork_server_message message;
+
+		if (recv(g_fork_server_fd, &message, sizeof(message), 0) != sizeof(message))
+		{
+			sent = 0;
+		}
+		else if (message.type == FORK_SERVER_CHANGED)
+		{
+			fork_server_record(&message);
+		}
+		else
+		{
+			child_pid = message.pid;
+			error = message.status;
+			break;
+		}
+	}
+
+	if (!sent)
+	{
+		printf("Error: fork server %d stopped responding, using posix_spawn\n", (int)g_fork_server_pid);
+		stop_fork_server();
+		g_spawn_backend = SPAWN_POSIX;
+		return spawn_with_posix_spawn(request);
+	}
+
+	if (child_pid < 0)
+	{
+		errno = error;
+	}
+
+	return child_pid;
+}
+
+//*****************************************************************************
+// Abstract: Sends one packet with the input descriptors attached. Returns 0
+// on success.
+//*****************************************************************************
+int send_with_fds(int socket_fd, const void *data, size_t length, const int *fds, int fd_count)
+{
+	char control[CMSG_SPACE(sizeof(int) * (3 + MAX_REDIRECTIONS))];
+	struct iovec io = { (void*)data, length };
+	struct msghdr message;
+
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov = &io;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+	memcpy(CMSG_DATA(header), fds, sizeof(int) * fd_count);
+
+	return (sendmsg(socket_fd, &message, MSG_NOSIGNAL) == (ssize_t)length) ? 0 : -1;
+}
+
+//*****************************************************************************
+// Abstract: Records every child state change the fork server has reported
+// so far. Called by run_events when the socket is readable.
+//*****************************************************************************
+void fork_server_collect()
+{
+	struct fork_server_message message;
+	ssize_t received;
+
+	while ((received = recv(g_fork_server_fd, &message, sizeof(message), MSG_DONTWAIT)) == sizeof(message))
+	{
+		fork_server_record(&message);
+	}
+
+	//The server has exited, the next launch starts a new one
+	if (received == 0)
+	{
+		stop_fork_server();
+	}
+}
+
+//*****************************************************************************
+// Abstract: Records a child state change reported by the fork server
+//*****************************************************************************
+void fork_server_record(struct fork_server_message *message)
+{
+	update_job_process(message->pid, message->status, &message->usage);
+	g_jobs_changed = 1;
+}
+
+//*****************************************************************************
+// Abstract: SIGCHLD handler of the fork server, only wakes up its loop
+//*****************************************************************************
+void fork_server_sigchld(int signal_number)
+{
+	g_fork_server_reap = 1;
+}
+
+//*****************************************************************************
+// Abstract: Main loop of the fork server. Launches every request that comes
+// in on socket_fd with spawn_with_fork, from this small process, and
+// reports the pid and every later state change of the child. The shell's
+// event loop watches the socket for those. Returns when the shell closes
+// the socket.
+//*****************************************************************************
+int run_fork_server(int socket_fd)
+{
+	extern char **environ;
+	struct sigaction action;
+	sigset_t wait_mask;
+	char *strings = NULL, *cwd = NULL;
+	char **vectors = NULL;
+	size_t strings_capacity = 0, vectors_capacity = 0;
+	int i;
+
+	fcntl(socket_fd, F_SETFD, FD_CLOEXEC);
+
+	//The shell owns the terminal's job control signals, the server must not stop or die on ^C
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = fork_server_sigchld;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGCHLD, &action, NULL);
+
+	sigemptyset(&g_sigchld_mask);
+	sigaddset(&g_sigchld_mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &wait_mask);
+	sigdelset(&wait_mask, SIGCHLD);
+
+	while (1)
+	{
+		struct pollfd poll_fd = { socket_fd, POLLIN, 0 };
+
+		//SIGCHLD is only let in while sleeping here
+		ppoll(&poll_fd, 1, NULL, &wait_mask);
+
+		if (g_fork_server_reap)
+		{
+			struct fork_server_message message;
+
+			g_fork_server_reap = 0;
+			memset(&message, 0, sizeof(message));
+			message.type = FORK_SERVER_CHANGED;
+
+			while ((message.pid = wait4(-1, &message.status, WNOHANG | WUNTRACED | WCONTINUED, &message.usage)) > 0)
+			{
+				send(socket_fd, &message, sizeof(message), MSG_NOSIGNAL);
+			}
+		}
+
+		if (!(poll_fd.revents & (POLLIN | POLLHUP)))
+		{
+			continue;
+		}
+
+		//The header carries the descriptors, the strings follow in packets
+		struct fork_server_request header;
+		int fds[3 + MAX_REDIRECTIONS], fd_count = 0;
+		char control[CMSG_SPACE(sizeof(fds))];
+		struct iovec io = { &header, sizeof(header) };
+		struct msghdr packet;
+
+		memset(&packet, 0, sizeof(packet));
+		packet.msg_iov = &io;
+		packet.msg_iovlen = 1;
+		packet.msg_control = control;
+		packet.msg_controllen = sizeof(control);
+
+		if (recvmsg(socket_fd, &packet, MSG_CMSG_CLOEXEC) != sizeof(header))
+		{
+			break;
+		}
+
+		struct cmsghdr *control_header = CMSG_FIRSTHDR(&packet);
+		if (control_header != NULL && control_header->cmsg_type == SCM_RIGHTS)
+		{
+			fd_count = (control_header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(control_header), sizeof(int) * fd_count);
+		}
+
+		if (header.length > strings_capacity)
+		{
+			strings_capacity = header.length;
+			strings = (char*)realloc(strings, strings_capacity);
+		}
+		if ((size_t)header.argc + header.envc + 2 > vectors_capacity)
+		{
+			vectors_capacity = header.argc + header.envc + 2;
+			vectors = (char**)realloc(vectors, vectors_capacity * sizeof(char*));
+		}
+
+		size_t offset = 0;
+		while (offset < header.length)
+		{
+			ssize_t received = recv(socket_fd, strings + offset, header.length - offset, 0);
+			if (received <= 0)
+			{
+				break;
+			}
+			offset += received;
+		}
+
+		struct fork_server_message reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.type = FORK_SERVER_SPAWNED;
+		reply.pid = -1;
+		reply.status = EINVAL;
+
+		int passed = (header.redirection_count <= MAX_REDIRECTIONS) ? 3 : -1;
+		for (i = 0; i < header.redirection_count && passed > 0; i++)
+		{
+			passed += (header.redirection_sources[i] < 0);
+		}
+
+		if (offset == header.length && fd_count == passed)
+		{
+			char *path = strings, *text = path + strlen(path) + 1;
+			char *new_cwd = text;
+			text += strlen(text) + 1;
+
+			for (i = 0; i < header.argc + header.envc; i++)
+			{
+				vectors[i + (i >= header.argc)] = text;
+				text += strlen(text) + 1;
+			}
+			vectors[header.argc] = NULL;
+			vectors[header.argc + header.envc + 1] = NULL;
+
+			if (new_cwd[0] != '\0' && (cwd == NULL || 0 != strcmp(cwd, new_cwd)) && 0 == chdir(new_cwd))
+			{
+				free(cwd);
+				cwd = strdup(new_cwd);
+			}
+			environ = &vectors[header.argc + 1];
+
+			struct spawn_request request;
+			init_spawn_request(&request, path, vectors);
+			request.set_process_group = header.set_process_group;
+			request.process_group = header.process_group;
+			request.take_terminal = header.take_terminal;
+			request.launch = header.launch;
+
+			//The shell's own stdin, stdout and stderr first, then its redirections
+			for (i = 0; i < 3; i++)
+			{
+				request.redirections[i].fd = i;
+				request.redirections[i].source_fd = fds[i];
+			}
+			for (i = 0, passed = 3; i < header.redirection_count; i++)
+			{
+				request.redirections[3 + i].fd = header.redirection_fds[i];
+				request.redirections[3 + i].source_fd = (header.redirection_sources[i] < 0)
+					? fds[passed++] : header.redirection_sources[i];
+			}
+			request.redirection_count = 3 + header.redirection_count;
+
+			reply.pid = spawn_with_fork(&request);
+			reply.status = (reply.pid < 0) ? errno : 0;
+
+			//Only the parent can settle the group before the child runs
+			if (reply.pid > 0 && request.set_process_group)
+			{
+				setpgid(reply.pid, request.process_group ? request.process_group : reply.pid);
+			}
+		}
+
+		for (i = 0; i < fd_count; i++)
+		{
+			close(fds[i]);
+		}
+
+		send(socket_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Sets the pipe buffer size used between pipeline stages from
+// "set pipesize <bytes>" (0 keeps the kernel default). Returns 1 if the
+// input was a pipe size setting.
+//*****************************************************************************
+int set_pipe_size(const char *input_buffer)
+{
+	const char setting[] = "set pipesize ";
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	g_pipe_size = atoi(&input_buffer[strlen(setting)]);
+	if (g_pipe_size < 0)
+	{
+		g_pipe_size = 0;
+	}
+
+	verbose_print("VEBOSE: Pipe size set to %d\n", g_pipe_size);
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Runs the NULL terminated input params as a pipeline, splitting
+// it into stages at every "|" operator. Every stage is resolved and started
+// before any of them is waited on, and adjacent stages are connected
+// directly with a pipe so data never passes through the shell. The stages
+// make up one job in the job table. Returns the exit status of the last
+// stage (0 for background pipelines).
+//*****************************************************************************
+int run_pipeline(char *params[], unsigned char *operators, int run_in_background)
+{
+	char **stages[MAX_PIPELINE];
+	unsigned char *stage_operators[MAX_PIPELINE];
+	char *paths[MAX_PIPELINE];
+	struct builtin *builtins[MAX_PIPELINE];
+	struct file_redirection file_redirections[MAX_PIPELINE][MAX_REDIRECTIONS];
+	int file_redirection_counts[MAX_PIPELINE];
+	int stage_count = 0, status = 0, last_failed = 0, i, j;
+	size_t command_length = 0;
+
+	//Keep the text of the whole pipeline for job listings
+	for (i = 0; params[i] != NULL; i++)
+	{
+		command_length += strlen(params[i]) + 1;
+	}
+	char *command = (char*)arena_alloc(&g_line_arena, command_length + 1);
+	command[0] = '\0';
+	for (i = 0; params[i] != NULL; i++)
+	{
+		if (i > 0) strcat(command, " ");
+		strcat(command, params[i]);
+	}
+
+	//Split params into stages by terminating each one at the "|"
+	stages[stage_count] = params;
+	stage_operators[stage_count++] = operators;
+	for (i = 0; params[i] != NULL; i++)
+	{
+		if (operators[i] && 0 == strcmp(params[i], "|"))
+		{
+			if (stage_count == MAX_PIPELINE)
+			{
+				printf("Error: too many commands in pipeline\n");
+				return 1;
+			}
+
+			params[i] = NULL;
+			stages[stage_count] = &params[i + 1];
+			stage_operators[stage_count++] = &operators[i + 1];
+		}
+	}
+
+	//Resolve every stage before starting any of them
+	for (i = 0; i < stage_count; i++)
+	{
+		//Two redirections are kept free for the pipes
+		file_redirection_counts[i] = parse_redirections(stages[i], stage_operators[i], file_redirections[i], MAX_REDIRECTIONS - 2);
+		if (file_redirection_counts[i] < 0)
+		{
+			return 1;
+		}
+
+		if (stages[i][0] == NULL)
+		{
+			printf("Error: missing command in pipeline\n");
+			return 1;
+		}
+
+		//Builtins in a pipeline run in a child like any other stage
+		builtins[i] = find_builtin(stages[i][0]);
+		if (builtins[i] != NULL)
+		{
+			paths[i] = stages[i][0];
+			continue;
+		}
+
+		uint64_t trace_start = g_tracing ? trace_now() : 0;
+
+		paths[i] = find_command(stages[i][0]);
+
+		if (g_tracing)
+		{
+			trace_complete("path", trace_start, paths[i] ? paths[i] : stages[i][0], 0);
+		}
+
+		if (paths[i] == NULL)
+		{
+			printf("Error: command \"%s\" not found\n", stages[i][0]);
+			return 127;
+		}
+
+		//A stage that fails to start drops its command from the hash, which frees the path
+		paths[i] = arena_strdup(&g_line_arena, paths[i]);
+	}
+
+	//No child can be reaped before it is in the job table
+	sigset_t old_mask;
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	struct job *job = create_job(command);
+	if (job == NULL)
+	{
+		printf("Error: too many jobs\n");
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		return 1;
+	}
+
+	int read_fd = -1;
+
+	//Anything the shell printed must come out before the children's output
+	fflush(stdout);
+
+	for (i = 0; i < stage_count; i++)
+	{
+		int pipe_fds[2] = { -1, -1 };
+
+		if (i < stage_count - 1)
+		{
+			if (0 != pipe2(pipe_fds, O_CLOEXEC))
+			{
+				perror("pipe");
+				break;
+			}
+
+			if (g_pipe_size > 0)
+			{
+				fcntl(pipe_fds[1], F_SETPIPE_SZ, g_pipe_size);
+			}
+		}
+
+		struct spawn_request request;
+		init_spawn_request(&request, paths[i], stages[i]);
+		request.builtin = builtins[i];
+		request.set_process_group = run_in_background || g_interactive;
+		request.process_group = job->process_group;
+		request.take_terminal = g_interactive && !run_in_background;
+
+		//Unless the command chose its cpus, round robin gives each background process its own core
+		int cpu = -1;
+		if (run_in_background && g_round_robin && !request.launch.set_cpus)
+		{
+			cpu = next_round_robin_cpu();
+			CPU_ZERO(&request.launch.cpus);
+			CPU_SET(cpu, &request.launch.cpus);
+			request.launch.set_cpus = 1;
+		}
+
+		if (read_fd >= 0)
+		{
+			request.redirections[request.redirection_count].fd = STDIN_FILENO;
+			request.redirections[request.redirection_count].source_fd = read_fd;
+			request.redirection_count++;
+		}
+
+		if (pipe_fds[1] >= 0)
+		{
+			request.redirections[request.redirection_count].fd = STDOUT_FILENO;
+			request.redirections[request.redirection_count].source_fd = pipe_fds[1];
+			request.redirection_count++;
+		}
+
+		//Files are opened here and only duplicated onto their descriptors in the child,
+		//after the pipes so an explicit redirection wins
+		int opened_fds[MAX_REDIRECTIONS], opened_count = 0, open_failed = 0;
+
+		for (j = 0; j < file_redirection_counts[i]; j++)
+		{
+			struct file_redirection *redirection = &file_redirections[i][j];
+			int source_fd = redirection->source_fd;
+
+			if (redirection->path != NULL)
+			{
+				source_fd = open(redirection->path, redirection->flags | O_CLOEXEC, 0666);
+				if (source_fd < 0)
+				{
+					printf("Error: cannot open %s: %s\n", redirection->path, strerror(errno));
+					open_failed = 1;
+					break;
+				}
+				opened_fds[opened_count++] = source_fd;
+			}
+
+			request.redirections[request.redirection_count].fd = redirection->fd;
+			request.redirections[request.redirection_count].source_fd = source_fd;
+			request.redirection_count++;
+		}
+
+		uint64_t trace_start = g_tracing ? trace_now() : 0;
+
+		pid_t child_pid = open_failed ? -1 : spawn_command(&request);
+
+		if (g_tracing)
+		{
+			trace_complete("spawn", trace_start, stages[i][0], child_pid);
+		}
+
+		for (j = 0; j < opened_count; j++)
+		{
+			close(opened_fds[j]);
+		}
+
+		last_failed = (child_pid < 0);
+
+		if (open_failed)
+		{
+			status = 1;
+		}
+		else if (child_pid < 0)
+		{
+			int error = errno;
+
+			print_spawn_error(stages[i][0], error);
+			forget_command(stages[i][0]);
+			status = (error == ENOENT) ? 127 : 126;
+		}
+		else
+		{
+			if (job->process_group == 0 && request.set_process_group)
+			{
+				job->process_group = child_pid;
+
+				//Also done here in case the child has not got that far yet
+				setpgid(child_pid, child_pid);
+				if (request.take_terminal)
+				{
+					tcsetpgrp(STDIN_FILENO, child_pid);
+				}
+			}
+
+			add_job_process(job, child_pid);
+			job->processes[job->process_count - 1].cpu = cpu;
+		}
+
+		//The shell keeps neither end once the children have their copies
+		if (read_fd >= 0) close(read_fd);
+		if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+		read_fd = pipe_fds[0];
+	}
+
+	if (read_fd >= 0)
+	{
+		close(read_fd);
+	}
+
+	if (job->process_count == 0)
+	{
+		free_job(job);
+	}
+	else if (run_in_background)
+	{
+		g_current_job = job_id(job);
+		if (!g_batch_mode)
+		{
+			printf("[%d] %d\n", job_id(job), (int)job->processes[job->process_count - 1].pid);
+		}
+	}
+	else
+	{
+		uint64_t trace_start = g_tracing ? trace_now() : 0;
+
+		status = wait_for_job(job, 1);
+
+		if (g_tracing)
+		{
+			trace_complete("wait", trace_start, job->command, job->processes[job->process_count - 1].pid);
+		}
+
+		//A cached path that no longer exists should be searched for again next time
+		for (i = 0; i < job->process_count; i++)
+		{
+			if (job->processes[i].state == JOB_DONE && WIFEXITED(job->processes[i].status)
+				&& WEXITSTATUS(job->processes[i].status) == 127)
+			{
+				forget_command(stages[i][0]);
+			}
+		}
+
+		if (job->state == JOB_DONE)
+		{
+			free_job(job);
+		}
+
+		//The pipeline's status is the last stage's, even if it never started
+		if (last_failed)
+		{
+			status = 1;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: Writes all of data to fd, retrying short writes and signals.
+// Returns 0 on success and -1 on error.
+//*****************************************************************************
+int write_all(int fd, const char *data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		data += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Appends data to the output buffer, writing the buffer out to its
+// fd whenever it fills up.
+//*****************************************************************************
+void buffer_write(struct output_buffer *buffer, const char *data, size_t length)
+{
+	if (buffer->used + length > OUTPUT_BUFFER_SIZE)
+	{
+		buffer_flush(buffer);
+
+		//Anything that would not fit in an empty buffer goes straight out
+		if (length > OUTPUT_BUFFER_SIZE)
+		{
+			write_all(buffer->fd, data, length);
+			return;
+		}
+	}
+
+	memcpy(&buffer->data[buffer->used], data, length);
+	buffer->used += length;
+}
+
+//*****************************************************************************
+// Abstract: Writes everything held in the output buffer to its fd
+//*****************************************************************************
+void buffer_flush(struct output_buffer *buffer)
+{
+	if (buffer->used > 0)
+	{
+		write_all(buffer->fd, buffer->data, buffer->used);
+		buffer->used = 0;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Write function for the stdout stream used while a script is
+// running. Everything the shell prints goes to the terminal and the
+// transcript at the same time.
+//*****************************************************************************
+ssize_t transcript_stdout_write(void *cookie, const char *data, size_t length)
+{
+	write_all(g_terminal_fd, data, length);
+	buffer_write(&g_transcript, data, length);
+
+	return length;
+}
+
+//*****************************************************************************
+// Abstract: Starts teeing all output into file_name. The shell's stdout and
+// stderr descriptors are pointed at a pipe so children write into it, and
+// the shell's own stdout stream writes to the terminal and the transcript
+// directly. Returns 1 on success.
+//*****************************************************************************
+int start_transcript(const char *file_name)
+{
+	int pipe_fds[2];
+	int file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (file_fd < 0)
+	{
+		printf("Error: cannot open \"%s\"\n", file_name);
+		return 0;
+	}
+
+	if (0 != pipe2(pipe_fds, O_CLOEXEC))
+	{
+		perror("pipe");
+		close(file_fd);
+		return 0;
+	}
+
+	//The shell only ever drains what is already there
+	fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, TRANSCRIPT_PIPE_SIZE);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	g_terminal_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+	g_saved_stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+	dup2(pipe_fds[1], STDOUT_FILENO);
+	dup2(pipe_fds[1], STDERR_FILENO);
+	close(pipe_fds[1]);
+
+	g_transcript_pipe = pipe_fds[0];
+	watch_fd(g_transcript_pipe, EVENT_TRANSCRIPT);
+	g_transcript.fd = file_fd;
+	g_transcript.used = 0;
+
+	cookie_io_functions_t functions = { NULL, transcript_stdout_write, NULL, NULL };
+	g_terminal_stdout = stdout;
+	stdout = fopencookie(NULL, "w", functions);
+	setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+
+	running_script = 1;
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Stops the running transcript, drains the last of the child
+// output and restores the shell's stdout and stderr.
+//*****************************************************************************
+void stop_transcript()
+{
+	fflush(stdout);
+	transcript_drain();
+
+	fclose(stdout);
+	stdout = g_terminal_stdout;
+
+	dup2(g_terminal_fd, STDOUT_FILENO);
+	dup2(g_saved_stderr_fd, STDERR_FILENO);
+	close(g_terminal_fd);
+	close(g_saved_stderr_fd);
+	unwatch_fd(g_transcript_pipe);
+	close(g_transcript_pipe);
+	g_terminal_fd = g_saved_stderr_fd = g_transcript_pipe = -1;
+
+	buffer_flush(&g_transcript);
+	close(g_transcript.fd);
+
+	running_script = 0;
+}
+
+//*****************************************************************************
+// Abstract: Copies whatever the children have written into the transcript
+// pipe so far to the terminal and the transcript. Never blocks on the pipe.
+//*****************************************************************************
+void transcript_drain()
+{
+	char chunk[OUTPUT_BUFFER_SIZE];
+	ssize_t length;
+
+	while ((length = read(g_transcript_pipe, chunk, sizeof(chunk))) > 0)
+	{
+		write_all(g_terminal_fd, chunk, length);
+		buffer_write(&g_transcript, chunk, length);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Records a line typed by the user in the transcript. The terminal
+// already echoed it, so it only goes to the file.
+//*****************************************************************************
+void transcript_record_input(const char *input_buffer)
+{
+	buffer_write(&g_transcript, input_buffer, strlen(input_buffer));
+	buffer_write(&g_transcript, "\n", 1);
+}
+
+//*****************************************************************************
+// Abstract: Returns size bytes from the arena. Memory is only handed back
+// all at once by arena_reset, so an allocation is a pointer bump.
+//*****************************************************************************
+void* arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block = arena->current;
+
+	//Keep every allocation aligned for any type
+	size = (size + 15) & ~(size_t)15;
+
+	//Move on to the next block that fits, reusing blocks kept from earlier lines
+	while (block != NULL && block->used + size > block->size)
+	{
+		block = block->next;
+		if (block != NULL)
+		{
+			block->used = 0;
+		}
+	}
+
+	if (block == NULL)
+	{
+		size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+
+		block = (struct arena_block*)malloc(sizeof(struct arena_block) + block_size);
+		if (block == NULL)
+		{
+			perror("malloc");
+			exit(1);
+		}
+
+		block->size = block_size;
+		block->used = 0;
+		block->next = NULL;
+
+		//Append so the chain stays in the order it is reused
+		if (arena->current == NULL)
+		{
+			arena->first = block;
+		}
+		else
+		{
+			struct arena_block *last = arena->current;
+			while (last->next != NULL) last = last->next;
+			last->next = block;
+		}
+	}
+
+	arena->current = block;
+
+	void *memory = &block->data[block->used];
+	block->used += size;
+
+	return memory;
+}
+
+//*****************************************************************************
+// Abstract: Copies the input string into the arena
+//*****************************************************************************
+char* arena_strdup(struct arena *arena, const char *string)
+{
+	size_t length = strlen(string) + 1;
+	char *copy = (char*)arena_alloc(arena, length);
+
+	memcpy(copy, string, length);
+
+	return copy;
+}
+
+//*****************************************************************************
+// Abstract: Releases everything allocated from the arena. The blocks are
+// kept for the next line so a steady workload never calls malloc.
+//*****************************************************************************
+void arena_reset(struct arena *arena)
+{
+	arena->current = arena->first;
+
+	if (arena->first != NULL)
+	{
+		arena->first->used = 0;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Returns all of the arena's blocks to the system
+//*****************************************************************************
+void arena_free(struct arena *arena)
+{
+	struct arena_block *block = arena->first;
+
+	while (block != NULL)
+	{
+		struct arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	arena->first = arena->current = NULL;
+}
+
+//*****************************************************************************
+// Abstract: Sets up a reader for the input fd
+//*****************************************************************************
+void line_reader_init(struct line_reader *reader, int fd)
+{
+	reader->fd = fd;
+	reader->interactive = 0;
+	reader->eof = 0;
+	reader->capacity = READ_BLOCK_SIZE + 1;
+	reader->buffer = (char*)malloc(reader->capacity);
+	reader->start = reader->end = 0;
+}
+
+//*****************************************************************************
+// Abstract: Sets up a reader for the input file. Returns 1 if the file was
+// opened.
+//*****************************************************************************
+int line_reader_open(struct line_reader *reader, const char *file_name)
+{
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	line_reader_init(reader, fd);
+
+	//Size the buffer so a regular file is read in a single call
+	struct stat file_stat;
+	if (0 == fstat(fd, &file_stat) && S_ISREG(file_stat.st_mode) && file_stat.st_size > READ_BLOCK_SIZE)
+	{
+		reader->capacity = (size_t)file_stat.st_size + READ_BLOCK_SIZE + 1;
+		reader->buffer = (char*)realloc(reader->buffer, reader->capacity);
+	}
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Sets up a reader that returns the lines of the input text
+//*****************************************************************************
+void line_reader_from_string(struct line_reader *reader, const char *text)
+{
+	size_t length = strlen(text);
+
+	line_reader_init(reader, -1);
+	reader->eof = 1;
+
+	if (length + 1 > reader->capacity)
+	{
+		reader->capacity = length + 1;
+		reader->buffer = (char*)realloc(reader->buffer, reader->capacity);
+	}
+
+	memcpy(reader->buffer, text, length);
+	reader->end = length;
+}
+
+//*****************************************************************************
+// Abstract: Frees the reader's buffer and closes its fd
+//*****************************************************************************
+void line_reader_close(struct line_reader *reader)
+{
+	free(reader->buffer);
+	reader->buffer = NULL;
+
+	if (reader->fd > STDIN_FILENO)
+	{
+		close(reader->fd);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Returns the next line from the reader without its newline, or
+// NULL at end of input. Lines of any length are supported and a line ending
+// in a backslash is joined with the next one. The line points into the
+// reader's buffer and is only valid until the next call.
+//*****************************************************************************
+char* read_line(struct line_reader *reader)
+{
+	size_t scanned = reader->start;
+
+	while (1)
+	{
+		char *newline = (char*)memchr(&reader->buffer[scanned], '\n', reader->end - scanned);
+
+		if (newline != NULL)
+		{
+			size_t position = newline - reader->buffer;
+
+			//A backslash before the newline continues the line, drop both characters
+			if (position > reader->start && reader->buffer[position - 1] == '\\')
+			{
+				memmove(&reader->buffer[position - 1], &reader->buffer[position + 1],
+					reader->end - position - 1);
+				reader->end -= 2;
+				scanned = position - 1;
+				continue;
+			}
+
+			char *line = &reader->buffer[reader->start];
+			*newline = '\0';
+			reader->start = position + 1;
+			return line;
+		}
+
+		scanned = reader->end;
+
+		//The last line of a file does not need a newline
+		if (reader->eof)
+		{
+			if (reader->start == reader->end)
+			{
+				return NULL;
+			}
+
+			char *line = &reader->buffer[reader->start];
+			reader->buffer[reader->end] = '\0';
+			reader->start = reader->end;
+			return line;
+		}
+
+		//Slide the partial line to the front, then make room for another block
+		if (reader->start > 0)
+		{
+			memmove(reader->buffer, &reader->buffer[reader->start], reader->end - reader->start);
+			reader->end -= reader->start;
+			scanned -= reader->start;
+			reader->start = 0;
+		}
+
+		//Always keep a spare byte for the terminator
+		if (reader->capacity - reader->end < READ_BLOCK_SIZE + 1)
+		{
+			reader->capacity *= 2;
+			reader->buffer = (char*)realloc(reader->buffer, reader->capacity);
+		}
+
+		if (reader->interactive && reader->end > 0)
+		{
+			printf("> ");
+			fflush(stdout);
+		}
+
+		ssize_t length = read(reader->fd, &reader->buffer[reader->end], reader->capacity - reader->end - 1);
+
+		if (length < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (length <= 0)
+		{
+			reader->eof = 1;
+		}
+		else
+		{
+			reader->end += length;
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Sets up the event loop and, for an interactive shell, puts the
+// shell in its own process group in control of the terminal. Signals the
+// shell handles stay blocked and are read from a signalfd in the loop, so
+// children are only ever reaped by run_events.
+//*****************************************************************************
+void init_job_control(int interactive)
+{
+	sigset_t signals;
+
+	sigemptyset(&g_sigchld_mask);
+	sigaddset(&g_sigchld_mask, SIGCHLD);
+
+	signals = g_sigchld_mask;
+	if (interactive)
+	{
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGWINCH);
+	}
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+
+	g_event_fd = epoll_create1(EPOLL_CLOEXEC);
+	g_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	watch_fd(g_signal_fd, EVENT_SIGNAL);
+
+	//Started by the rc file before there was a loop to report to
+	if (g_fork_server_fd >= 0)
+	{
+		watch_fd(g_fork_server_fd, EVENT_FORK_SERVER);
+	}
+	if (g_path_index.inotify_fd >= 0)
+	{
+		watch_fd(g_path_index.inotify_fd, EVENT_PATH_INDEX);
+	}
+
+	g_interactive = interactive;
+
+	if (interactive)
+	{
+		//Wait until the shell is in the foreground before taking over
+		while (tcgetpgrp(STDIN_FILENO) != (g_shell_process_group = getpgrp()))
+		{
+			kill(-g_shell_process_group, SIGTTIN);
+		}
+
+		//SIGINT is blocked above, ^C at the prompt comes in through the loop
+		signal(SIGQUIT, SIG_IGN);
+		signal(SIGTSTP, SIG_IGN);
+		signal(SIGTTIN, SIG_IGN);
+		signal(SIGTTOU, SIG_IGN);
+
+		if (getpid() != getsid(0))
+		{
+			setpgid(0, 0);
+		}
+		g_shell_process_group = getpgrp();
+		tcsetpgrp(STDIN_FILENO, g_shell_process_group);
+		tcgetattr(STDIN_FILENO, &g_shell_terminal_modes);
+		ioctl(STDIN_FILENO, TIOCGWINSZ, &g_window_size);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Records every child that stopped or continued in the job table.
+// Called by run_events when SIGCHLD arrives. Exits are reaped through each
+// process's pidfd, which finds the process without searching, unless some
+// child has no pidfd.
+//*****************************************************************************
+void reap_children()
+{
+	struct rusage usage;
+	siginfo_t info;
+	int status;
+	pid_t pid;
+
+	if (g_reap_all)
+	{
+		while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+		{
+			update_job_process(pid, status, &usage);
+		}
+	}
+	else
+	{
+		//Without WEXITED the exited children are left for their pidfd
+		while (info.si_pid = 0, 0 == waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) && info.si_pid != 0)
+		{
+			struct job *job;
+			struct job_process *process = find_process(info.si_pid, &job);
+
+			if (process != NULL)
+			{
+				update_process(job, process, (info.si_code == CLD_CONTINUED) ? JOB_RUNNING : JOB_STOPPED, 0, NULL);
+			}
+		}
+	}
+
+	g_jobs_changed = 1;
+}
+
+//*****************************************************************************
+// Abstract: Reaps the process after its pidfd became readable. A child of
+// the fork server is not the shell's to reap, its exit comes over the
+// server socket instead. Either way the pidfd is done with the event loop.
+//*****************************************************************************
+void reap_process(struct job *job, struct job_process *process)
+{
+	struct rusage usage;
+	int status;
+
+	while (process->state != JOB_DONE && wait4(process->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage) > 0)
+	{
+		update_process(job, process, process_state(status), status, &usage);
+	}
+
+	unwatch_fd(process->pidfd);
+	g_jobs_changed = 1;
+}
+
+//*****************************************************************************
+// Abstract: Adds fd to the event loop. tag is returned by run_events when it
+// is readable.
+//*****************************************************************************
+void watch_fd(int fd, uint64_t tag)
+{
+	struct epoll_event event;
+
+	if (g_event_fd < 0)
+	{
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = tag;
+	epoll_ctl(g_event_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+//*****************************************************************************
+// Abstract: Removes fd from the event loop
+//*****************************************************************************
+void unwatch_fd(int fd)
+{
+	if (g_event_fd >= 0)
+	{
+		epoll_ctl(g_event_fd, EPOLL_CTL_DEL, fd, NULL);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Waits up to timeout milliseconds (-1 for ever, 0 to only look)
+// for events and handles them: children are reaped, transcript output is
+// drained, fork server reports are recorded and PATH directory changes are
+// applied as they arrive. Jobs past
+// their timeout are signalled, and the wait never runs past the next one.
+// Returns the tags of the events the caller has to handle itself,
+// EVENT_INPUT so far.
+//*****************************************************************************
+int run_events(int timeout)
+{
+	struct epoll_event events[64];
+	int fired = 0, count, i;
+
+	if (g_deadline_jobs > 0)
+	{
+		int64_t now = now_msec(), next = enforce_deadlines(now);
+
+		if (next > 0 && (timeout < 0 || next - now < timeout))
+		{
+			timeout = (int)(next - now);
+		}
+	}
+
+	count = epoll_wait(g_event_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+
+	for (i = 0; i < count; i++)
+	{
+		uint64_t data = events[i].data.u64;
+
+		switch (data & EVENT_TAG_MASK)
+		{
+			case EVENT_CHILD:
+			{
+				struct job *job = &g_jobs[data >> 32];
+				reap_process(job, &job->processes[(data >> 16) & EVENT_TAG_MASK]);
+				break;
+			}
+
+			case EVENT_SIGNAL:
+				handle_signals();
+				break;
+
+			case EVENT_TRANSCRIPT:
+				transcript_drain();
+				break;
+
+			case EVENT_FORK_SERVER:
+				fork_server_collect();
+				break;
+
+			case EVENT_PATH_INDEX:
+				read_path_events();
+				break;
+
+			default:
+				fired |= data;
+				break;
+		}
+	}
+
+	return fired;
+}
+
+//*****************************************************************************
+// Abstract: Handles every signal queued on the signalfd
+//*****************************************************************************
+void handle_signals()
+{
+	struct signalfd_siginfo info;
+
+	while (read(g_signal_fd, &info, sizeof(info)) == sizeof(info))
+	{
+		switch (info.ssi_signo)
+		{
+			case SIGCHLD:
+				reap_children();
+				break;
+
+			case SIGINT:
+				g_interrupted = 1;
+				break;
+
+			case SIGWINCH:
+				ioctl(STDIN_FILENO, TIOCGWINSZ, &g_window_size);
+				break;
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Waits at the prompt until a line can be read from the reader.
+// Jobs that finish or stop in the meantime are reported right away, and ^C
+// starts a fresh prompt, the terminal has already thrown the line away.
+//*****************************************************************************
+void wait_for_input(struct line_reader *reader)
+{
+	//A line read ahead with the last block needs no waiting
+	if (reader->start < reader->end && memchr(&reader->buffer[reader->start], '\n', reader->end - reader->start))
+	{
+		return;
+	}
+
+	watch_fd(reader->fd, EVENT_INPUT);
+
+	while (!(run_events(-1) & EVENT_INPUT))
+	{
+		if (g_interrupted)
+		{
+			g_interrupted = 0;
+			printf("\n" PROMPT);
+			fflush(stdout);
+		}
+
+		//A job that was only continued has nothing to show
+		if (g_jobs_changed && count_unreported_jobs() > 0)
+		{
+			printf("\n");
+			notify_jobs();
+			printf(PROMPT);
+			fflush(stdout);
+		}
+
+		if (running_script)
+		{
+			buffer_flush(&g_transcript);
+		}
+	}
+
+	unwatch_fd(reader->fd);
+}
+
+//*****************************************************************************
+// Abstract: Reads one line at the terminal with editing: cursor movement,
+// up and down through the commands starting with what was typed, ^R
+// incremental search and tab completion of command names. The prompt has
+// already been printed. While waiting, jobs are reported and the history
+// search index is built a step at a time. Returns the line, or NULL at end
+// of input.
+//*****************************************************************************
+char* edit_line(struct line_reader *reader)
+{
+	struct termios raw = g_shell_terminal_modes;
+	long behind = 0;
+	int result = 0, key;
+
+	//Signals stay on, ^C arrives through the event loop like at a cooked prompt
+	raw.c_iflag &= ~(ICRNL | INLCR | IXON | ISTRIP);
+	raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(reader->fd, TCSADRAIN, &raw);
+
+	g_editor.fd = reader->fd;
+	g_editor.length = g_editor.cursor = g_editor.kept = 0;
+	g_editor.browsing = -1;
+	g_editor.searching = 0;
+	g_editor.last_key = 0;
+	g_editor.columns = g_window_size.ws_col;
+	if (g_editor.line == NULL)
+	{
+		g_editor.capacity = 256;
+		g_editor.line = (char*)malloc(g_editor.capacity);
+	}
+
+	if (g_history.index_fd >= 0)
+	{
+		flock(g_history.index_fd, LOCK_SH);
+		if (0 == history_refresh())
+		{
+			behind = history_index_catch_up(0);
+		}
+		flock(g_history.index_fd, LOCK_UN);
+	}
+
+	watch_fd(reader->fd, EVENT_INPUT);
+
+	while (result == 0)
+	{
+		//Draw once the keys at hand are handled, not for every pasted byte
+		while (result == 0 && (key = edit_read_key()) != KEY_MORE)
+		{
+			result = g_editor.searching ? edit_search_key(key) : edit_key(key);
+			g_editor.last_key = key;
+		}
+
+		if (result != 0)
+		{
+			break;
+		}
+		edit_refresh();
+
+		int fired = 0;
+		while (!(fired & EVENT_INPUT))
+		{
+			fired = run_events(behind > 0 ? 0 : -1);
+
+			if (g_interrupted)
+			{
+				g_interrupted = 0;
+				edit_write("^C\n", 3);
+				g_editor.length = g_editor.cursor = g_editor.kept = 0;
+				g_editor.browsing = -1;
+				g_editor.searching = 0;
+				edit_refresh();
+			}
+
+			if (g_jobs_changed && count_unreported_jobs() > 0)
+			{
+				edit_write("\r\x1b[K", 4);
+				notify_jobs();
+				fflush(stdout);
+				edit_refresh();
+			}
+
+			if (g_editor.columns != g_window_size.ws_col)
+			{
+				g_editor.columns = g_window_size.ws_col;
+				edit_refresh();
+			}
+
+			if (running_script)
+			{
+				buffer_flush(&g_transcript);
+			}
+
+			//Nobody is typing, index some more history
+			if (behind > 0 && !(fired & EVENT_INPUT))
+			{
+				flock(g_history.index_fd, LOCK_SH);
+				behind = (0 == history_refresh()) ? history_index_catch_up(HISTORY_INDEX_STEP) : 0;
+				flock(g_history.index_fd, LOCK_UN);
+			}
+		}
+
+		ssize_t length = read(reader->fd, &g_editor.input[g_editor.input_end],
+			sizeof(g_editor.input) - g_editor.input_end);
+
+		if (length == 0 || (length < 0 && errno != EINTR && errno != EAGAIN))
+		{
+			result = -1;
+		}
+		else if (length > 0)
+		{
+			g_editor.input_end += length;
+		}
+	}
+
+	unwatch_fd(reader->fd);
+	tcsetattr(reader->fd, TCSADRAIN, &g_shell_terminal_modes);
+
+	if (result < 0)
+	{
+		return NULL;
+	}
+
+	char *line = (char*)arena_alloc(&g_line_arena, g_editor.length + 1);
+	memcpy(line, g_editor.line, g_editor.length);
+	line[g_editor.length] = '\0';
+	return line;
+}
+
+//*****************************************************************************
+// Abstract: Takes the next key from the editor's input. Escape sequences
+// for arrows, home, end and delete become KEY_ values. Returns KEY_MORE when
+// the input is used up, and waits briefly for the rest of a sequence that
+// was split across reads before deciding it was a lone escape.
+//*****************************************************************************
+int edit_read_key()
+{
+	struct line_editor *editor = &g_editor;
+	size_t available = editor->input_end - editor->input_start, used = 0;
+	unsigned char *input = (unsigned char*)&editor->input[editor->input_start];
+	int key = KEY_NONE;
+
+	if (available == 0)
+	{
+		editor->input_start = editor->input_end = 0;
+		return KEY_MORE;
+	}
+
+	if (input[0] != 27)
+	{
+		editor->input_start++;
+		return input[0];
+	}
+
+	if (available == 1 || ((input[1] == '[' || input[1] == 'O') && available == 2))
+	{
+		struct pollfd more = { editor->fd, POLLIN, 0 };
+
+		//Slide what is left to the front so the rest of the sequence fits
+		memmove(editor->input, input, available);
+		editor->input_start = 0;
+		editor->input_end = available;
+
+		if (poll(&more, 1, EDIT_ESCAPE_WAIT) > 0)
+		{
+			ssize_t length = read(editor->fd, &editor->input[available], sizeof(editor->input) - available);
+			if (length > 0)
+			{
+				editor->input_end += length;
+				return edit_read_key();
+			}
+		}
+
+		editor->input_start++;
+		return (available == 1) ? KEY_ESCAPE : KEY_NONE;
+	}
+
+	if (input[1] == '[')
+	{
+		//Parameters, then a final byte, as in ESC [ 3 ~ or ESC [ 1 ; 5 C
+		used = 2;
+		while (used < available && (isdigit(input[used]) || input[used] == ';'))
+		{
+			used++;
+		}
+		if (used == available)
+		{
+			editor->input_start += used;
+			return KEY_NONE;
+		}
+
+		int modified = (used > 2 && memchr(&input[2], ';', used - 2) != NULL);
+		switch (input[used])
+		{
+			case 'A': key = KEY_UP; break;
+			case 'B': key = KEY_DOWN; break;
+			case 'C': key = modified ? KEY_WORD_RIGHT : KEY_RIGHT; break;
+			case 'D': key = modified ? KEY_WORD_LEFT : KEY_LEFT; break;
+			case 'H': key = KEY_HOME; break;
+			case 'F': key = KEY_END; break;
+			case '~':
+				switch (atoi((char*)&input[2]))
+				{
+					case 1: case 7: key = KEY_HOME; break;
+					case 4: case 8: key = KEY_END; break;
+					case 3: key = KEY_DELETE; break;
+				}
+				break;
+		}
+		used++;
+	}
+	else if (input[1] == 'O')
+	{
+		switch (input[2])
+		{
+			case 'A': key = KEY_UP; break;
+			case 'B': key = KEY_DOWN; break;
+			case 'C': key = KEY_RIGHT; break;
+			case 'D': key = KEY_LEFT; break;
+			case 'H': key = KEY_HOME; break;
+			case 'F': key = KEY_END; break;
+		}
+		used = 3;
+	}
+	else
+	{
+		//Meta b and f move by words
+		key = (input[1] == 'b') ? KEY_WORD_LEFT : (input[1] == 'f') ? KEY_WORD_RIGHT : KEY_NONE;
+		used = 2;
+	}
+
+	editor->input_start += used;
+	return key;
+}
+
+//*****************************************************************************
+// Abstract: Handles one key while editing. Returns 1 when a line has been
+// entered, -1 for ^D on an empty line and 0 otherwise.
+//*****************************************************************************
+int edit_key(int key)
+{
+	struct line_editor *editor = &g_editor;
+	size_t start;
+
+	if (key != KEY_UP && key != KEY_DOWN && key != 16 && key != 14)
+	{
+		editor->browsing = -1;
+	}
+
+	switch (key)
+	{
+		case '\r':
+		case '\n':
+			editor->cursor = editor->length;
+			edit_refresh();
+			edit_write("\n", 1);
+
+			//A trailing backslash continues the line, as in read_line
+			if (editor->length > editor->kept && editor->line[editor->length - 1] == '\\')
+			{
+				editor->kept = editor->cursor = --editor->length;
+				return 0;
+			}
+			return 1;
+
+		case 4: //^D
+			if (editor->length == 0)
+			{
+				return -1;
+			}
+			//fall through
+		case KEY_DELETE:
+			if (editor->cursor < editor->length)
+			{
+				memmove(&editor->line[editor->cursor], &editor->line[editor->cursor + 1], editor->length - editor->cursor - 1);
+				editor->length--;
+			}
+			break;
+
+		case 127:
+		case 8: //^H
+			if (editor->cursor > editor->kept)
+			{
+				memmove(&editor->line[editor->cursor - 1], &editor->line[editor->cursor], editor->length - editor->cursor);
+				editor->cursor--;
+				editor->length--;
+			}
+			break;
+
+		case 1: //^A
+		case KEY_HOME:
+			editor->cursor = editor->kept;
+			break;
+
+		case 5: //^E
+		case KEY_END:
+			editor->cursor = editor->length;
+			break;
+
+		case 2: //^B
+		case KEY_LEFT:
+			if (editor->cursor > editor->kept)
+			{
+				editor->cursor--;
+			}
+			break;
+
+		case 6: //^F
+		case KEY_RIGHT:
+			if (editor->cursor < editor->length)
+			{
+				editor->cursor++;
+			}
+			break;
+
+		case KEY_WORD_LEFT:
+			while (editor->cursor > editor->kept && editor->line[editor->cursor - 1] == ' ')
+			{
+				editor->cursor--;
+			}
+			while (editor->cursor > editor->kept && editor->line[editor->cursor - 1] != ' ')
+			{
+				editor->cursor--;
+			}
+			break;
+
+		case KEY_WORD_RIGHT:
+			while (editor->cursor < editor->length && editor->line[editor->cursor] == ' ')
+			{
+				editor->cursor++;
+			}
+			while (editor->cursor < editor->length && editor->line[editor->cursor] != ' ')
+			{
+				editor->cursor++;
+			}
+			break;
+
+		case 11: //^K
+			editor->length = editor->cursor;
+			break;
+
+		case 21: //^U
+		case 23: //^W
+			start = editor->cursor;
+			if (key == 21)
+			{
+				start = editor->kept;
+			}
+			else
+			{
+				while (start > editor->kept && editor->line[start - 1] == ' ')
+				{
+					start--;
+				}
+				while (start > editor->kept && editor->line[start - 1] != ' ')
+				{
+					start--;
+				}
+			}
+			memmove(&editor->line[start], &editor->line[editor->cursor], editor->length - editor->cursor);
+			editor->length -= editor->cursor - start;
+			editor->cursor = start;
+			break;
+
+		case 12: //^L
+			edit_write("\x1b[H\x1b[2J", 7);
+			break;
+
+		case 16: //^P
+		case KEY_UP:
+			edit_history(1);
+			break;
+
+		case 14: //^N
+		case KEY_DOWN:
+			edit_history(0);
+			break;
+
+		case 18: //^R
+			free(editor->typed);
+			editor->typed = strndup(&editor->line[editor->kept], editor->length - editor->kept);
+			editor->searching = 1;
+			editor->query_length = 0;
+			editor->match = -1;
+			break;
+
+		case '\t':
+			edit_complete();
+			break;
+
+		default:
+			if (key >= 32 && key < 256 && key != 127)
+			{
+				char byte = (char)key;
+				edit_insert(&byte, 1);
+			}
+			break;
+	}
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Handles one key during a ^R search. Typing narrows the search,
+// ^R goes to the next older match, ^G puts back what was typed before and
+// any other key keeps the match and is handled as an editing key.
+//*****************************************************************************
+int edit_search_key(int key)
+{
+	struct line_editor *editor = &g_editor;
+
+	switch (key)
+	{
+		case 18: //^R
+			edit_search((editor->match >= 0) ? editor->match : LONG_MAX, 1);
+			return 0;
+
+		case 127:
+		case 8: //^H
+			if (editor->query_length > 0)
+			{
+				editor->query_length--;
+				edit_search(LONG_MAX, 0);
+			}
+			return 0;
+
+		case 7: //^G
+			editor->searching = 0;
+			edit_set_line(editor->typed, strlen(editor->typed));
+			return 0;
+
+		case KEY_ESCAPE:
+			editor->searching = 0;
+			return 0;
+
+		default:
+			if (key >= 32 && key < 256 && key != 127)
+			{
+				if (editor->query_length + 1 < sizeof(editor->query))
+				{
+					editor->query[editor->query_length++] = (char)key;
+					edit_search((editor->match >= 0) ? editor->match + 1 : LONG_MAX, 0);
+				}
+				return 0;
+			}
+
+			editor->searching = 0;
+			return edit_key(key);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Redraws the line. A line wider than the terminal scrolls
+// sideways to keep the cursor in view.
+//*****************************************************************************
+void edit_refresh()
+{
+	struct line_editor *editor = &g_editor;
+	char prompt[EDIT_QUERY_SIZE + 32];
+	size_t columns = (g_window_size.ws_col > 0) ? g_window_size.ws_col : 80;
+
+	if (editor->searching)
+	{
+		snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+			(editor->match < 0 && editor->query_length > 0) ? "failed " : "",
+			(int)editor->query_length, editor->query);
+	}
+	else
+	{
+		strcpy(prompt, (editor->kept > 0) ? "> " : PROMPT);
+	}
+
+	size_t prompt_length = strlen(prompt);
+	size_t length = editor->length - editor->kept, cursor = editor->cursor - editor->kept;
+	size_t room = (columns > prompt_length + 1) ? columns - prompt_length - 1 : 1;
+	size_t first = (cursor > room) ? cursor - room : 0;
+	size_t shown = (length - first < room) ? length - first : room;
+	char *screen = (char*)malloc(prompt_length + shown + 32);
+
+	int used = sprintf(screen, "\r%s%.*s\x1b[K\r", prompt, (int)shown, &editor->line[editor->kept + first]);
+	if (prompt_length + cursor - first > 0)
+	{
+		used += sprintf(&screen[used], "\x1b[%zuC", prompt_length + cursor - first);
+	}
+
+	edit_write(screen, used);
+	free(screen);
+}
+
+//*****************************************************************************
+// Abstract: Writes editor output to the terminal. While a script is running
+// this bypasses the transcript, which gets the finished line instead.
+//*****************************************************************************
+void edit_write(const char *text, size_t length)
+{
+	write_all((g_terminal_fd >= 0) ? g_terminal_fd : STDOUT_FILENO, text, length);
+}
+
+//*****************************************************************************
+// Abstract: Inserts text at the cursor
+//*****************************************************************************
+void edit_insert(const char *text, size_t length)
+{
+	struct line_editor *editor = &g_editor;
+
+	if (editor->length + length + 1 > editor->capacity)
+	{
+		while (editor->length + length + 1 > editor->capacity)
+		{
+			editor->capacity *= 2;
+		}
+		editor->line = (char*)realloc(editor->line, editor->capacity);
+	}
+
+	memmove(&editor->line[editor->cursor + length], &editor->line[editor->cursor], editor->length - editor->cursor);
+	memcpy(&editor->line[editor->cursor], text, length);
+	editor->cursor += length;
+	editor->length += length;
+}
+
+//*****************************************************************************
+// Abstract: Replaces the line being edited with text, cursor at the end
+//*****************************************************************************
+void edit_set_line(const char *text, size_t length)
+{
+	g_editor.length = g_editor.cursor = g_editor.kept;
+	edit_insert(text, length);
+}
+
+//*****************************************************************************
+// Abstract: Up and down: shows the next older or newer command starting
+// with what was typed before the first up, skipping ones equal to the line
+// shown. Going down past the newest brings back what was typed.
+//*****************************************************************************
+void edit_history(int older)
+{
+	struct line_editor *editor = &g_editor;
+	size_t shown_length, typed_length, length;
+	long entry;
+
+	if (g_history.index_fd < 0)
+	{
+		return;
+	}
+
+	flock(g_history.index_fd, LOCK_SH);
+
+	if (0 == history_refresh())
+	{
+		history_index_catch_up(-1);
+
+		if (editor->browsing < 0)
+		{
+			free(editor->typed);
+			editor->typed = strndup(&editor->line[editor->kept], editor->length - editor->kept);
+			editor->browsing = g_history_search.indexed;
+		}
+
+		typed_length = strlen(editor->typed);
+		shown_length = editor->length - editor->kept;
+		entry = editor->browsing;
+
+		while (1)
+		{
+			entry = older ? search_history(editor->typed, typed_length, entry, 1)
+				: search_history_newer(editor->typed, typed_length, entry, 1);
+
+			if (entry < 0)
+			{
+				break;
+			}
+
+			const char *text = history_entry(entry, &length);
+			if (length != shown_length || 0 != memcmp(text, &editor->line[editor->kept], length))
+			{
+				edit_set_line(text, length);
+				editor->browsing = entry;
+				break;
+			}
+		}
+
+		if (entry < 0 && !older)
+		{
+			edit_set_line(editor->typed, typed_length);
+			editor->browsing = -1;
+		}
+	}
+
+	flock(g_history.index_fd, LOCK_UN);
+}
+
+//*****************************************************************************
+// Abstract: Shows the newest command before entry number before that holds
+// the search query, with the cursor on the match. With skip_same, commands
+// equal to the one shown are passed over, so ^R does not stop on repeats.
+//*****************************************************************************
+void edit_search(long before, int skip_same)
+{
+	struct line_editor *editor = &g_editor;
+	size_t length;
+	long entry = -1;
+
+	if (editor->query_length == 0)
+	{
+		editor->match = -1;
+		edit_set_line(editor->typed, strlen(editor->typed));
+		return;
+	}
+
+	if (g_history.index_fd < 0)
+	{
+		return;
+	}
+
+	flock(g_history.index_fd, LOCK_SH);
+
+	if (0 == history_refresh())
+	{
+		history_index_catch_up(-1);
+
+		while ((entry = search_history(editor->query, editor->query_length, before, 0)) >= 0)
+		{
+			const char *text = history_entry(entry, &length);
+
+			if (!skip_same || length != editor->length - editor->kept
+				|| 0 != memcmp(text, &editor->line[editor->kept], length))
+			{
+				edit_set_line(text, length);
+				editor->cursor = editor->kept + ((const char*)memmem(text, length, editor->query, editor->query_length) - text);
+				break;
+			}
+			before = entry;
+		}
+	}
+
+	flock(g_history.index_fd, LOCK_UN);
+
+	editor->match = entry;
+}
+
+//*****************************************************************************
+// Abstract: Tab: completes the command name before the cursor from the
+// builtins, the aliases and the PATH index. One match is completed in
+// full, several as far as they agree, and a second tab lists them.
+//*****************************************************************************
+void edit_complete()
+{
+	struct line_editor *editor = &g_editor;
+	size_t start = editor->cursor, before, prefix_length, common, i;
+	int path_count, count = 0, m;
+
+	while (start > editor->kept && !strchr(" \t|;&<>", editor->line[start - 1]))
+	{
+		start--;
+	}
+
+	//Only the first word of a command is a command name
+	for (before = start; before > editor->kept && editor->line[before - 1] == ' '; before--);
+	if (before > editor->kept && !strchr("|;&", editor->line[before - 1]))
+	{
+		edit_write("\a", 1);
+		return;
+	}
+
+	prefix_length = editor->cursor - start;
+	char *prefix = strndup(&editor->line[start], prefix_length);
+	char **path_matches = complete_command(prefix, &path_count);
+	char **matches = (char**)malloc((path_count + g_builtin_count + g_aliases.capacity + 1) * sizeof(char*));
+
+	for (m = 0; m < path_count; m++)
+	{
+		matches[count++] = path_matches[m];
+	}
+	for (m = 0; m < g_builtin_count; m++)
+	{
+		if (0 == strncmp(g_builtins[m].name, prefix, prefix_length))
+		{
+			matches[count++] = (char*)g_builtins[m].name;
+		}
+	}
+	for (i = 0; i < g_aliases.capacity; i++)
+	{
+		if (g_aliases.slots[i].command != NULL && 0 == strncmp(g_aliases.slots[i].string, prefix, prefix_length))
+		{
+			matches[count++] = g_aliases.slots[i].string;
+		}
+	}
+
+	qsort(matches, count, sizeof(char*), compare_strings);
+	for (i = 0, m = 0; (int)i < count; i++)
+	{
+		if (m == 0 || 0 != strcmp(matches[m - 1], matches[i]))
+		{
+			matches[m++] = matches[i];
+		}
+	}
+	count = m;
+
+	if (count == 0)
+	{
+		edit_write("\a", 1);
+	}
+	else if (count == 1)
+	{
+		edit_insert(&matches[0][prefix_length], strlen(matches[0]) - prefix_length);
+		edit_insert(" ", 1);
+	}
+	else
+	{
+		//Sorted, so the first and last match bound what all of them share
+		for (common = 0; matches[0][common] != '\0' && matches[0][common] == matches[count - 1][common]; common++);
+
+		if (common > prefix_length)
+		{
+			edit_insert(&matches[0][prefix_length], common - prefix_length);
+		}
+		else if (editor->last_key == '\t')
+		{
+			edit_write("\n", 1);
+			for (m = 0; m < count && m < 100; m++)
+			{
+				edit_write(matches[m], strlen(matches[m]));
+				edit_write("  ", 2);
+			}
+			if (count > 100)
+			{
+				char more[64];
+				edit_write(more, snprintf(more, sizeof(more), "... %d more", count - 100));
+			}
+			edit_write("\n", 1);
+		}
+		else
+		{
+			edit_write("\a", 1);
+		}
+	}
+
+	free(matches);
+	free(path_matches);
+	free(prefix);
+}
+
+//*****************************************************************************
+// Abstract: Handles "set editing on" and "set editing off". Returns 1 if the
+// input was an editing setting.
+//*****************************************************************************
+int set_editing(const char *input_buffer)
+{
+	const char setting[] = "set editing ";
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	g_editing = (0 == strcmp(&input_buffer[strlen(setting)], "on"));
+	verbose_print("VEBOSE: Line editing %s\n", g_editing ? "enabled" : "disabled");
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Records a wait status of the input pid. Children that are not in
+// a job are ignored.
+//*****************************************************************************
+void update_job_process(pid_t pid, int status, struct rusage *usage)
+{
+	struct job *job;
+	struct job_process *process = find_process(pid, &job);
+
+	if (process != NULL)
+	{
+		update_process(job, process, process_state(status), status, usage);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Returns the job and process of the input pid, NULL if it is not
+// in a job
+//*****************************************************************************
+struct job_process* find_process(pid_t pid, struct job **job)
+{
+	int i, j;
+
+	for (i = 0; i < g_job_count; i++)
+	{
+		for (j = 0; j < g_jobs[i].process_count && g_jobs[i].state != JOB_FREE; j++)
+		{
+			if (g_jobs[i].processes[j].pid == pid)
+			{
+				*job = &g_jobs[i];
+				return &g_jobs[i].processes[j];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+//*****************************************************************************
+// Abstract: Returns the process state a wait status means
+//*****************************************************************************
+int process_state(int status)
+{
+	if (WIFSTOPPED(status))
+	{
+		return JOB_STOPPED;
+	}
+
+	return WIFCONTINUED(status) ? JOB_RUNNING : JOB_DONE;
+}
+
+//*****************************************************************************
+// Abstract: Records the new state of one process of the job and works out
+// the state of the job. status and usage are only used once it is done.
+//*****************************************************************************
+void update_process(struct job *job, struct job_process *process, int state, int status, struct rusage *usage)
+{
+	process->state = state;
+	if (state == JOB_DONE)
+	{
+		process->status = status;
+		add_rusage(&job->usage, usage);
+	}
+
+	if (g_tracing)
+	{
+		trace_record("exit", 'i', trace_now(), NULL, process->pid, status);
+	}
+
+	//The job is done once every process is, stopped once none is running
+	int running = 0, stopped = 0, k;
+	for (k = 0; k < job->process_count; k++)
+	{
+		if (job->processes[k].state == JOB_RUNNING) running++;
+		if (job->processes[k].state == JOB_STOPPED) stopped++;
+	}
+
+	state = running ? JOB_RUNNING : (stopped ? JOB_STOPPED : JOB_DONE);
+
+	if (state == JOB_DONE)
+	{
+		int last_status = job->processes[job->process_count - 1].status;
+
+		job->status = WIFEXITED(last_status) ? WEXITSTATUS(last_status) : 128 + WTERMSIG(last_status);
+		clock_gettime(CLOCK_MONOTONIC, &job->finished);
+		job->usage.wall_usec = (job->finished.tv_sec - job->started.tv_sec) * 1000000LL
+			+ (job->finished.tv_nsec - job->started.tv_nsec) / 1000;
+
+		if (job->timed_out)
+		{
+			job->status = TIMEOUT_STATUS;
+		}
+
+		if (job->deadline != 0)
+		{
+			job->deadline = 0;
+			g_deadline_jobs--;
+		}
+	}
+
+	if (state != job->state)
+	{
+		job->state = state;
+		job->notified = 0;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Takes the lowest free job number for the input command. Must be
+// called with SIGCHLD blocked. Returns NULL if the table is full.
+//*****************************************************************************
+struct job* create_job(const char *command)
+{
+	int i;
+
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		if (g_jobs[i].state == JOB_FREE)
+		{
+			struct job *job = &g_jobs[i];
+
+			memset(job, 0, sizeof(struct job));
+			job->state = JOB_RUNNING;
+			job->command = strdup(command);
+			clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+			if (g_command_deadline != 0)
+			{
+				job->deadline = g_command_deadline;
+				g_deadline_jobs++;
+			}
+
+			if (i >= g_job_count)
+			{
+				g_job_count = i + 1;
+			}
+
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+//*****************************************************************************
+// Abstract: Adds a started child to the job and watches its pidfd, which
+// becomes readable when it exits. The event carries the job and process
+// index, so reaping it is the same work however many children there are.
+// Must be called with SIGCHLD blocked.
+//*****************************************************************************
+void add_job_process(struct job *job, pid_t pid)
+{
+	struct job_process *process = &job->processes[job->process_count];
+
+	process->pid = pid;
+	process->state = JOB_RUNNING;
+	process->status = 0;
+	process->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+	process->cpu = -1;
+
+	if (process->pidfd >= 0)
+	{
+		watch_fd(process->pidfd, EVENT_CHILD | ((uint64_t)(job - g_jobs) << 32) | ((uint64_t)job->process_count << 16));
+	}
+	else
+	{
+		g_reap_all = 1;
+	}
+
+	job->process_count++;
+}
+
+//*****************************************************************************
+// Abstract: Releases the job's slot. Must be called with SIGCHLD blocked.
+//*****************************************************************************
+void free_job(struct job *job)
+{
+	int id = job_id(job);
+
+	int i;
+
+	if (job->state == JOB_DONE)
+	{
+		record_job_usage(job);
+	}
+
+	//A forked builtin may hold a copy of the pidfd, which would keep it in the loop
+	for (i = 0; i < job->process_count; i++)
+	{
+		if (job->processes[i].pidfd >= 0)
+		{
+			unwatch_fd(job->processes[i].pidfd);
+			close(job->processes[i].pidfd);
+		}
+	}
+
+	if (job->deadline != 0)
+	{
+		g_deadline_jobs--;
+	}
+
+	free(job->command);
+	job->command = NULL;
+	job->state = JOB_FREE;
+
+	while (g_job_count > 0 && g_jobs[g_job_count - 1].state == JOB_FREE)
+	{
+		g_job_count--;
+	}
+
+	//Fall back to the most recent job still around
+	if (g_current_job == id)
+	{
+		g_current_job = g_job_count;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Returns the job number of the input job
+//*****************************************************************************
+int job_id(struct job *job)
+{
+	return (int)(job - g_jobs) + 1;
+}
+
+//*****************************************************************************
+// Abstract: Returns the job named by %n, %% or %+ or the job that contains
+// the input pid. An empty spec means the current job. Returns NULL if there
+// is no such job.
+//*****************************************************************************
+struct job* find_job(const char *spec)
+{
+	int id, i, j;
+
+	if (spec == NULL || *spec == '\0' || 0 == strcmp(spec, "%%") || 0 == strcmp(spec, "%+"))
+	{
+		id = g_current_job;
+	}
+	else if (spec[0] == '%')
+	{
+		id = atoi(&spec[1]);
+	}
+	else
+	{
+		pid_t pid = atoi(spec);
+
+		for (i = 0; i < g_job_count; i++)
+		{
+			for (j = 0; j < g_jobs[i].process_count && g_jobs[i].state != JOB_FREE; j++)
+			{
+				if (g_jobs[i].processes[j].pid == pid)
+				{
+					return &g_jobs[i];
+				}
+			}
+		}
+
+		return NULL;
+	}
+
+	if (id < 1 || id > g_job_count || g_jobs[id - 1].state == JOB_FREE)
+	{
+		return NULL;
+	}
+
+	return &g_jobs[id - 1];
+}
+
+//*****************************************************************************
+// Abstract: Waits until the job is done or stopped, draining the transcript
+// while it runs. A foreground job gets the terminal and it is given back to
+// the shell afterwards. Must be called with SIGCHLD blocked. Returns the
+// job's exit status, or 128 plus the stop signal if it stopped.
+//*****************************************************************************
+int wait_for_job(struct job *job, int foreground)
+{
+	return wait_for_job_until(job, foreground, 0);
+}
+
+//*****************************************************************************
+// Abstract: wait_for_job that gives up at the deadline (monotonic ms, 0 for
+// none) and returns TIMEOUT_STATUS with the job still running
+//*****************************************************************************
+int wait_for_job_until(struct job *job, int foreground, int64_t deadline)
+{
+	//Output is drained and other jobs are reaped as it runs
+	while (job->state == JOB_RUNNING)
+	{
+		int timeout = -1;
+
+		if (deadline != 0)
+		{
+			int64_t left = deadline - now_msec();
+			if (left <= 0)
+			{
+				return TIMEOUT_STATUS;
+			}
+			timeout = (int)left;
+		}
+
+		run_events(timeout);
+
+		//Only a background job can be waited for while ^C reaches the shell
+		if (g_interrupted && !foreground)
+		{
+			g_interrupted = 0;
+			printf("\n");
+			return 128 + SIGINT;
+		}
+	}
+
+	if (running_script)
+	{
+		transcript_drain();
+	}
+
+	if (foreground && g_interactive)
+	{
+		tcsetpgrp(STDIN_FILENO, g_shell_process_group);
+
+		if (job->state == JOB_STOPPED)
+		{
+			tcgetattr(STDIN_FILENO, &job->terminal_modes);
+		}
+		tcsetattr(STDIN_FILENO, TCSADRAIN, &g_shell_terminal_modes);
+	}
+
+	if (job->state == JOB_STOPPED)
+	{
+		g_current_job = job_id(job);
+		job->notified = 1;
+		printf("\n");
+		print_job(job, 0);
+		return 128 + SIGTSTP;
+	}
+
+	//Start the prompt on a new line after ^C
+	if (foreground && WIFSIGNALED(job->processes[job->process_count - 1].status)
+		&& WTERMSIG(job->processes[job->process_count - 1].status) == SIGINT)
+	{
+		printf("\n");
+	}
+
+	job->notified = 1;
+	return job->status;
+}
+
+//*****************************************************************************
+// Abstract: Waits until one of the jobs is done or stopped, or until the
+// deadline (monotonic ms, 0 for none). Returns that job's status and frees
+// it if it is done, TIMEOUT_STATUS at the deadline or 128 + SIGINT after ^C.
+// Must be called with SIGCHLD blocked.
+//*****************************************************************************
+int wait_for_any_job(struct job **jobs, int job_count, int64_t deadline)
+{
+	int i;
+
+	while (1)
+	{
+		for (i = 0; i < job_count; i++)
+		{
+			if (jobs[i]->state != JOB_RUNNING)
+			{
+				int status = wait_for_job(jobs[i], 0);
+
+				if (jobs[i]->state == JOB_DONE)
+				{
+					free_job(jobs[i]);
+				}
+
+				return status;
+			}
+		}
+
+		int timeout = -1;
+		if (deadline != 0)
+		{
+			int64_t left = deadline - now_msec();
+			if (left <= 0)
+			{
+				return TIMEOUT_STATUS;
+			}
+			timeout = (int)left;
+		}
+
+		run_events(timeout);
+
+		if (g_interrupted)
+		{
+			g_interrupted = 0;
+			printf("\n");
+			return 128 + SIGINT;
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Sends a signal to every process of the job that has not been
+// reaped. Through the pidfd a process that has exited in the meantime
+// cannot be mistaken for a new one with the same pid.
+//*****************************************************************************
+void signal_job(struct job *job, int signal_number)
+{
+	int i;
+
+	for (i = 0; i < job->process_count; i++)
+	{
+		struct job_process *process = &job->processes[i];
+
+		if (process->state == JOB_DONE)
+		{
+			continue;
+		}
+
+		if (process->pidfd >= 0)
+		{
+			syscall(SYS_pidfd_send_signal, process->pidfd, signal_number, NULL, 0);
+		}
+		else
+		{
+			kill(process->pid, signal_number);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Signals every job whose deadline has passed: SIGTERM first, then
+// SIGKILL if it is still there TIMEOUT_KILL_DELAY ms later. Returns the
+// earliest deadline still ahead, 0 if there is none.
+//*****************************************************************************
+int64_t enforce_deadlines(int64_t now)
+{
+	int64_t next = 0;
+	int i;
+
+	for (i = 0; i < g_job_count; i++)
+	{
+		struct job *job = &g_jobs[i];
+
+		if (job->state == JOB_FREE || job->deadline == 0)
+		{
+			continue;
+		}
+
+		if (job->deadline <= now)
+		{
+			if (!job->timed_out)
+			{
+				job->timed_out = 1;
+				job->deadline = now + TIMEOUT_KILL_DELAY;
+				signal_job(job, SIGTERM);
+
+				if (job->state == JOB_STOPPED)
+				{
+					continue_job(job);
+				}
+			}
+			else
+			{
+				job->deadline = 0;
+				g_deadline_jobs--;
+				signal_job(job, SIGKILL);
+				continue;
+			}
+		}
+
+		if (next == 0 || job->deadline < next)
+		{
+			next = job->deadline;
+		}
+	}
+
+	return next;
+}
+
+//*****************************************************************************
+// Abstract: Returns the current monotonic time in milliseconds
+//*****************************************************************************
+int64_t now_msec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//*****************************************************************************
+// Abstract: Sends SIGCONT to every process of a stopped job. Must be called
+// with SIGCHLD blocked.
+//*****************************************************************************
+void continue_job(struct job *job)
+{
+	int i;
+
+	for (i = 0; i < job->process_count; i++)
+	{
+		if (job->processes[i].state == JOB_STOPPED)
+		{
+			job->processes[i].state = JOB_RUNNING;
+		}
+	}
+
+	job->state = JOB_RUNNING;
+	job->notified = 1;
+
+	if (job->process_group > 0)
+	{
+		kill(-job->process_group, SIGCONT);
+	}
+	else
+	{
+		for (i = 0; i < job->process_count; i++)
+		{
+			kill(job->processes[i].pid, SIGCONT);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Prints one line of the job listing, optionally with its exit
+// status and wall, user and system time
+//*****************************************************************************
+void print_job(struct job *job, int verbose_times)
+{
+	char state[32];
+	int id = job_id(job);
+
+	if (job->state == JOB_RUNNING)
+	{
+		strcpy(state, "Running");
+	}
+	else if (job->state == JOB_STOPPED)
+	{
+		strcpy(state, "Stopped");
+	}
+	else if (job->status == 0)
+	{
+		strcpy(state, "Done");
+	}
+	else if (WIFSIGNALED(job->processes[job->process_count - 1].status))
+	{
+		snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(job->processes[job->process_count - 1].status)));
+	}
+	else
+	{
+		sprintf(state, "Exit %d", job->status);
+	}
+
+	if (verbose_times)
+	{
+		struct timespec end = job->finished;
+
+		if (job->state != JOB_DONE)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &end);
+		}
+
+		double wall = (end.tv_sec - job->started.tv_sec) + (end.tv_nsec - job->started.tv_nsec) / 1e9;
+
+		printf("[%d]%c  %-10s real %8.3fs  user %8.3fs  sys %8.3fs  maxrss %7ld KB  csw %ld/%ld  %s\n",
+			id, (id == g_current_job) ? '+' : ' ', state, wall, job->usage.user_usec / 1e6,
+			job->usage.system_usec / 1e6, job->usage.max_rss_kb, job->usage.voluntary_switches,
+			job->usage.involuntary_switches, job->command);
+	}
+	else
+	{
+		printf("[%d]%c  %-22s %s\n", id, (id == g_current_job) ? '+' : ' ', state, job->command);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Reports jobs that finished or stopped in the background and
+// frees the finished ones. Only runs after the event loop flagged a change,
+// so an idle prompt costs nothing.
+//*****************************************************************************
+void notify_jobs()
+{
+	sigset_t old_mask;
+	int i;
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	g_jobs_changed = 0;
+
+	for (i = 0; i < g_job_count; i++)
+	{
+		struct job *job = &g_jobs[i];
+
+		if (job->state == JOB_FREE || job->state == JOB_RUNNING)
+		{
+			continue;
+		}
+
+		if (!job->notified && !g_batch_mode)
+		{
+			print_job(job, 0);
+			job->notified = 1;
+		}
+
+		if (job->state == JOB_DONE)
+		{
+			free_job(job);
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	fflush(stdout);
+}
+
+//*****************************************************************************
+// Abstract: Returns how many jobs notify_jobs would print
+//*****************************************************************************
+int count_unreported_jobs()
+{
+	int count = 0, i;
+
+	for (i = 0; i < g_job_count && !g_batch_mode; i++)
+	{
+		if (g_jobs[i].state != JOB_FREE && g_jobs[i].state != JOB_RUNNING && !g_jobs[i].notified)
+		{
+			count++;
+		}
+	}
+
+	return count;
+}
+
+//*****************************************************************************
+// Abstract: jobs [-v] lists the jobs, -v adds run times
+//*****************************************************************************
+int builtin_jobs(char *input_buffer)
+{
+	int verbose_times = (NULL != strstr(input_buffer, " -v"));
+	sigset_t old_mask;
+	int i;
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	for (i = 0; i < g_job_count; i++)
+	{
+		struct job *job = &g_jobs[i];
+
+		if (job->state != JOB_FREE)
+		{
+			print_job(job, verbose_times);
+			job->notified = 1;
+
+			if (job->state == JOB_DONE)
+			{
+				free_job(job);
+			}
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: fg [%n] continues a job in the foreground and waits for it
+//*****************************************************************************
+int builtin_fg(char *input_buffer)
+{
+	const char *spec = input_buffer + strcspn(input_buffer, " ");
+	sigset_t old_mask;
+	int status;
+
+	spec += strspn(spec, " ");
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	struct job *job = find_job(spec);
+	if (job == NULL || job->state == JOB_DONE)
+	{
+		printf("fg: no such job\n");
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		return 1;
+	}
+
+	printf("%s\n", job->command);
+	fflush(stdout);
+
+	if (g_interactive && job->process_group > 0)
+	{
+		tcsetpgrp(STDIN_FILENO, job->process_group);
+		if (job->state == JOB_STOPPED)
+		{
+			tcsetattr(STDIN_FILENO, TCSADRAIN, &job->terminal_modes);
+		}
+	}
+
+	continue_job(job);
+	status = wait_for_job(job, 1);
+
+	if (job->state == JOB_DONE)
+	{
+		free_job(job);
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: bg [%n] continues a stopped job in the background
+//*****************************************************************************
+int builtin_bg(char *input_buffer)
+{
+	const char *spec = input_buffer + strcspn(input_buffer, " ");
+	sigset_t old_mask;
+
+	spec += strspn(spec, " ");
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	struct job *job = find_job(spec);
+	if (job == NULL || job->state != JOB_STOPPED)
+	{
+		printf("bg: no such stopped job\n");
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		return 1;
+	}
+
+	continue_job(job);
+	printf("[%d]+ %s &\n", job_id(job), job->command);
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: wait [-n] [-t ms] [%n|pid ...] waits for the named jobs, or for
+// every running job, and returns the status of the last one waited for.
+// With -n it returns as soon as one of them is done, with -t it gives up
+// after ms milliseconds with status 124 and leaves the jobs running.
+//*****************************************************************************
+int builtin_wait(char *input_buffer)
+{
+	char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	char **token = &argv[1];
+	struct job **jobs = (struct job**)arena_alloc(&g_line_arena, sizeof(struct job*) * (g_job_count + 1));
+	int job_count = 0, any = 0, status = 0, i;
+	int64_t deadline = 0;
+	sigset_t old_mask;
+
+	for (; *token != NULL && (*token)[0] == '-'; token++)
+	{
+		if (0 == strcmp(*token, "-n"))
+		{
+			any = 1;
+		}
+		else if (0 == strcmp(*token, "-t") && token[1] != NULL && isdigit((unsigned char)token[1][0]))
+		{
+			deadline = now_msec() + atol(*++token);
+		}
+		else
+		{
+			printf("Error: usage: wait [-n] [-t ms] [%%n|pid ...]\n");
+			return 2;
+		}
+	}
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	//Jobs waited for by name are freed, the others are still reported as usual
+	int named = (*token != NULL);
+
+	if (!named)
+	{
+		for (i = 0; i < g_job_count; i++)
+		{
+			if (g_jobs[i].state == JOB_RUNNING)
+			{
+				jobs[job_count++] = &g_jobs[i];
+			}
+		}
+	}
+
+	for (; *token != NULL; token++)
+	{
+		struct job *job = find_job(*token);
+
+		if (job == NULL)
+		{
+			printf("wait: %s: no such job\n", *token);
+			status = 127;
+		}
+		else
+		{
+			jobs[job_count++] = job;
+		}
+	}
+
+	if (any)
+	{
+		status = (job_count > 0) ? wait_for_any_job(jobs, job_count, deadline) : 127;
+	}
+
+	for (i = 0; i < job_count && !any; i++)
+	{
+		status = wait_for_job_until(jobs[i], 0, deadline);
+
+		//Still running means the deadline passed or ^C, either ends the whole wait
+		if (jobs[i]->state == JOB_RUNNING)
+		{
+			break;
+		}
+
+		if (jobs[i]->state == JOB_DONE && named)
+		{
+			free_job(jobs[i]);
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: timeout ms command runs the command and signals every job it
+// starts with SIGTERM once ms milliseconds have passed, then with SIGKILL a
+// second later. Returns 124 if the command had to be stopped.
+//*****************************************************************************
+int builtin_timeout(char *input_buffer)
+{
+	const char *digits = input_buffer + strlen("timeout");
+	char *end;
+
+	digits += strspn(digits, " ");
+	long timeout = strtol(digits, &end, 10);
+	const char *command = end + strspn(end, " ");
+
+	if (!isdigit((unsigned char)*digits) || *end != ' ' || *command == '\0')
+	{
+		printf("Error: usage: timeout ms command\n");
+		return 2;
+	}
+
+	//A nested timeout can only make the deadline earlier
+	int64_t saved_deadline = g_command_deadline, deadline = now_msec() + timeout;
+	if (g_command_deadline == 0 || deadline < g_command_deadline)
+	{
+		g_command_deadline = deadline;
+	}
+
+	int status = run_external(arena_strdup(&g_line_arena, command));
+
+	g_command_deadline = saved_deadline;
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: on setting=value... command runs the command with the settings
+// on top of the session's: cpus=list|nodeN, nice=n, mem=size, files=n and
+// cputime=seconds, or =off to drop one. Every job the command starts gets
+// them, builtins the shell runs itself do not.
+//*****************************************************************************
+int builtin_on(char *input_buffer)
+{
+	struct launch_settings settings = (g_command_launch != NULL) ? *g_command_launch : g_launch_defaults;
+	char *word = input_buffer + strlen("on");
+
+	//Settings are the words with an =, the command starts at the first without one
+	while (1)
+	{
+		word += strspn(word, " ");
+		size_t length = strcspn(word, " ");
+
+		if (memchr(word, '=', length) == NULL)
+		{
+			break;
+		}
+
+		char saved = word[length];
+		word[length] = '\0';
+		int parsed = parse_launch_setting(word, &settings);
+		word[length] = saved;
+
+		if (parsed < 0)
+		{
+			return 2;
+		}
+
+		word += length;
+	}
+
+	if (*word == '\0')
+	{
+		printf("Error: usage: on setting=value... command\n");
+		return 2;
+	}
+
+	struct launch_settings *saved_launch = g_command_launch;
+	g_command_launch = &settings;
+
+	int status = run_external(arena_strdup(&g_line_arena, word));
+
+	g_command_launch = saved_launch;
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: Handles "set affinity cpus", where cpus is a list or nodeN,
+// "set affinity roundrobin [cpus]" and "set affinity off". Round robin puts
+// each background process on the core of cpus (by default every core the
+// shell may run on) with the fewest processes placed so far. Returns 1 if
+// the input was an affinity setting.
+//*****************************************************************************
+int set_affinity(const char *input_buffer)
+{
+	const char setting[] = "set affinity ";
+	const char *value = &input_buffer[strlen(setting)];
+	cpu_set_t cpus;
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	if (0 == strcmp(value, "off"))
+	{
+		g_round_robin = 0;
+		g_launch_defaults.set_cpus = 0;
+		verbose_print("VEBOSE: Jobs run on any cpu\n");
+		return 1;
+	}
+
+	if (0 == strncmp(value, "roundrobin", 10) && (value[10] == '\0' || value[10] == ' '))
+	{
+		const char *list = value + 10 + strspn(value + 10, " ");
+
+		if (*list == '\0' ? 0 != sched_getaffinity(0, sizeof(cpus), &cpus) : 0 != parse_cpus(list, &cpus))
+		{
+			printf("Error: bad cpu list \"%s\"\n", list);
+			return 1;
+		}
+
+		g_round_robin = 1;
+		g_round_robin_cpus = cpus;
+		g_next_cpu = 0;
+		g_launch_defaults.set_cpus = 0;
+		verbose_print("VEBOSE: Background jobs are placed on %d cpus in turn\n", CPU_COUNT(&cpus));
+		return 1;
+	}
+
+	if (0 != parse_cpus(value, &cpus))
+	{
+		printf("Error: bad cpu list \"%s\"\n", value);
+		return 1;
+	}
+
+	g_round_robin = 0;
+	g_launch_defaults.set_cpus = 1;
+	g_launch_defaults.cpus = cpus;
+	verbose_print("VEBOSE: Jobs run on %d cpus\n", CPU_COUNT(&cpus));
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Handles "set limits setting=value..." with the settings of on,
+// which every job then starts with, and "set limits off". Returns 1 if the
+// input was a limits setting.
+//*****************************************************************************
+int set_limits(const char *input_buffer)
+{
+	const char setting[] = "set limits ";
+	struct launch_settings settings = g_launch_defaults;
+	int i;
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	char words[strlen(input_buffer) + 1];
+	strcpy(words, &input_buffer[strlen(setting)]);
+
+	if (0 == strcmp(words, "off"))
+	{
+		g_launch_defaults.set_nice = 0;
+		for (i = 0; i < LAUNCH_LIMIT_COUNT; i++)
+		{
+			g_launch_defaults.limits[i] = -1;
+		}
+
+		verbose_print("VEBOSE: Jobs run with the shell's limits\n");
+		return 1;
+	}
+
+	//Nothing changes unless every setting is valid
+	char *word = strtok(words, " ");
+	while (word != NULL)
+	{
+		int parsed = parse_launch_setting(word, &settings);
+
+		if (parsed == 0)
+		{
+			printf("Error: usage: set limits setting=value...|off\n");
+		}
+		if (parsed <= 0)
+		{
+			return 1;
+		}
+
+		word = strtok(NULL, " ");
+	}
+
+	g_launch_defaults = settings;
+	verbose_print("VEBOSE: Launch limits set\n");
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Applies one key=value word of on or set limits to settings.
+// Returns 1 if it was applied, 0 if the word has no = and -1 after printing
+// an error.
+//*****************************************************************************
+int parse_launch_setting(const char *word, struct launch_settings *settings)
+{
+	const char *value = strchr(word, '=');
+	char *end;
+	int i;
+
+	if (value == NULL)
+	{
+		return 0;
+	}
+
+	int key_length = value++ - word;
+	int off = (0 == strcmp(value, "off"));
+
+	if (key_length == 4 && 0 == strncmp(word, "cpus", 4))
+	{
+		if (!off && 0 != parse_cpus(value, &settings->cpus))
+		{
+			printf("Error: bad cpu list \"%s\"\n", value);
+			return -1;
+		}
+
+		settings->set_cpus = !off;
+		return 1;
+	}
+
+	if (key_length == 4 && 0 == strncmp(word, "nice", 4))
+	{
+		long nice = strtol(value, &end, 10);
+
+		if (!off && (end == value || *end != '\0' || nice < -20 || nice > 19))
+		{
+			printf("Error: nice must be between -20 and 19\n");
+			return -1;
+		}
+
+		settings->set_nice = !off;
+		settings->nice = nice;
+		return 1;
+	}
+
+	for (i = 0; i < LAUNCH_LIMIT_COUNT; i++)
+	{
+		if (key_length != (int)strlen(g_limit_names[i]) || 0 != strncmp(word, g_limit_names[i], key_length))
+		{
+			continue;
+		}
+
+		long long amount = strtoll(value, &end, 10);
+
+		//Memory takes K, M, G and T suffixes
+		const char *suffix = (g_limit_resources[i] == RLIMIT_AS) ? strchr("KMGT", toupper((unsigned char)*end)) : NULL;
+		if (*end != '\0' && suffix != NULL)
+		{
+			amount <<= 10 * (suffix - "KMGT" + 1);
+			end++;
+		}
+
+		if (!off && (end == value || *end != '\0' || amount < 0))
+		{
+			printf("Error: bad %s limit \"%s\"\n", g_limit_names[i], value);
+			return -1;
+		}
+
+		settings->limits[i] = off ? -1 : amount;
+		return 1;
+	}
+
+	printf("Error: unknown launch setting \"%.*s\"\n", key_length, word);
+	return -1;
+}
+
+//*****************************************************************************
+// Abstract: Parses a cpu list such as 0-3,8 into cpus, or nodeN into the
+// cpus of NUMA node N. Returns 0 on success, -1 if the text is not a list
+// or names no cpu.
+//*****************************************************************************
+int parse_cpus(const char *text, cpu_set_t *cpus)
+{
+	char node_cpus[4096];
+	char *end;
+
+	if (0 == strncmp(text, "node", 4) && isdigit((unsigned char)text[4]))
+	{
+		char file_name[64];
+		long node = strtol(text + 4, &end, 10);
+
+		snprintf(file_name, sizeof(file_name), NUMA_NODE_PATH, (int)node);
+		int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+		ssize_t length = (fd >= 0 && *end == '\0') ? read(fd, node_cpus, sizeof(node_cpus) - 1) : -1;
+
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		if (length <= 0)
+		{
+			return -1;
+		}
+
+		node_cpus[length] = '\0';
+		node_cpus[strcspn(node_cpus, "\n")] = '\0';
+		text = node_cpus;
+	}
+
+	CPU_ZERO(cpus);
+
+	while (1)
+	{
+		long first = strtol(text, &end, 10), last = first;
+
+		if (!isdigit((unsigned char)*text))
+		{
+			return -1;
+		}
+
+		if (*end == '-')
+		{
+			text = end + 1;
+			last = strtol(text, &end, 10);
+			if (!isdigit((unsigned char)*text))
+			{
+				return -1;
+			}
+		}
+
+		if (first > last || last >= CPU_SETSIZE)
+		{
+			return -1;
+		}
+
+		for (; first <= last; first++)
+		{
+			CPU_SET(first, cpus);
+		}
+
+		if (*end != ',')
+		{
+			break;
+		}
+		text = end + 1;
+	}
+
+	return (*end == '\0' && CPU_COUNT(cpus) > 0) ? 0 : -1;
+}
+
+//*****************************************************************************
+// Abstract: Returns 1 if settings change nothing about how a job starts
+//*****************************************************************************
+int launch_settings_empty(const struct launch_settings *settings)
+{
+	int i;
+
+	for (i = 0; i < LAUNCH_LIMIT_COUNT; i++)
+	{
+		if (settings->limits[i] >= 0)
+		{
+			return 0;
+		}
+	}
+
+	return !settings->set_cpus && !settings->set_nice;
+}
+
+//*****************************************************************************
+// Abstract: Returns the core for the next background process: the round
+// robin cpu with the fewest live processes placed on it, taking the next in
+// turn on a tie, so cores come free again as jobs finish. Must be called with
+// SIGCHLD blocked.
+//*****************************************************************************
+int next_round_robin_cpu()
+{
+	int counts[CPU_SETSIZE];
+	int i, j, best = -1;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < g_job_count; i++)
+	{
+		for (j = 0; j < g_jobs[i].process_count && g_jobs[i].state != JOB_FREE; j++)
+		{
+			struct job_process *process = &g_jobs[i].processes[j];
+
+			if (process->cpu >= 0 && process->state != JOB_DONE)
+			{
+				counts[process->cpu]++;
+			}
+		}
+	}
+
+	for (i = 0; i < CPU_SETSIZE; i++)
+	{
+		int cpu = (g_next_cpu + i) % CPU_SETSIZE;
+
+		if (CPU_ISSET(cpu, &g_round_robin_cpus) && (best < 0 || counts[cpu] < counts[best]))
+		{
+			best = cpu;
+		}
+	}
+
+	g_next_cpu = best + 1;
+	return best;
+}
+
+//*****************************************************************************
+// Abstract: kill [-SIG] %n|pid ... sends a signal (TERM by default) to jobs
+// or processes. Stopped jobs are continued so they can act on it.
+//*****************************************************************************
+int builtin_kill(char *input_buffer)
+{
+	static const struct { const char *name; int number; } signals[] =
+	{
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+		{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+		{ "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+	};
+	char **argv = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	char **arg = &argv[1];
+	char *token = *arg;
+	int signal_number = SIGTERM, status = 0;
+	sigset_t old_mask;
+
+	//The optional signal, by number or by name with or without SIG
+	if (token != NULL && token[0] == '-')
+	{
+		const char *name = (0 == strncmp(&token[1], "SIG", 3)) ? &token[4] : &token[1];
+		size_t i;
+
+		signal_number = atoi(name);
+		for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+		{
+			if (0 == strcmp(name, signals[i].name))
+			{
+				signal_number = signals[i].number;
+			}
+		}
+
+		if (signal_number <= 0)
+		{
+			printf("kill: %s: invalid signal\n", token);
+			return 1;
+		}
+
+		token = *++arg;
+	}
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+
+	while (token != NULL)
+	{
+		if (token[0] == '%')
+		{
+			struct job *job = find_job(token);
+
+			if (job == NULL)
+			{
+				printf("kill: %s: no such job\n", token);
+				status = 1;
+			}
+			else
+			{
+				signal_job(job, signal_number);
+
+				if (job->state == JOB_STOPPED && signal_number != SIGSTOP && signal_number != SIGTSTP)
+				{
+					continue_job(job);
+				}
+			}
+		}
+		else
+		{
+			char *end;
+			long pid = strtol(token, &end, 10);
+
+			//0 or a negative pid would signal a whole group, the shell's own for 0
+			if (end == token || *end != '\0' || pid <= 0 || pid > INT_MAX)
+			{
+				printf("kill: %s: arguments must be process or job IDs\n", token);
+				status = 1;
+			}
+			else if (0 != kill((pid_t)pid, signal_number))
+			{
+				printf("kill: %s: %s\n", token, strerror(errno));
+				status = 1;
+			}
+		}
+
+		token = *++arg;
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: parallel [-j N] [-k] command args ::: items... runs the command
+// once per item with at most N children at a time. {} in the arguments is
+// replaced by the item, otherwise the item is added as the last argument.
+// Items can also come from a file with :::: file, or from stdin when no
+// source is given. Each child's output is held until it finishes and is
+// printed in one piece, in the order the children finish or in item order
+// with -k. Returns the number of failed children (at most 101), or 130 if
+// ^C stopped it.
+//*****************************************************************************
+int builtin_parallel(char *input_buffer)
+{
+	char **words = build_argv(arena_strdup(&g_line_arena, input_buffer));
+	char **arg = &words[1];
+	char *token = *arg;
+	char **template_args;
+	char **items = NULL;
+	size_t item_count = 0, item_capacity = 0, next_item = 0, next_output = 0, i;
+	long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int template_count = 0, keep_order = 0, active = 0, failed = 0, interrupted = 0;
+	const char *item_file = "-";
+
+	//Options come before the command
+	while (token != NULL && token[0] == '-')
+	{
+		if (0 == strncmp(token, "-j", 2))
+		{
+			const char *value = (token[2] != '\0') ? &token[2] : *++arg;
+			max_jobs = (value != NULL) ? atol(value) : 0;
+		}
+		else if (0 == strcmp(token, "-k"))
+		{
+			keep_order = 1;
+		}
+		else
+		{
+			printf("Error: parallel: unknown option %s\n", token);
+			return 1;
+		}
+
+		token = (*arg != NULL) ? *++arg : NULL;
+	}
+
+	if (max_jobs < 1)
+	{
+		max_jobs = 1;
+	}
+	if (max_jobs > MAX_PARALLEL_JOBS)
+	{
+		max_jobs = MAX_PARALLEL_JOBS;
+	}
+
+	template_args = arg;
+	while (token != NULL && 0 != strcmp(token, ":::") && 0 != strcmp(token, "::::"))
+	{
+		template_count++;
+		token = *++arg;
+	}
+
+	if (template_count == 0)
+	{
+		printf("Error: usage: parallel [-j N] [-k] command [args] ::: items\n");
+		return 1;
+	}
+
+	//Collect the items
+	if (token != NULL && 0 == strcmp(token, ":::"))
+	{
+		item_file = NULL;
+		while ((token = *++arg) != NULL)
+		{
+			if (item_count == item_capacity)
+			{
+				item_capacity = item_capacity ? item_capacity * 2 : 64;
+				items = (char**)realloc(items, item_capacity * sizeof(char*));
+			}
+			items[item_count++] = token;
+		}
+	}
+	else if (token != NULL)
+	{
+		item_file = *++arg;
+		if (item_file == NULL)
+		{
+			item_file = "-";
+		}
+	}
+
+	if (item_file != NULL)
+	{
+		struct line_reader reader;
+		char *line;
+
+		if (0 == strcmp(item_file, "-"))
+		{
+			line_reader_init(&reader, STDIN_FILENO);
+		}
+		else if (!line_reader_open(&reader, item_file))
+		{
+			printf("Error: parallel: cannot open %s\n", item_file);
+			return 1;
+		}
+
+		while ((line = read_line(&reader)) != NULL)
+		{
+			if (item_count == item_capacity)
+			{
+				item_capacity = item_capacity ? item_capacity * 2 : 64;
+				items = (char**)realloc(items, item_capacity * sizeof(char*));
+			}
+			items[item_count++] = arena_strdup(&g_line_arena, line);
+		}
+
+		line_reader_close(&reader);
+	}
+
+	char *path = find_command(template_args[0]);
+	if (path == NULL)
+	{
+		printf("Error: command \"%s\" not found\n", template_args[0]);
+		free(items);
+		return 127;
+	}
+
+	//The dispatch loop runs the event loop, whose PATH changes can free the hash's copy
+	path = arena_strdup(&g_line_arena, path);
+
+	struct parallel_task *tasks = (struct parallel_task*)calloc(item_count + 1, sizeof(struct parallel_task));
+	struct parallel_task *running[MAX_PARALLEL_JOBS];
+	struct pollfd fds[2 * MAX_PARALLEL_JOBS + 1];
+	struct parallel_task *fd_tasks[2 * MAX_PARALLEL_JOBS + 1];
+	int fd_streams[2 * MAX_PARALLEL_JOBS + 1];
+	sigset_t old_mask;
+
+	sigprocmask(SIG_BLOCK, &g_sigchld_mask, &old_mask);
+	fflush(stdout);
+
+	while (next_item < item_count || active > 0)
+	{
+		//Keep every worker slot busy
+		while (active < max_jobs && next_item < item_count)
+		{
+			struct parallel_task *task = &tasks[next_item];
+			char **argv = expand_parallel_template(template_args, template_count, items[next_item]);
+
+			next_item++;
+
+			if (0 != start_parallel_task(task, path, argv))
+			{
+				task->finished = 1;
+				task->status = 127;
+				failed++;
+				continue;
+			}
+
+			running[active++] = task;
+		}
+
+		if (active == 0)
+		{
+			break;
+		}
+
+		//Wait for output or for the event loop to have a child to reap
+		int fd_count = 1, j;
+		fds[0].fd = g_event_fd;
+		fds[0].events = POLLIN;
+
+		for (j = 0; j < active; j++)
+		{
+			int stream;
+			for (stream = 0; stream < 2; stream++)
+			{
+				if (running[j]->fds[stream] >= 0)
+				{
+					fds[fd_count].fd = running[j]->fds[stream];
+					fds[fd_count].events = POLLIN;
+					fd_tasks[fd_count] = running[j];
+					fd_streams[fd_count] = stream;
+					fd_count++;
+				}
+			}
+		}
+
+		poll(fds, fd_count, -1);
+
+		if (fds[0].revents != 0)
+		{
+			run_events(0);
+		}
+
+		//The workers have their own groups, so ^C reaches only the shell and stops the rest here
+		if (g_interrupted)
+		{
+			g_interrupted = 0;
+			interrupted = 1;
+			printf("\n");
+
+			signal_parallel_tasks(running, active, SIGINT);
+
+			//Their output is dropped, a second ^C kills workers that ignore the first
+			while (active > 0)
+			{
+				struct parallel_task *task = running[active - 1];
+				int stream;
+
+				for (stream = 0; stream < 2; stream++)
+				{
+					if (task->fds[stream] >= 0)
+					{
+						close(task->fds[stream]);
+						task->fds[stream] = -1;
+					}
+				}
+
+				if (task->job->state == JOB_RUNNING)
+				{
+					run_events(-1);
+
+					if (g_interrupted)
+					{
+						g_interrupted = 0;
+						signal_parallel_tasks(running, active, SIGKILL);
+					}
+					continue;
+				}
+
+				free_job(task->job);
+				task->job = NULL;
+				active--;
+			}
+
+			break;
+		}
+
+		for (j = 1; j < fd_count; j++)
+		{
+			if (fds[j].revents != 0)
+			{
+				read_parallel_output(fd_tasks[j], fd_streams[j]);
+			}
+		}
+
+		//A task is finished once its child is done and both pipes are drained
+		for (j = 0; j < active; j++)
+		{
+			struct parallel_task *task = running[j];
+
+			if (task->job->state != JOB_DONE || task->fds[0] >= 0 || task->fds[1] >= 0)
+			{
+				continue;
+			}
+
+			task->finished = 1;
+			task->status = task->job->status;
+			if (task->status != 0)
+			{
+				failed++;
+			}
+
+			free_job(task->job);
+			task->job = NULL;
+
+			running[j--] = running[--active];
+
+			if (!keep_order)
+			{
+				print_parallel_output(task);
+			}
+		}
+
+		//With -k output waits for every earlier item
+		while (keep_order && next_output < next_item && tasks[next_output].finished)
+		{
+			print_parallel_output(&tasks[next_output++]);
+		}
+	}
+
+	while (keep_order && !interrupted && next_output < item_count)
+	{
+		print_parallel_output(&tasks[next_output++]);
+	}
+
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	for (i = 0; i < item_count; i++)
+	{
+		free(tasks[i].output[0]);
+		free(tasks[i].output[1]);
+	}
+	free(tasks);
+	free(items);
+
+	if (interrupted)
+	{
+		return 128 + SIGINT;
+	}
+
+	return (failed > 100) ? 101 : failed;
+}
+
+//*****************************************************************************
+// Abstract: Returns the argv for one item: every {} in the template is
+// replaced by the item, or the item is added at the end if there is no {}
+//*****************************************************************************
+char** expand_parallel_template(char **template_args, int template_count, const char *item)
+{
+	char **argv = (char**)arena_alloc(&g_line_arena, (template_count + 2) * sizeof(char*));
+	size_t item_length = strlen(item);
+	int i, argc = 0, replaced = 0;
+
+	for (i = 0; i < template_count; i++)
+	{
+		const char *arg = template_args[i];
+		const char *marker = strstr(arg, "{}");
+
+		if (marker == NULL)
+		{
+			argv[argc++] = template_args[i];
+			continue;
+		}
+
+		//Count the markers to size the result
+		size_t markers = 0;
+		const char *scan;
+		for (scan = marker; scan != NULL; scan = strstr(scan + 2, "{}"))
+		{
+			markers++;
+		}
+
+		char *expanded = (char*)arena_alloc(&g_line_arena, strlen(arg) + markers * item_length + 1);
+		char *out = expanded;
+
+		while (marker != NULL)
+		{
+			memcpy(out, arg, marker - arg);
+			out += marker - arg;
+			memcpy(out, item, item_length);
+			out += item_length;
+			arg = marker + 2;
+			marker = strstr(arg, "{}");
+		}
+		strcpy(out, arg);
+
+		argv[argc++] = expanded;
+		replaced = 1;
+	}
+
+	if (!replaced)
+	{
+		argv[argc++] = (char*)item;
+	}
+
+	argv[argc] = NULL;
+	return argv;
+}
+
+//*****************************************************************************
+// Abstract: Starts the child for one task with its stdout and stderr going
+// to pipes the shell reads. At a terminal the child gets its own process
+// group, so ^C reaches the shell, which stops the whole run. Must be called
+// with SIGCHLD blocked. Returns 0 if the child was started.
+//*****************************************************************************
+int start_parallel_task(struct parallel_task *task, const char *path, char **argv)
+{
+	int out_pipe[2], err_pipe[2];
+
+	task->fds[0] = task->fds[1] = -1;
+
+	task->job = create_job(argv[0]);
+	if (task->job == NULL)
+	{
+		printf("Error: too many jobs\n");
+		return -1;
+	}
+
+	if (0 != pipe2(out_pipe, O_CLOEXEC))
+	{
+		perror("pipe");
+		free_job(task->job);
+		return -1;
+	}
+
+	if (0 != pipe2(err_pipe, O_CLOEXEC))
+	{
+		perror("pipe");
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		free_job(task->job);
+		return -1;
+	}
+
+	struct spawn_request request;
+	init_spawn_request(&request, path, argv);
+	request.redirections[0].fd = STDOUT_FILENO;
+	request.redirections[0].source_fd = out_pipe[1];
+	request.redirections[1].fd = STDERR_FILENO;
+	request.redirections[1].source_fd = err_pipe[1];
+	request.redirection_count = 2;
+	request.set_process_group = g_interactive;
+
+	pid_t child_pid = spawn_command(&request);
+
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+
+	if (child_pid < 0)
+	{
+		print_spawn_error(argv[0], errno);
+		close(out_pipe[0]);
+		close(err_pipe[0]);
+		free_job(task->job);
+		task->job = NULL;
+		return -1;
+	}
+
+	//Also done here in case the child has not got that far yet
+	if (request.set_process_group)
+	{
+		task->job->process_group = child_pid;
+		setpgid(child_pid, child_pid);
+	}
+
+	add_job_process(task->job, child_pid);
+	task->fds[0] = out_pipe[0];
+	task->fds[1] = err_pipe[0];
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Sends a signal to the running tasks. A task with its own process
+// group gets it as from the terminal, so whatever the worker started does
+// too. Must be called with SIGCHLD blocked.
+//*****************************************************************************
+void signal_parallel_tasks(struct parallel_task **tasks, int task_count, int signal_number)
+{
+	int i;
+
+	for (i = 0; i < task_count; i++)
+	{
+		struct job *job = tasks[i]->job;
+
+		//The worker is not reaped yet, so its group cannot have been reused
+		if (job->process_group != 0 && job->state == JOB_RUNNING)
+		{
+			kill(-job->process_group, signal_number);
+		}
+		else
+		{
+			signal_job(job, signal_number);
+		}
+	}
+}
+
+//*****************************************************************************
+// Abstract: Appends whatever is ready on one of the task's pipes to its
+// buffer, closing the pipe at end of file
+//*****************************************************************************
+void read_parallel_output(struct parallel_task *task, int stream)
+{
+	char data[OUTPUT_BUFFER_SIZE];
+	ssize_t length = read(task->fds[stream], data, sizeof(data));
+
+	if (length < 0 && errno == EINTR)
+	{
+		return;
+	}
+
+	if (length <= 0)
+	{
+		close(task->fds[stream]);
+		task->fds[stream] = -1;
+		return;
+	}
+
+	if (task->length[stream] + length > task->capacity[stream])
+	{
+		task->capacity[stream] = (task->capacity[stream] + length) * 2;
+		task->output[stream] = (char*)realloc(task->output[stream], task->capacity[stream]);
+	}
+
+	memcpy(&task->output[stream][task->length[stream]], data, length);
+	task->length[stream] += length;
+}
+
+//*****************************************************************************
+// Abstract: Prints everything a finished task wrote, stdout then stderr
+//*****************************************************************************
+void print_parallel_output(struct parallel_task *task)
+{
+	if (task->length[0] > 0)
+	{
+		fwrite(task->output[0], 1, task->length[0], stdout);
+		fflush(stdout);
+	}
+
+	if (task->length[1] > 0)
+	{
+		fwrite(task->output[1], 1, task->length[1], stderr);
+	}
+
+	free(task->output[0]);
+	free(task->output[1]);
+	task->output[0] = task->output[1] = NULL;
+	task->length[0] = task->length[1] = 0;
+}
+
+//*****************************************************************************
+// Abstract: Adds what wait4 reported for one process to usage
+//*****************************************************************************
+void add_rusage(struct resource_usage *usage, const struct rusage *rusage)
+{
+	usage->user_usec += rusage->ru_utime.tv_sec * 1000000LL + rusage->ru_utime.tv_usec;
+	usage->system_usec += rusage->ru_stime.tv_sec * 1000000LL + rusage->ru_stime.tv_usec;
+	usage->voluntary_switches += rusage->ru_nvcsw;
+	usage->involuntary_switches += rusage->ru_nivcsw;
+
+	if (rusage->ru_maxrss > usage->max_rss_kb)
+	{
+		usage->max_rss_kb = rusage->ru_maxrss;
+	}
+}
+
+//*****************************************************************************
+// Abstract: Keeps the usage of a finished job for time and times, and logs
+// it if set timelog is on
+//*****************************************************************************
+void record_job_usage(struct job *job)
+{
+	g_last_usage = job->usage;
+	g_finished_jobs++;
+
+	g_total_usage.wall_usec += job->usage.wall_usec;
+	g_total_usage.user_usec += job->usage.user_usec;
+	g_total_usage.system_usec += job->usage.system_usec;
+	g_total_usage.voluntary_switches += job->usage.voluntary_switches;
+	g_total_usage.involuntary_switches += job->usage.involuntary_switches;
+	if (job->usage.max_rss_kb > g_total_usage.max_rss_kb)
+	{
+		g_total_usage.max_rss_kb = job->usage.max_rss_kb;
+	}
+
+	if (g_time_log)
+	{
+		fprintf(stderr, "[time] status %d  real %.3fs  user %.3fs  sys %.3fs  maxrss %ld KB  csw %ld/%ld  %s\n",
+			job->status, job->usage.wall_usec / 1e6, job->usage.user_usec / 1e6,
+			job->usage.system_usec / 1e6, job->usage.max_rss_kb, job->usage.voluntary_switches,
+			job->usage.involuntary_switches, job->command);
+	}
+}
+
+//*****************************************************************************
+// Abstract: Prints usage in the layout of the time builtin
+//*****************************************************************************
+void print_usage(FILE *out, const struct resource_usage *usage)
+{
+	fprintf(out, "real\t%.3fs\n", usage->wall_usec / 1e6);
+	fprintf(out, "user\t%.3fs\n", usage->user_usec / 1e6);
+	fprintf(out, "sys\t%.3fs\n", usage->system_usec / 1e6);
+	fprintf(out, "maxrss\t%ld KB\n", usage->max_rss_kb);
+	fprintf(out, "csw\t%ld voluntary, %ld involuntary\n", usage->voluntary_switches,
+		usage->involuntary_switches);
+}
+
+//*****************************************************************************
+// Abstract: time command runs the command and prints its wall and CPU time,
+// max RSS and context switches to stderr. A builtin is measured with the
+// shell's own usage.
+//*****************************************************************************
+int builtin_time(char *input_buffer)
+{
+	const char *command = input_buffer + strlen("time");
+	struct resource_usage usage;
+	struct rusage before, after;
+	struct timespec start, end;
+	long finished_jobs = g_finished_jobs;
+	int status;
+
+	command += strspn(command, " ");
+	if (*command == '\0')
+	{
+		printf("Error: usage: time command\n");
+		return 1;
+	}
+
+	getrusage(RUSAGE_SELF, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	status = run_external(arena_strdup(&g_line_arena, command));
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &after);
+
+	if (g_finished_jobs != finished_jobs)
+	{
+		usage = g_last_usage;
+	}
+	else
+	{
+		//Nothing was started, so the time was spent in the shell
+		memset(&usage, 0, sizeof(usage));
+		usage.wall_usec = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+		usage.user_usec = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * 1000000LL
+			+ (after.ru_utime.tv_usec - before.ru_utime.tv_usec);
+		usage.system_usec = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000LL
+			+ (after.ru_stime.tv_usec - before.ru_stime.tv_usec);
+		usage.max_rss_kb = after.ru_maxrss;
+		usage.voluntary_switches = after.ru_nvcsw - before.ru_nvcsw;
+		usage.involuntary_switches = after.ru_nivcsw - before.ru_nivcsw;
+	}
+
+	fflush(stdout);
+	print_usage(stderr, &usage);
+
+	return status;
+}
+
+//*****************************************************************************
+// Abstract: times prints the CPU time of the shell and the totals of every
+// job that has finished
+//*****************************************************************************
+int builtin_times(char *input_buffer)
+{
+	struct rusage self;
+
+	getrusage(RUSAGE_SELF, &self);
+
+	printf("shell     user %9.3fs  sys %9.3fs  maxrss %7ld KB  csw %ld/%ld\n",
+		self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6, self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6,
+		self.ru_maxrss, self.ru_nvcsw, self.ru_nivcsw);
+	printf("children  user %9.3fs  sys %9.3fs  maxrss %7ld KB  csw %ld/%ld  real %.3fs in %ld jobs\n",
+		g_total_usage.user_usec / 1e6, g_total_usage.system_usec / 1e6, g_total_usage.max_rss_kb,
+		g_total_usage.voluntary_switches, g_total_usage.involuntary_switches,
+		g_total_usage.wall_usec / 1e6, g_finished_jobs);
+
+	return 0;
+}
+
+//*****************************************************************************
+// Abstract: Handles "set timelog on|off". Returns 1 if the input was a
+// timelog setting.
+//*****************************************************************************
+int set_time_log(const char *input_buffer)
+{
+	const char setting[] = "set timelog ";
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	g_time_log = (0 == strcmp(&input_buffer[strlen(setting)], "on"));
+	verbose_print("VEBOSE: Time log %s\n", g_time_log ? "enabled" : "disabled");
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Handles "set trace file" and "set trace off". Returns 1 if the
+// input was a trace setting.
+//*****************************************************************************
+int set_trace(const char *input_buffer)
+{
+	const char setting[] = "set trace ";
+	const char *value = &input_buffer[strlen(setting)];
+
+	if (0 != strncmp(input_buffer, setting, strlen(setting)))
+	{
+		return 0;
+	}
+
+	trace_close();
+
+	if (0 != strcmp(value, "off") && trace_open(value))
+	{
+		verbose_print("VEBOSE: Tracing to %s\n", value);
+	}
+
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Starts tracing to file_name in the Chrome trace event format.
+// Returns 1 if the file was opened.
+//*****************************************************************************
+int trace_open(const char *file_name)
+{
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+	{
+		printf("Error: cannot open \"%s\"\n", file_name);
+		return 0;
+	}
+
+	if (g_trace.events == NULL)
+	{
+		g_trace.events = (struct trace_event*)calloc(TRACE_RING_SIZE, sizeof(struct trace_event));
+		g_trace.out = (struct output_buffer*)malloc(sizeof(struct output_buffer));
+	}
+
+	g_trace.out->fd = fd;
+	g_trace.out->used = 0;
+	g_trace.dropped = 0;
+	buffer_write(g_trace.out, "[\n", 2);
+
+	g_tracing = 1;
+	return 1;
+}
+
+//*****************************************************************************
+// Abstract: Writes out the remaining events and closes the trace file
+//*****************************************************************************
+void trace_close()
+{
+	char end[128];
+
+	if (!g_tracing)
+	{
+		return;
+	}
+
+	trace_flush();
+	g_tracing = 0;
+
+	//The last event has no comma after it, so the file is valid JSON
+	int length = snprintf(end, sizeof(end),
+		"{\"name\":\"dropped\",\"ph\":\"i\",\"ts\":%llu,\"pid\":%d,\"tid\":%d,\"s\":\"g\",\"args\":{\"events\":%llu}}\n]\n",
+		(unsigned long long)trace_now(), (int)getpid(), (int)getpid(), (unsigned long long)g_trace.dropped);
+	buffer_write(g_trace.out, end, length);
+	buffer_flush(g_trace.out);
+
+	close(g_trace.out->fd);
+	g_trace.out->fd = -1;
+}
+
+//*****************************************************************************
+// Abstract: Returns the monotonic clock in microseconds
+//*****************************************************************************
+uint64_t trace_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//*****************************************************************************
+// Abstract: Adds an event to the ring. A slot is claimed with a single
+// compare and swap and published by storing its sequence number, so a
+// signal handler can record events while the shell is in the middle of
+// one. Events are dropped rather than waiting when the ring is full.
+//*****************************************************************************
+void trace_record(const char *stage, char phase, uint64_t start, const char *detail, int pid, int status)
+{
+	uint64_t slot = __atomic_load_n(&g_trace.head, __ATOMIC_RELAXED);
+
+	do
+	{
+		if (slot - __atomic_load_n(&g_trace.tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+		{
+			__atomic_fetch_add(&g_trace.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	while (!__atomic_compare_exchange_n(&g_trace.head, &slot, slot + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	struct trace_event *event = &g_trace.events[slot & (TRACE_RING_SIZE - 1)];
+
+	event->timestamp = start;
+	event->duration = (phase == 'X') ? trace_now() - start : 0;
+	event->stage = stage;
+	event->phase = phase;
+	event->pid = pid;
+	event->status = status;
+	event->detail[0] = '\0';
+	if (detail != NULL)
+	{
+		strncpy(event->detail, detail, TRACE_DETAIL_SIZE - 1);
+		event->detail[TRACE_DETAIL_SIZE - 1] = '\0';
+	}
+
+	__atomic_store_n(&event->sequence, slot + 1, __ATOMIC_RELEASE);
+}
+
+//*****************************************************************************
+// Abstract: Records a complete event for a stage that began at start, and
+// writes the ring out once it is three quarters full. Only called from the
+// main loop, never from a signal handler.
+//*****************************************************************************
+void trace_complete(const char *stage, uint64_t start, const char *detail, int pid)
+{
+	trace_record(stage, 'X', start, detail, pid, 0);
+
+	if (g_trace.head - g_trace.tail >= TRACE_RING_SIZE * 3 / 4)
+	{
+		trace_flush();
+	}
+}
+
+//*****************************************************************************
+// Abstract: Formats every published event as Chrome trace JSON and writes
+// it to the trace file
+//*****************************************************************************
+void trace_flush()
+{
+	int shell_pid = (int)getpid();
+	char line[256];
+
+	while (g_trace.tail != __atomic_load_n(&g_trace.head, __ATOMIC_ACQUIRE))
+	{
+		struct trace_event *event = &g_trace.events[g_trace.tail & (TRACE_RING_SIZE - 1)];
+
+		//Stop at an event that is still being written
+		if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != g_trace.tail + 1)
+		{
+			break;
+		}
+
+		int length = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,", event->stage, event->stage,
+			event->phase, (unsigned long long)event->timestamp);
+
+		if (event->phase == 'X')
+		{
+			length += snprintf(&line[length], sizeof(line) - length, "\"dur\":%llu,",
+				(unsigned long long)event->duration);
+		}
+		else
+		{
+			length += snprintf(&line[length], sizeof(line) - length, "\"s\":\"t\",");
+		}
 
-			printf("Script done, output file is %s\n", script_file_name); //write to console
-			fflush(stdout);
+		length += snprintf(&line[length], sizeof(line) - length,
+			"\"pid\":%d,\"tid\":%d,\"args\":{\"pid\":%d,\"status\":%d,\"detail\":", shell_pid, shell_pid,
+			event->pid, event->status);
 
-			free(script_file_name);
-        }
+		buffer_write(g_trace.out, line, length);
+		trace_write_string(g_trace.out, event->detail);
+		buffer_write(g_trace.out, "}},\n", 4);
 
-        if (running_script)
-        {
-        	printf("%s\n", args); //print the stdin to the file
-        	fflush(stdout);
-        }
+		__atomic_store_n(&g_trace.tail, g_trace.tail + 1, __ATOMIC_RELEASE);
+	}
 
-		//if input is script _filename_
-		if (0 == regexec(&script_regex, input_buffer, 0, NULL, 0) && 0 != strcmp(input_buffer, "endscript"))
-		{
-			script_file_name = (char*)malloc(sizeof(char));
+	buffer_flush(g_trace.out);
+}
 
-			char *input_copy2 = (char*)malloc(sizeof(char));
-			strcpy(input_copy2, input_buffer);
+//*****************************************************************************
+// Abstract: Writes string as a quoted JSON string
+//*****************************************************************************
+void trace_write_string(struct output_buffer *out, const char *string)
+{
+	char escape[8];
 
-			char *file_name = strtok(input_copy2, space_delimiter);
-			file_name = strtok(NULL, space_delimiter);
-			if (file_name == NULL)
-			{
-				strcpy(script_file_name, "typescript");
-			}
-			else
-			{
-				strcpy(script_file_name, file_name);
-			}
-			
-			printf("Script started, output file is %s\n", script_file_name); //write to console
-			fflush(stdout);
-			
-			start_script = 1;
-			running_script = 1;
+	buffer_write(out, "\"", 1);
 
-			switch_stdout_to_file(0);
+	while (*string != '\0')
+	{
+		size_t plain = strcspn(string, "\"\\\n\r\t\b\f\x01\x02\x03\x04\x05\x06\x07\x0b\x0e\x0f\x10\x11\x12"
+			"\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f");
 
-			printf("Script started, output file is %s\n", script_file_name); //write to file
-			fflush(stdout);
+		buffer_write(out, string, plain);
+		string += plain;
 
-			free(input_copy2);
+		if (*string != '\0')
+		{
+			int length = snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*string);
+			buffer_write(out, escape, length);
+			string++;
 		}
+	}
 
-    	//Check if the agument matches the history regex ex !# or !!
-    	if (0 == regexec(&history_command_regex, input_copy, 0, NULL, 0) && start_script == 0)
-    	{
-    		int history_id;
-    		char *cpy = (char*)malloc(sizeof(char));
-    		strcpy(cpy, input_buffer);
-    		char *cpy_token = strtok(cpy, space_delimiter);
-    		
-    		//If the second parameter is a "!"
-    		if (0 == strcmp(&cpy_token[1], "!"))
-    		{
-    			//get previous history #
-    			history_id = history_num - 1;
-    		}
-    		else
-    		{
-    			//get input history number
-    			history_id = atoi(&cpy_token[1]);    			
-    		}
-    		
-    		//Replace the input with the history command
-    		input_buffer = get_history_command(prev_commands, history_id);
-    		strcpy(input_copy, input_buffer);
-    	}
-        
-        char *token = strtok(input_copy, space_delimiter);
+	buffer_write(out, "\"", 1);
+}
 
-        //If input is alias, save off the alias command
-        if (token != NULL && 0 == strcmp(&token[0], "alias") && start_script == 0)
-        {
-        	//if the input is more than "alias"
-        	if ((int)strlen(input_buffer) > 5)
-        	{
-	        	save_alias(input_buffer);
+//*****************************************************************************
+// Abstract: Removes the redirection operators and their files from the NULL
+// terminated argv and stores them in order. operators flags the tokens that
+// are operators and is compacted along with argv. Understands <, >, >>,
+// N<, N>, N>>, N>&M, &> and >&file. Returns the number of redirections, or
+// -1 after printing an error.
+//*****************************************************************************
+int parse_redirections(char **argv, unsigned char *operators, struct file_redirection *redirections, int max_redirections)
+{
+	int count = 0, in = 0, out = 0;
 
-				//Add alias to history list
-		    	struct previous_commands *current_command = (struct previous_commands*)malloc(sizeof(struct previous_commands));
-		        current_command->string = (char*)malloc(sizeof(char));
-		        strcpy(current_command->string, input_buffer);
-		        current_command->index = history_num;
-		        history_num++;
-		        add_to_history(current_command, prev_commands);
-			}
-			//Else the user wants to print the aliases
-			else
-			{
-	        	print_aliases();
-			}
+	while (argv[in] != NULL)
+	{
+		char *token = argv[in];
+		char *operator = token;
+		int fd = -1, both = 0;
 
-	        token = NULL; //set to NULL to prevent further processing
-        }
+		if (!operators[in] || strpbrk(token, "<>") == NULL)
+		{
+			operators[out] = operators[in];
+			argv[out++] = argv[in++];
+			continue;
+		}
+		in++;
 
-        if (token != NULL && start_script == 0 && 0 != strcmp(input_buffer, "endscript"))
-        {
-			char *replaced_with_alias = (char*)malloc(sizeof(char));
+		while (isdigit((unsigned char)*operator))
+		{
+			operator++;
+		}
 
-			//Check the input to see if we need to replace anything with the aliased commands
-			strcpy(replaced_with_alias, replace_alias(input_buffer));
+		if (operator != token)
+		{
+			fd = atoi(token);
+		}
+		else if (*operator == '&')
+		{
+			both = 1;
+			operator++;
+		}
 
-			//If we replaced a command
-			if (strcmp(replaced_with_alias, input_copy) != 0)
-			{	
-				//Set the token to the new replaced buffer
-				token = strtok(replaced_with_alias, space_delimiter);
-			}
+		if (count + 2 > max_redirections)
+		{
+			printf("Error: too many redirections\n");
+			return -1;
 		}
 
-        if (token != NULL && (int)strlen(token) > 0 && *token != '\n' 
-        	&& start_script == 0 && 0 != strcmp(input_buffer, "endscript"))
-        {
-        	//If the input is history
-	        if (0 == strcmp(input_copy, "history"))
-	        {
-	        	//Add history to history list
-	        	struct previous_commands *current_command = (struct previous_commands*)malloc(sizeof(struct previous_commands));
-		        current_command->string = (char*)malloc(sizeof(char));
-		        strcpy(current_command->string, "history");
-		        current_command->index = history_num;
-		        history_num++;
-		        add_to_history(current_command, prev_commands);
-
-	        	print_history(prev_commands);
-	        }
-			else
-			{
-				//Add current command to history list
-		        struct previous_commands *current_command = (struct previous_commands*)malloc(sizeof(struct previous_commands));
-		        current_command->string = (char*)malloc(sizeof(char));
-		        strcpy(current_command->string, input_copy);
-		        current_command->index = history_num;
-		        history_num++;
-		        add_to_history(current_command, prev_commands);
+		struct file_redirection *redirection = &redirections[count++];
 
-	        	command = &token[0];
+		if (*operator == '<')
+		{
+			redirection->fd = (fd >= 0) ? fd : STDIN_FILENO;
+			redirection->flags = O_RDONLY;
+			operator++;
+		}
+		else if (operator[1] == '>')
+		{
+			redirection->fd = (fd >= 0) ? fd : STDOUT_FILENO;
+			redirection->flags = O_WRONLY | O_CREAT | O_APPEND;
+			operator += 2;
+		}
+		else
+		{
+			redirection->fd = (fd >= 0) ? fd : STDOUT_FILENO;
+			redirection->flags = O_WRONLY | O_CREAT | O_TRUNC;
+			operator++;
+		}
 
-	        	//If the input is exit, exit the program
-	        	if (0 == strcmp(command, "exit"))
-	        	{
-	        		//cleanup memory here
-	        		if (alias_curr && alias_curr != alias_head) free(alias_curr);
-	        		if (alias_head) free(alias_head);
-	        		if (parameter_list) free(parameter_list);
-	        		if (current_parameter) free(current_parameter);
-	        		if (input_copy) free(input_copy);
-
-	        		int cmd_indx;
-					for(cmd_indx = 0; cmd_indx < MAX_HISTORY; cmd_indx++)
-					{
-						if (prev_commands[cmd_indx]) free(prev_commands[cmd_indx]);
-						if (prev_commands[cmd_indx]->string) free(prev_commands[cmd_indx]->string);
-					}
+		//N>&M duplicates a descriptor of the child instead of opening a file
+		if (*operator == '&' && isdigit((unsigned char)operator[1]))
+		{
+			redirection->path = NULL;
+			redirection->source_fd = atoi(&operator[1]);
+			continue;
+		}
 
-	        	    exit(1);
-	        	}
-
-		       	token = strtok(NULL, space_delimiter);
-		       	struct parameters * working_parameter = (struct parameters*)malloc(sizeof(struct parameters));
-
-		       	//Grab the first parameter to the command if it exist
-		       	if (token != NULL)
-		       	{
-					working_parameter->parameter = &token[0];
-					parameter_list->head = working_parameter;
-					parameter_list->length = 1;
-					current_parameter = working_parameter; 
-		       	}
-		       	else
-		       	{
-					parameter_list->length = 0;		       		
-		       	} 		
-
-				//Grab the additional parameters
-		       	token = strtok(NULL, space_delimiter);
-		        while (token != NULL)
-		        {
-		        	struct parameters * loop_parameter = (struct parameters*)malloc(sizeof(struct parameters));
-		        	loop_parameter->parameter = &token[0];
-		        	current_parameter->next = loop_parameter; 
-		        	current_parameter = loop_parameter;
-		        	parameter_list->length++;
-
-		        	token = strtok(NULL, space_delimiter);
-		        }
-		        
-		        //Point the current parameter to the newly head
-		        if (parameter_list->length > 0)
-		        {
-			        current_parameter = parameter_list->head;
-		        }
-
-		        //Check if the run in background command was set
-				run_in_background = is_run_is_background_set(args);
-
-				//Create the parameter list with the number of parameters plus 2 for the command and NULL
-				//This is used as the input to execvp
-				char *params[parameter_list->length + 2];
-
-				//Set the first parameter to the command for execvp
-				params[0] = command;
-
-				//Fill out the param array using the current parameter list
-				int param_index;
-				for (param_index = 1; param_index < (parameter_list->length + 1); param_index++)
-				{
-					params[param_index] = current_parameter->parameter;
-					current_parameter = current_parameter->next;
-				}
+		//>&file is the same as &>file
+		if (*operator == '&')
+		{
+			if (fd >= 0)
+			{
+				printf("Error: missing descriptor after %s\n", token);
+				return -1;
+			}
+			both = 1;
+		}
 
-				//Default the last parameter to NULL for execvp
-				params[parameter_list->length + 1] = NULL;
+		if (argv[in] == NULL || operators[in])
+		{
+			printf("Error: missing file name after %s\n", token);
+			return -1;
+		}
 
-				//If the last parameter is a &, remove the character for execvp
-				if (*params[parameter_list->length] == '&')
-				{
-					params[parameter_list->length] = 0;
-				}
+		redirection->path = argv[in++];
+		redirection->source_fd = -1;
 
-				//If we have a command
-				if (command[0] > 0)
-				{
-		    		verbose_print("VEBOSE: Searching PATH: \"%s\" for command \"%s\"\n", getenv("PATH"), command);
-
-				    pid_t child_pid = fork();
-
-				    //Run the child process
-				    if (0 == child_pid)
-				    {
-				    	//Run the command with the parameters
-					  	if (0 != execvp(command, params))
-					  	{
-					  		printf("Error: command \"%s\" not found\n", command);
-					  		exit(1);
-					  	}
-				    }
-				    //Run the parent process
-				    else
-				    {
-				      if (run_in_background == 0)
-				      {
-						waitpid(child_pid, &child_status, 0);
-				      }
-				    }
-				 }
-			}
+		if (both)
+		{
+			redirections[count].fd = STDERR_FILENO;
+			redirections[count].path = NULL;
+			redirections[count].source_fd = STDOUT_FILENO;
+			count++;
 		}
-    }
-   
-	return 0;
+	}
+
+	argv[out] = NULL;
+	return count;
 }
 
 //*****************************************************************************
-// Abstract: adds the input item  to the input queue using the queue
-// like a circular buffer.
+// Abstract: copy [src] [dst] also written copy < src > dst (or >> dst)
+// copies a file without starting a process. Data is moved in the kernel
+// when possible. Without a source it reads stdin and without a destination
+// it writes to stdout, so redirections work as for any other command.
 //*****************************************************************************
-void add_to_history(struct previous_commands *item, struct previous_commands *queue[MAX_HISTORY])
+int builtin_copy(char *input_buffer)
 {
-	//If head and tail are not initialized, set them to zero
-	if (head == -1 && tail == -1)
-	{
-		head++;
-		tail++;
-	}
-	else
+	char **argv = build_argv(input_buffer);
+	int in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO, status;
+
+	if (argv[1] != NULL)
 	{
-		//If either the head or the tail are at the end of the queue
-		if ((tail == (MAX_HISTORY - 1)) || (head == (MAX_HISTORY - 1)))
+		in_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (in_fd < 0)
 		{
-			//if tail is already at the end of the array
-			if (tail == (MAX_HISTORY - 1))
-			{
-				//set tail to first index
-				tail = 0;
-
-				//move head over one
-				head++;
-			}
-
-			//if head is at the end of the array
-			if (head == (MAX_HISTORY - 1))
-			{
-				//set head to fist index
-				head = 0;
-
-				//move tail over one
-				tail++;
-			}
+			printf("Error: cannot open %s: %s\n", argv[1], strerror(errno));
+			return 1;
 		}
-		else
-		{
-			tail++;
 
-			if (head == tail)
+		if (argv[2] != NULL)
+		{
+			out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			if (out_fd < 0)
 			{
-				head++;
+				printf("Error: cannot open %s: %s\n", argv[2], strerror(errno));
+				close(in_fd);
+				return 1;
 			}
 		}
 	}
 
-	strcpy(queue[tail]->string, item->string);
-	queue[tail]->index = item->index;
+	fflush(stdout);
+	status = copy_fd(in_fd, out_fd);
+
+	if (in_fd != STDIN_FILENO)
+	{
+		close(in_fd);
+	}
+	if (out_fd != STDOUT_FILENO)
+	{
+		close(out_fd);
+	}
+
+	return status;
 }
 
 //*****************************************************************************
-// Abstract: Prints the commands from the input previous commands array
-// in order using the globals head and tail
+// Abstract: Copies everything from in_fd to out_fd with copy_file_range,
+// falling back to sendfile and then to read and write when the kernel or
+// the file types do not allow it. Returns 0 on success.
 //*****************************************************************************
-void print_history(struct previous_commands *prev_commands[MAX_HISTORY])
+int copy_fd(int in_fd, int out_fd)
 {
-	//Start at the tail
-	int current = tail;
-	
-	while(current != head)
-	{	
-		if (prev_commands[current]->index != 0) 
+	char data[OUTPUT_BUFFER_SIZE];
+	ssize_t length;
+
+	//While a script runs, descriptor 1 is read by the shell itself and the data must go
+	//through the stdout stream, which has no descriptor then
+	int use_stream = (out_fd == STDOUT_FILENO && fileno(stdout) < 0);
+
+	if (!use_stream)
+	{
+		while ((length = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0);
+
+		if (length == 0)
 		{
-			printf("%d %s\n", prev_commands[current]->index, prev_commands[current]->string);
+			return 0;
 		}
 
-		if ((current - 1) == head)
+		//Whatever was copied has moved both offsets, so the next method carries on from there
+		if (errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP)
 		{
-			printf("%d %s\n", prev_commands[current - 1]->index, prev_commands[current - 1]->string);
+			perror("copy");
+			return 1;
 		}
 
-		if (current == 0)
+		while ((length = sendfile(out_fd, in_fd, NULL, 1 << 30)) > 0);
+
+		if (length == 0)
 		{
-			current = MAX_HISTORY - 1;
+			return 0;
 		}
-		else
+
+		if (errno != EINVAL && errno != ENOSYS)
+		{
+			perror("copy");
+			return 1;
+		}
+	}
+
+	while ((length = read(in_fd, data, sizeof(data))) > 0)
+	{
+		if (use_stream)
 		{
-			current--;
+			fwrite(data, 1, length, stdout);
 		}
+		else if (0 != write_all(out_fd, data, length))
+		{
+			perror("copy");
+			return 1;
+		}
+	}
+
+	if (length < 0)
+	{
+		perror("copy");
+		return 1;
 	}
+
+	fflush(stdout);
+	return 0;
 }
 
 //*****************************************************************************
-// Abstract: Returns the string that matches the input history ID number.
-// If nothing matches, NULL is returned.
+// Abstract: cd [dir] changes the shell's directory. With no argument it goes
+// to HOME and with - to the previous directory.
 //*****************************************************************************
-char* get_history_command(struct previous_commands *prev_commands[MAX_HISTORY], int id)
+int builtin_cd(char *input_buffer)
 {
-	char *return_val = (char*)malloc(sizeof(char));
+	char **argv = build_argv(input_buffer);
+	const char *dir = argv[1];
+	int print_dir = 0;
 
-	int i;
-	for (i = 0; i < MAX_HISTORY; i++)
+	if (dir == NULL)
+	{
+		dir = getenv("HOME");
+		if (dir == NULL)
+		{
+			printf("Error: cd: HOME not set\n");
+			return 1;
+		}
+	}
+	else if (0 == strcmp(dir, "-"))
 	{
-		if (prev_commands[i]->index == id)
+		dir = getenv("OLDPWD");
+		if (dir == NULL)
 		{
-			printf("%s\n", prev_commands[i]->string);
-			strcpy(return_val, prev_commands[i]->string);
+			printf("Error: cd: OLDPWD not set\n");
+			return 1;
 		}
+		print_dir = 1;
 	}
 
-	return return_val;
+	char *old_dir = getcwd(NULL, 0);
+
+	if (0 != chdir(dir))
+	{
+		printf("Error: cd: %s: %s\n", dir, strerror(errno));
+		free(old_dir);
+		return 1;
+	}
+
+	if (old_dir != NULL)
+	{
+		setenv("OLDPWD", old_dir, 1);
+		free(old_dir);
+	}
+
+	char *new_dir = getcwd(NULL, 0);
+	if (new_dir != NULL)
+	{
+		setenv("PWD", new_dir, 1);
+		if (print_dir)
+		{
+			printf("%s\n", new_dir);
+		}
+		free(new_dir);
+	}
+
+	//Commands found through a relative PATH entry are somewhere else now
+	const char *path = getenv("PATH");
+	while (path != NULL)
+	{
+		if (*path != '/')
+		{
+			clear_command_hash();
+			break;
+		}
+
+		path = strchr(path, ':');
+		if (path != NULL)
+		{
+			path++;
+		}
+	}
+
+	return 0;
 }
 
 //*****************************************************************************
-// Abstract: Removes the new line from the input buffer
+// Abstract: pwd prints the shell's directory
 //*****************************************************************************
-char *remove_newline(char *input_buffer)
+int builtin_pwd(char *input_buffer)
 {
-	int length = strlen(input_buffer);
+	char *dir = getcwd(NULL, 0);
 
-	if (length > 0 && input_buffer[length - 1] == '\n')
+	if (dir == NULL)
 	{
-		input_buffer[length - 1] = '\0';
+		perror("pwd");
+		return 1;
 	}
 
-	return input_buffer;
+	printf("%s\n", dir);
+	free(dir);
+
+	return 0;
 }
 
 //*****************************************************************************
-// Abstract: Returns true is the input has a & and false if not
+// Abstract: echo [-n] [words] prints the words separated by spaces, with a
+// newline unless -n is given
 //*****************************************************************************
-int is_run_is_background_set(char *input_buffer)
+int builtin_echo(char *input_buffer)
 {
-	int i, run_in_background = 0;
-	for (i = BUFFER_LENGTH; i > 0; i--)
+	char **argv = build_argv(input_buffer);
+	int i = 1;
+
+	if (argv[1] != NULL && 0 == strcmp(argv[1], "-n"))
+	{
+		i = 2;
+	}
+
+	for (; argv[i] != NULL; i++)
 	{
-		if (input_buffer[i] == '&')
+		fputs(argv[i], stdout);
+		if (argv[i + 1] != NULL)
 		{
-			run_in_background = 1;
-			break;
+			putchar(' ');
 		}
 	}
-	
-	return run_in_background;
+
+	if (argv[1] == NULL || 0 != strcmp(argv[1], "-n"))
+	{
+		putchar('\n');
+	}
+
+	return 0;
 }
 
 //*****************************************************************************
-// Abstract: Saves the alias and the aliased command in the input
+// Abstract: true does nothing, successfully
 //*****************************************************************************
-void save_alias(char *input_buffer)
+int builtin_true(char *input_buffer)
 {
-	char *temp_input = (char*)malloc(sizeof(char));
-	char *temp_input2 = (char*)malloc(sizeof(char));
-	
-	strcpy(temp_input, input_buffer);	
-	strcpy(temp_input2, input_buffer);
-	
-	const char space_delimiter[2] = " ";
-	const char quote_delimiter[2] = "\"";
-	
-	char *alias_cmd = (char*)malloc(sizeof(char));
-
-	char *token = strtok(temp_input, space_delimiter); //reads alias
-	token = strtok(NULL, space_delimiter); //reads aliased string
-    
-	char *alias_string = (char*)malloc(sizeof(char));
-    strcpy(alias_string, token);
-
-    //if we have a string to alias
-    if (token != NULL)
-    {
-		token = strtok(temp_input2, quote_delimiter);
-		token = strtok(NULL, quote_delimiter);
-
-	    if (token != NULL)
-	    {
-	    	strcpy(alias_cmd, token);
-
-	    	struct alias_command *new_alias = (struct alias_command*)malloc(sizeof(struct alias_command));
-	    	new_alias->string = (char*)malloc(sizeof(char));
-	    	new_alias->command = (char*)malloc(sizeof(char));
-	    	strcpy(new_alias->string, alias_string);
-	    	strcpy(new_alias->command, alias_cmd);
-	    	new_alias->next = NULL;
-
-	    	//If this is the first alias, point the head and curr to the new alias
-	    	if (alias_head == NULL)
-	    	{
-	    		alias_head = alias_curr = new_alias;
-	    	}
-	    	//Else point the curr->next to the new alias and point curr to new alias
-	    	else
-	    	{
-	    		alias_curr->next = new_alias;
-	    		alias_curr = new_alias;
-	    	}
-	    }
-    }
+	return 0;
 }
 
 //*****************************************************************************
-// Abstract: Prints all of the saved aliases
+// Abstract: false does nothing, unsuccessfully
 //*****************************************************************************
-void print_aliases()
+int builtin_false(char *input_buffer)
 {
-    struct alias_command *test = alias_head;
-    while(test != NULL)
-    {
-    	printf("alias %s=\'%s\'\n", test->string, test->command);
-    	test = test->next;
-    }
-    fflush(stdout);
+	return 1;
 }
 
 //*****************************************************************************
-// Abstract: Searches for commands in the input buffer that match an aliases.
-// Then returns the a new char* with the replaced alias.
+// Abstract: export NAME=value ... sets environment variables for the shell
+// and every command it starts. With no arguments the environment is printed.
 //*****************************************************************************
-char* replace_alias(char *input_buffer)
+int builtin_export(char *input_buffer)
 {
-	const char space_delimiter[2] = " ";
+	extern char **environ;
+	char **argv = build_argv(input_buffer);
+	int status = 0, i;
 
-	//Set up working copies
-	char *return_val = (char*)malloc(sizeof(char));
-	strcpy(return_val, input_buffer);
-	char *temp_input = (char*)malloc(sizeof(char));
-	strcpy(temp_input, input_buffer);
-	
-	//Get first command from the input
-	char *token = strtok(temp_input, space_delimiter);
+	if (argv[1] == NULL)
+	{
+		char **variable;
+		for (variable = environ; *variable != NULL; variable++)
+		{
+			printf("export %s\n", *variable);
+		}
+		return 0;
+	}
 
-    struct alias_command *test = alias_head;
-    while(test != NULL)
-    {
-    	//If first command matches current alias string
-    	if (0 == strcmp(token, test->string))
-    	{
-    		return_val = test->command;
-    		strncpy(return_val, test->command, strlen(test->command));
-
-    		char *full_command = (char*)malloc(sizeof(char));
-
-    		//Add the aliased command to the full_command array
-    		int i;
-    		for (i = 0; i < strlen(test->command); i++)
-    		{
-    			full_command[i] = test->command[i];
-    		}
-    		
-    		//Add the remaining parameters to the full_command array
-    		int j, k;
-    		for(j = (int)strlen(test->string), k = (int)strlen(test->command); 
-    			j < (int)strlen(input_buffer); j++, k++)
-    		{
-    			//printf("input_buffer[%d] = %c\n", j, input_buffer[j]);
-    			full_command[k] = input_buffer[j];
-    		}
-
-    		full_command[k + 1] = '\0';
-
-    		strcpy(return_val, full_command);
-
-    		break;
-    	}
-    	test = test->next;
-    }
+	for (i = 1; argv[i] != NULL; i++)
+	{
+		char *equals = strchr(argv[i], '=');
+		char *name = argv[i];
+
+		//Everything the shell has set is already in the environment
+		if (equals == NULL)
+		{
+			continue;
+		}
+
+		*equals = '\0';
+
+		int valid = (isalpha((unsigned char)name[0]) || name[0] == '_');
+		while (valid && *++name != '\0')
+		{
+			valid = (isalnum((unsigned char)*name) || *name == '_');
+		}
+
+		if (!valid)
+		{
+			printf("Error: export: invalid name \"%s\"\n", argv[i]);
+			status = 1;
+			continue;
+		}
+
+		setenv(argv[i], equals + 1, 1);
+
+		if (0 == strcmp(argv[i], "PATH"))
+		{
+			clear_command_hash();
+		}
+	}
 
-    return return_val;
+	return status;
 }
 
 //*****************************************************************************
-// Abstract: Redirects stdout to file
+// Abstract: test expr, also written [ expr ], exits 0 when the expression is
+// true, 1 when it is false and 2 when it cannot be evaluated. Handles one
+// string, unary file and string tests, string and integer comparisons and
+// a leading !.
 //*****************************************************************************
-void switch_stdout_to_file(int append_to_file)
+int builtin_test(char *input_buffer)
 {
-	fflush(stdout);
-	fgetpos(stdout, &pos);
-	fd = dup(fileno(stdout));
-	
-	if (append_to_file)
+	char **argv = build_argv(input_buffer);
+	int count = 0, negate = 0;
+
+	while (argv[count] != NULL)
 	{
-		freopen(script_file_name, "a", stdout);
+		count++;
 	}
-	else
+
+	if (0 == strcmp(argv[0], "["))
 	{
-		freopen(script_file_name, "w", stdout);
+		if (0 != strcmp(argv[count - 1], "]"))
+		{
+			printf("Error: [: missing ]\n");
+			return 2;
+		}
+		argv[--count] = NULL;
 	}
-}
 
-//*****************************************************************************
-// Abstract: Redirects stdout back to terminal
-//*****************************************************************************
-void switch_stdout_to_terminal()
-{
-	fflush(stdout);
-	dup2(fd, fileno(stdout));
-	close(fd);
-	clearerr(stdout);
-	fgetpos(stdout, &pos);
+	char **args = &argv[1];
+	count--;
+
+	if (count > 0 && 0 == strcmp(args[0], "!"))
+	{
+		negate = 1;
+		args++;
+		count--;
+	}
+
+	int result = evaluate_test(args, count);
+	if (result < 0)
+	{
+		return 2;
+	}
+
+	return (result != negate) ? 0 : 1;
 }
 
 //*****************************************************************************
-// Abstract: Prints verbose data to stdout if the verbose global is set
+// Abstract: Evaluates the count words of a test expression. Returns 1 for
+// true, 0 for false and -1 after printing an error.
 //*****************************************************************************
-void verbose_print(const char* string, ...)
+int evaluate_test(char **args, int count)
 {
-	va_list args;
-	va_start(args, string);
+	struct stat file_stat;
 
-	if (verbose)
+	if (count == 0)
 	{
-		if (NULL != script_file_name)
-		{
-			switch_stdout_to_terminal();
-		}
+		return 0;
+	}
+
+	if (count == 1)
+	{
+		return args[0][0] != '\0';
+	}
 
-		vfprintf(stdout, string, args);
+	if (count == 2 && args[0][0] == '-' && args[0][1] != '\0' && args[0][2] == '\0')
+	{
+		const char *operand = args[1];
 
-		if (NULL != script_file_name)
+		switch (args[0][1])
 		{
-			switch_stdout_to_file(1);
+			case 'n': return operand[0] != '\0';
+			case 'z': return operand[0] == '\0';
+			case 'e': return 0 == stat(operand, &file_stat);
+			case 'f': return 0 == stat(operand, &file_stat) && S_ISREG(file_stat.st_mode);
+			case 'd': return 0 == stat(operand, &file_stat) && S_ISDIR(file_stat.st_mode);
+			case 's': return 0 == stat(operand, &file_stat) && file_stat.st_size > 0;
+			case 'L': return 0 == lstat(operand, &file_stat) && S_ISLNK(file_stat.st_mode);
+			case 'r': return 0 == access(operand, R_OK);
+			case 'w': return 0 == access(operand, W_OK);
+			case 'x': return 0 == access(operand, X_OK);
 		}
 	}
-}
 
-void load_init_file()
-{
-	FILE *init_file;
-	char init_file_name[] = ".cs543rc";
-	char line[80];
-	char *line_copy = (char*)malloc(sizeof(char));
-
-	init_file = fopen(init_file_name, "r");
-
-	if (init_file != NULL)
+	if (count == 3)
 	{
-		printf(".cs543rc loaded\n");
+		const char *operator = args[1];
 
-		while( fgets(line, 80, init_file) != NULL )
+		if (0 == strcmp(operator, "=") || 0 == strcmp(operator, "=="))
 		{
-			strcpy(line_copy, line);
-
-			char *token = strtok(line_copy, " ");
-
-        	//If input is alias, save off the alias command
-        	if (token != NULL && 0 == strcmp(&token[0], "alias"))
-			{
-				//if the input is more than "alias"
-	        	if ((int)strlen(line) > 5)
-	        	{
-		        	save_alias(line);
-				}
-			}
-
-			set_path(line);
+			return 0 == strcmp(args[0], args[2]);
 		}
 
-		fclose(init_file);
-	}
-}
+		if (0 == strcmp(operator, "!="))
+		{
+			return 0 != strcmp(args[0], args[2]);
+		}
 
-int set_path(const char *input_buffer)
-{
-	int return_val = 0;
+		static const char *integer_operators[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+		int i;
 
-	if (0 == regexec(&g_path_regex, input_buffer, 0, NULL, 0))
-	{
-		char *cpy = (char*)malloc(sizeof(char));
-		strcpy(cpy, input_buffer);
-		char *new_path = strtok(cpy, "("); //returns "set path = "
-		if (new_path != NULL)
+		for (i = 0; i < 6; i++)
 		{
-			new_path = strtok(NULL, "(");
-			if (new_path != NULL)
+			if (0 == strcmp(operator, integer_operators[i]))
 			{
-				new_path = strtok(new_path, ")");
-				int tmp_index;
-				for(tmp_index = 0; tmp_index < strlen(new_path); tmp_index++)
+				char *left_end, *right_end;
+				long left = strtol(args[0], &left_end, 10);
+				long right = strtol(args[2], &right_end, 10);
+
+				if (args[0][0] == '\0' || *left_end != '\0' || args[2][0] == '\0' || *right_end != '\0')
 				{
-	    			if (new_path[tmp_index] == ' ')
-	    			{
-	    				new_path[tmp_index] = ':';
-	    			}
+					printf("Error: test: integer expected\n");
+					return -1;
 				}
 
-				setenv("PATH", new_path, 1);
-				return_val = 1;
+				switch (i)
+				{
+					case 0: return left == right;
+					case 1: return left != right;
+					case 2: return left < right;
+					case 3: return left <= right;
+					case 4: return left > right;
+					default: return left >= right;
+				}
 			}
 		}
-
-        free(cpy);
 	}
 
-	return return_val;
-}
\ No newline at end of file
+	printf("Error: test: cannot evaluate \"%s\"\n", args[count > 1 ? 1 : 0]);
+	return -1;
+}